@@ -4,9 +4,14 @@
 #include <assert.h>
 #include <iostream>
 #include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "globals.h"
 #include "cache.h"
 #include "logger.h"
+#include "stackdist.h"
 
 #define bits(x, i, l) (((x) >> (i)) & bitmask(l))
 
@@ -45,315 +50,141 @@ const std::string state2str (const uint8_t line_state)
     return std::string(strbuf);
 }
 
-void
-Cache :: line_mark_in_parent(Addr addr, uint8_t line_state_req, size_t &latency)
+static const char *repl_policy_names[REPL_NUM_POLICIES] = {
+    "lru", "plru", "srrip", "brrip", "dip", "random"
+};
+
+const char *
+repl_policy2str(const ReplPolicy policy)
 {
-    Line *line = addr2line_internal(addr);
-    uint8_t *data;
-    if (line) {
-        this->line_get(addr, line_state_req, latency, data);
-    } else {
-        this->_parent->line_get_intercache(addr, line_state_req, latency, this->_index_in_parent, line);
-    }
+    assert(policy < REPL_NUM_POLICIES);
+    return repl_policy_names[policy];
 }
 
-void
-Cache :: line_get(Addr addr, uint8_t line_state_req, size_t &latency, uint8_t *&pdata)
+bool
+str2repl_policy(const char *name, ReplPolicy &policy)
 {
-    //////////////////////////////////////////////////////////////////
-    //
-    //  proudly serving cache requests
-    //  since september 2008
-    //
-    //////////////////////////////////////////////////////////////////
-    //
-    // line_state_req(uest) values:
-    // LINE_SHR - request a read
-    // LINE_EXC - request an exclusive access (invalidate other readers)
-    // LINE_MOD - perform a write (invalidate other readers and mark line as dirty)
-
-    bool set_overflow = false;
-    Line *overflow_line = NULL;
-    // this adds a line (if it's not already in the cache) but with LINE_INV state
-    Line *line = addr2line(addr, set_overflow, overflow_line);
-    // if some line has been replaced, get the value and evict/invalidate the same line and its parts
-    // in all child caches
-    if (set_overflow) {
-        NVLOG1("%s\tline_get overflow 0x%lx\n", _name.c_str(), overflow_line->addr);
-        this->line_evict(overflow_line);
+    for (int i=0; i<REPL_NUM_POLICIES; i++) {
+        if (strcasecmp(name, repl_policy_names[i]) == 0) {
+            policy = (ReplPolicy)i;
+            return true;
+        }
     }
-    uint8_t __attribute__((unused)) line_state_orig = line->state;
-    uint64_t __attribute__((unused)) line_sharers_orig = line->sharers;
+    return false;
+}
 
-    bool hit = true;
-    size_t old_ticks = latency;
+static const char *sharer_format_names[SHARERS_NUM_FORMATS] = {
+    "bitmap", "coarse", "limited"
+};
 
-    if (line->state & LINE_MOD)
-    {
-        switch (line_state_req) {
-            case LINE_MOD:
-            case LINE_EXC:
-            case LINE_SHR:
-                break;
-            default:
-                assert(!"invalid line_state request!");
-        }
-    }
-    else if (line->state & LINE_EXC)
-    { // line is EXCLUSIVE when it is not modified and there is no other line sharer
-        // TODO update the functionality to reflect this;
-        // first line sharer should automatically get exclusive access;
-        // this exclusive access should be reduced to shared when another core requests line copy (for read)
-        switch (line_state_req) {
-            case LINE_MOD:
-                if (_is_writeback_cache || !_parent_cache) {
-                    // mark line as dirty (for writeback)
-                    line->state |= line_state_req;
-                } else {
-                    // write latency should include writing to the parent
-                    _parent->line_get_intercache(addr, line_state_req, latency, _index_in_parent, line->parent_line);
-                    // TODO should also write data to the parent cache
-                    hit = false;
-                    break;
-                }
-            case LINE_EXC:
-            case LINE_SHR:
-                break;
-            default:
-                assert(!"invalid line_state request!");
-        }
-    }
-    else if (line->state & LINE_SHR)
-    {
-        switch (line_state_req) {
-            case LINE_MOD:
-            case LINE_EXC:
-                if (_parent_cache) {
-                    if (_is_writeback_cache) {
-                        _parent->line_get_intercache(addr, LINE_EXC, latency, _index_in_parent, line->parent_line);
-                    } else {
-                        _parent->line_get_intercache(addr, line_state_req, latency, _index_in_parent, line->parent_line);
-                    }
-                    hit = false;
-                }
-                line->state |= line_state_req;
-                break;
-            case LINE_SHR:
-                break;
-            default:
-                assert(!"invalid line_state request!");
-        }
-    }
-    else if (line->state == LINE_INV)
-    {
-        hit = false;
-        switch (line_state_req) {
-            case LINE_TXW:
-            case LINE_TXR:
-                _parent->line_get_intercache(addr, LINE_SHR, latency, _index_in_parent, line->parent_line);
-                line->state |= line->parent_line->state & ( LINE_TXR | LINE_TXW);
-                line->state |= (LINE_SHR | line_state_req);
-                break;
-            case LINE_MOD:
-            case LINE_EXC:
-                if (_is_writeback_cache) {
-                    _parent->line_get_intercache(addr, LINE_EXC, latency, _index_in_parent, line->parent_line);
-                } else {
-                    _parent->line_get_intercache(addr, line_state_req, latency, _index_in_parent, line->parent_line);
-                }
-                line->state |= line_state_req;
-                break;
-            case LINE_SHR:
-                _parent->line_get_intercache(addr, LINE_SHR, latency, _index_in_parent, line->parent_line);
-                line->state |= line_state_req;
-                break;
-            default:
-                assert(!"invalid line_state request!");
+const char *
+sharer_format2str(const SharerFormat format)
+{
+    assert(format < SHARERS_NUM_FORMATS);
+    return sharer_format_names[format];
+}
+
+bool
+str2sharer_format(const char *name, SharerFormat &format)
+{
+    for (int i=0; i<SHARERS_NUM_FORMATS; i++) {
+        if (strcasecmp(name, sharer_format_names[i]) == 0) {
+            format = (SharerFormat)i;
+            return true;
         }
     }
-    else
-    {
-        NVLOG_ERROR("invalid current line_state %x\n", line->state);
-        assert(false && "invalid current line_state!");
-    }
+    return false;
+}
+
+static const char *inclusion_names[INCLUSION_NUM_POLICIES] = {
+    "inclusive", "nine", "exclusive"
+};
 
+const char *
+inclusion2str(const InclusionPolicy inclusion)
+{
+    assert(inclusion < INCLUSION_NUM_POLICIES);
+    return inclusion_names[inclusion];
+}
 
-    if (line->pdata == NULL) {
-        line->pdata = (uint8_t*)malloc(get_line_size());
-        if (_parent_cache && line->parent_line) { // if data found in parent cache
-            NVLOG1("%s\tline_get data copy from %s 0x%lx data 0x%lx -> 0x%lx\n", this->_name.c_str(), _parent_cache->_name.c_str(), line->addr, (Addr)line->parent_line->pdata, (Addr)line->pdata);
-            memcpy(line->pdata, line->parent_line->pdata+(line->addr - line->parent_line->addr), get_line_size());
-        } else {
-            // get the data from the memory
-            NVLOG1("%s\tline_get data copy from memory 0x%lx data -> 0x%lx\n", this->_name.c_str(), line->addr, (Addr)line->pdata);
-	    //Fault fault = rw_array_silent(line->addr, get_line_size(), line->pdata, false/*READ*/);
-	    //assert(fault == NoFault);
+bool
+str2inclusion(const char *name, InclusionPolicy &inclusion)
+{
+    for (int i=0; i<INCLUSION_NUM_POLICIES; i++) {
+        if (strcasecmp(name, inclusion_names[i]) == 0) {
+            inclusion = (InclusionPolicy)i;
+            return true;
         }
     }
-    pdata = line->pdata;
-
-    latency += _hit_latency;
-    // update statistics
-    if (hit) {
-        this->stats.hits_inc();
-    } else {
-        this->stats.misses_inc();
-        if (line_state_req & LINE_MOD || line_state_req & LINE_EXC)
-        { this->stats.misses_st_inc(); }
-        else
-        { this->stats.misses_ld_inc(); }
-    }
-    this->stats.ticks_inc(latency - old_ticks);
-    NVLOG1("%s\tline_get 0x%lx\t state %s->%s sharers 0x%lx->0x%lx\n",  _name.c_str(),  line->addr,  state2str(line_state_orig).c_str(), state2str(line->state).c_str(), line_sharers_orig, line->sharers);
-    assert(! ((line->state & (LINE_MOD | LINE_EXC)) && (line->state & LINE_TXW)) );
+    return false;
 }
 
 void
-Cache :: line_get_intercache(Addr addr, uint8_t line_state_req, size_t &latency, unsigned child_index, Line *&parent_line)
+SharerDirectory :: configure(SharerFormat format, size_t num_children)
 {
-    //////////////////////////////////////////////////////////////////////
-    // serving line relocations inside the cache hierarchy
-    //////////////////////////////////////////////////////////////////////
+    this->format = format;
+    this->num_children = num_children;
+    num_words = 1;
+    group_bits = 0;
+    switch (format) {
+        case SHARERS_BITMAP:
+            num_words = MAX2(ceil(num_children, (size_t)64) / 64, (size_t)1);
+            break;
+        case SHARERS_COARSE:
+            while ((64UL << group_bits) < num_children) group_bits++;
+            break;
+        case SHARERS_LIMITED_PTR:
+            assert(num_children < (1UL << SHARER_POINTER_BITS));
+            break;
+        default:
+            assert(false && "invalid sharer format");
+    }
+}
 
-    bool set_overflow = false;
-    Line *overflow_line = NULL;
-    // this adds a line (if it's not already in the cache) but with LINE_INV state
-    Line *line = addr2line(addr, set_overflow, overflow_line);
-    if (set_overflow) {
-        // if some line has been replaced, get the value and invalidate the same line and its parts
-        // in all child caches
-        NVLOG1("%s\tline_get overflow 0x%lx\n", _name.c_str(), overflow_line->addr);
-        this->line_evict(overflow_line);
+void
+Cache :: line_mark_in_parent(Addr addr, uint8_t line_state_req, size_t &latency)
+{
+    Line *line = addr2line_internal(addr);
+    uint8_t *data;
+    if (line) {
+        this->line_get(addr, line_state_req, latency, data);
+    } else {
+        this->_parent->line_get_intercache(addr, line_state_req, latency, this->_index_in_parent, line);
     }
-    uint8_t __attribute__((unused)) line_state_orig = line->state;
-    uint64_t __attribute__((unused)) line_sharers_orig = line->sharers;
+}
 
-    bool hit = true;
-    size_t old_ticks = latency;
+void
+Cache :: line_get(const Addr addr, const uint8_t line_state_req, size_t &latency, uint8_t *&pdata)
+{
+    ParentMemory parent(_parent);
+    this->line_get_from(parent, addr, line_state_req, latency, pdata);
+}
 
-    if (line->state & (LINE_MOD | LINE_EXC))
-    {
-        // this directory already owns a line (exclusively)
-        // just in case we'll invalidate the line in
-        // all other child-caches
-        switch (line_state_req) {
-            case LINE_MOD:
-                if (line->sharers != (1ULL<<child_index)) {
-                    this->line_make_owner_in_child_caches(line, child_index);
-                    setbit(line->sharers, child_index);
-                }
-                if (_is_writeback_cache || !_parent_cache) {
-                    line->state |= line_state_req;
-                } else {
-                    _parent->line_get_intercache(addr, line_state_req, latency, _index_in_parent, line->parent_line);
-                    hit = false;
-                    break;
-                }
-                break;
-            case LINE_EXC:
-                // this processor wants to have an exclusive copy
-                // (and it didn't have it until now, as we got an intercache request)
-                if (line->sharers != (1ULL<<child_index)) {
-                    this->line_make_owner_in_child_caches(line, child_index);
-                    setbit(line->sharers, child_index);
-                }
-                break;
-            case LINE_SHR:
-                if (line->sharers != (1ULL<<child_index)) {
-                    this->line_writer_to_sharer(line, latency);
-                    // and do not write the data up in the memory hierarchy
-                    setbit(line->sharers, child_index);
-                }
-                break;
-            default:
-                assert(!"invalid line_state request!");
-        }
-        //assert(line_state_req == LINE_SHR || line_state_req == LINE_EXC || line_state_req == LINE_MOD);
-        line->state |= line_state_req; // we might also reduce from writer to LINE_SHR in this cache
-    }
-    else if (line->state & LINE_SHR)
-    {
-        switch (line_state_req) {
-            case LINE_MOD:
-            case LINE_EXC:
-                this->line_make_owner_in_child_caches(line, child_index);
-                setbit(line->sharers, child_index);
-                if (_parent_cache) {
-                    if (_is_writeback_cache) {
-                        _parent->line_get_intercache(addr, LINE_EXC, latency, _index_in_parent, line->parent_line);
-                    } else {
-                        _parent->line_get_intercache(addr, line_state_req, latency, _index_in_parent, line->parent_line);
-                    }
-                    hit = false;
-                }
-                line->state |= line_state_req;
-                break;
-            case LINE_SHR:
-                setbit(line->sharers, child_index);
-                break;
-            default:
-                assert(!"invalid line_state request!");
-        }
+void
+Cache :: access_batch(const Access *refs, const size_t n, BatchResult &out)
+{
+    uint8_t *pdata;
+    const size_t misses_orig = this->stats.misses;
+    // the sets of the first references are requested before any of them is simulated, and
+    // from then on every access prefetches the sets of the one ACCESS_BATCH_LOOKAHEAD later
+    for (size_t i=0; i<MIN2(n, ACCESS_BATCH_LOOKAHEAD); i++) {
+        this->prefetch_sets(refs[i].addr);
     }
-    else if (line->state == LINE_INV)
-    {
-        hit = false;
-        switch (line_state_req) {
-            case LINE_MOD:
-            case LINE_EXC:
-                if (_is_writeback_cache) {
-                    _parent->line_get_intercache(addr, LINE_EXC, latency, _index_in_parent, line->parent_line);
-                } else {
-                    _parent->line_get_intercache(addr, line_state_req, latency, _index_in_parent, line->parent_line);
-                }
-                if (line->parent_line) { line->state = line->parent_line->state; }
-                line->state |= line_state_req;
-                setbit(line->sharers, child_index);
-                break;
-            case LINE_SHR:
-                _parent->line_get_intercache(addr, LINE_SHR, latency, _index_in_parent, line->parent_line);
-                if (line->parent_line) { line->state = line->parent_line->state; }
-                line->state |= line_state_req;
-                setbit(line->sharers, child_index);
-                break;
-            default:
-                assert(!"invalid line_state request!");
+    for (size_t i=0; i<n; i++) {
+        if (i + ACCESS_BATCH_LOOKAHEAD < n) {
+            this->prefetch_sets(refs[i + ACCESS_BATCH_LOOKAHEAD].addr);
         }
+        this->line_get(refs[i].addr, (uint8_t)refs[i].line_state, out.latency, pdata);
     }
-    else
-    {
-        NVLOG_ERROR("invalid current line_state %x\n", line->state);
-        assert(false && "invalid current line_state!");
-    }
-
-    if (line->pdata == NULL) {
-        line->pdata = (uint8_t*)malloc(get_line_size());
-        if (_parent_cache && line->parent_line) { // if data found in any parent cache
-            NVLOG1("%s\tline_get data copy from %s 0x%lx data 0x%lx -> 0x%lx\n", this->_name.c_str(), _parent_cache->_name.c_str(), line->addr, (Addr)line->parent_line->pdata, (Addr)line->pdata);
-            memcpy(line->pdata, line->parent_line->pdata+(line->addr - line->parent_line->addr), get_line_size());
-        } else {
-            // get the data from the memory
-            NVLOG1("%s\tline_get data copy from memory 0x%lx data 0x%lx\n", this->_name.c_str(), line->addr, (Addr)line->pdata);
-//            Fault fault = rw_array_silent(line->addr, get_line_size(), line->pdata, false/*READ*/);
-//            assert(fault == NoFault);
-        }
-    }
-    parent_line = line;
+    out.accesses += n;
+    out.hits += n - (this->stats.misses - misses_orig);
+}
 
-    latency += _hit_latency;
-    // update statistics
-    if (hit) {
-        this->stats.hits_inc();
-    } else {
-        this->stats.misses_inc();
-        if (line_state_req & LINE_MOD || line_state_req & LINE_EXC)
-        { this->stats.misses_st_inc(); }
-        else
-        { this->stats.misses_ld_inc(); }
-    }
-    this->stats.ticks_inc(latency - old_ticks);
-    NVLOG1("%s\tline_get 0x%lx\t state %s->%s sharers 0x%lx->0x%lx\n",  _name.c_str(),  line->addr,  state2str(line_state_orig).c_str(), state2str(line->state).c_str(), line_sharers_orig, line->sharers);
-    assert(! ((line->state & (LINE_MOD | LINE_EXC)) && (line->state & LINE_TXW)) );
+void
+Cache :: line_get_intercache(const Addr addr, const uint8_t line_state_req, size_t &latency, const unsigned child_index, Line *&parent_line)
+{
+    ParentMemory parent(_parent);
+    this->line_get_intercache_from(parent, addr, line_state_req, latency, child_index, parent_line);
 }
 
 bool
@@ -363,24 +194,20 @@ Cache :: line_make_owner_in_child_caches(Line *line, unsigned child_index)
     uint8_t __attribute__((unused)) line_state_orig = line->state;
     uint64_t __attribute__((unused)) line_sharers_orig = line->sharers;
     // evict the line in all but the requesting child cache
-    for (size_t child_i = 0; child_i<_children.size() && line->sharers>0; child_i++) {
-        Cache *child = dynamic_cast<Cache *>(_children[child_i]); assert(child!=NULL);
-        // NVLOG1("%s\tchecking for 0x%lx %lx 1\n", child->_name.c_str(), line->addr, line->sharers);
-        if (!bit(line->sharers, child_i)) continue; // a child is not a sharer, so continue
-        // NVLOG1("%s\tchecking for 0x%lx %lx 2\n", child->_name.c_str(), line->addr, line->sharers);
-        if (child_i == child_index) continue; // skip the child cache that called us
-        // NVLOG1("%s\tchecking for 0x%lx %lx 3\n", child->_name.c_str(), line->addr, line->sharers);
-        for (Addr line_addr_iter=line->addr; line_addr_iter<line->addr+get_line_size(); line_addr_iter += child->get_line_size())
-        {
-            NVLOG1("%s\tis line sharer, checking segment 0x%lx\n", child->_name.c_str(), line_addr_iter);
-            Line *child_line = child->addr2line_internal(line_addr_iter);
-            if (!child_line) continue;
-            NVLOG1("%s\thas segment 0x%lx, evicting\n", child->_name.c_str(), line_addr_iter);
-            child->line_evict(child_line);
+    SharerIter sharers = _sharers.iter(line->sharers, this->sharers_ext(line), child_index);
+    for (size_t child_i; sharers.next(child_i); ) {
+        Cache *child = _children.child(child_i);
+        // only the sub-blocks a child has fetched can be in it
+        for (uint64_t blocks = line->child_subblocks; blocks; blocks &= blocks-1) {
+            const Addr block_addr = this->subblock_addr(line, blocks);
+            for (Addr line_addr_iter=block_addr; line_addr_iter<block_addr+this->subblock_bytes(); line_addr_iter += child->_line_size_bytes)
+            {
+                NVLOG1("%s\tis line sharer, evicting segment 0x%lx\n", child->_name.c_str(), line_addr_iter);
+                child->line_evict(line_addr_iter);
+            }
         }
     }
-    line->sharers = 0;
-    setbit(line->sharers, child_index);
+    _sharers.set_only(line->sharers, this->sharers_ext(line), child_index);
     NVLOG1("%s\tline 0x%lx\t state %s->%s sharers 0x%lx->0x%lx\n",  _name.c_str(),  line->addr,  state2str(line_state_orig).c_str(), state2str(line->state).c_str(), line_sharers_orig, line->sharers);
     return true;
 }
@@ -389,8 +216,19 @@ void
 Cache :: line_writer_to_sharer(const Addr addr, size_t &latency, bool children_only)
 {
     Line *line = addr2line_internal(addr);
-    if (line==NULL) return;
-    this->line_writer_to_sharer(line, latency, children_only);
+    if (line) {
+        this->line_writer_to_sharer(line, latency, children_only);
+        return;
+    }
+    // a non-inclusive cache can miss lines that its children have
+    if (_inclusion == INCLUSION_INCLUSIVE) return;
+    const Addr line_addr = floor(addr, _line_size_bytes);
+    for (size_t child_i=0; child_i<_children.size(); child_i++) {
+        Cache *child = _children.child(child_i);
+        for (Addr line_addr_iter=line_addr; line_addr_iter<line_addr+_line_size_bytes; line_addr_iter += child->_line_size_bytes) {
+            child->line_writer_to_sharer(line_addr_iter, latency);
+        }
+    }
 }
 
 void
@@ -401,20 +239,20 @@ Cache :: line_writer_to_sharer(Line *line, size_t &latency, bool children_only)
     NVLOG1("%s\tline_writer_to_sharer 0x%lx +%ld cycles\n", this->_name.c_str(), line->addr, _hit_latency);
     latency += _hit_latency;
     this->stats.writebacks_inc();
-    for (size_t child_i = 0; child_i<_children.size(); child_i++) {
-        if (!bit(line->sharers, child_i)) continue; // a child is not a sharer, so continue
-        Cache *child = dynamic_cast<Cache *>(_children[child_i]); assert(child!=NULL);
-        for (Addr line_addr_iter=line->addr; line_addr_iter<line->addr+get_line_size(); line_addr_iter += child->get_line_size())
-        {
-            if (line_addr_iter!=line->addr) {
-                // also measure the latency for other line segments
-                NVLOG1("%s\tline_writer_to_sharer 0x%lx +%ld cycles\n", this->_name.c_str(), line_addr_iter, _hit_latency);
-                latency += _hit_latency;  // response from child to parent
-                this->stats.writebacks_inc();
+    SharerIter sharers = _sharers.iter(line->sharers, this->sharers_ext(line));
+    for (size_t child_i; sharers.next(child_i); ) {
+        Cache *child = _children.child(child_i);
+        // also measure the latency for other line segments (a response from the child to the parent)
+        const size_t segments = _line_size_bytes / child->_line_size_bytes;
+        NVLOG1("%s\tline_writer_to_sharer 0x%lx +%ld cycles for %ld more segments\n", this->_name.c_str(), line->addr, _hit_latency, segments-1);
+        latency += (segments-1)*_hit_latency;
+        this->stats.writebacks_inc(segments-1);
+        for (uint64_t blocks = line->child_subblocks; blocks; blocks &= blocks-1) {
+            const Addr block_addr = this->subblock_addr(line, blocks);
+            for (Addr line_addr_iter=block_addr; line_addr_iter<block_addr+this->subblock_bytes(); line_addr_iter += child->_line_size_bytes)
+            {
+                child->line_writer_to_sharer(line_addr_iter, latency);
             }
-            Line *child_line = child->addr2line_internal(line_addr_iter);
-            if (!child_line) continue;
-            child->line_writer_to_sharer(child_line, latency);
         }
     }
     if (!children_only) {
@@ -437,13 +275,27 @@ void
 Cache :: line_rm_recursive(Addr addr)
 {
     Line *line = addr2line_internal(addr);
-    if (line==NULL) return;
+    if (line==NULL) {
+        // a non-inclusive cache can miss lines that its children have
+        if (_inclusion == INCLUSION_INCLUSIVE) return;
+        const Addr line_addr = floor(addr, _line_size_bytes);
+        for (size_t child_i=0; child_i<_children.size(); child_i++) {
+            Cache *child = _children.child(child_i);
+            for (Addr line_addr_iter=line_addr; line_addr_iter<line_addr+_line_size_bytes; line_addr_iter += child->_line_size_bytes) {
+                child->line_rm_recursive(line_addr_iter);
+            }
+        }
+        return;
+    }
     NVLOG1("%s\tline_rm_recursive addr 0x%lx\n", this->_name.c_str(), addr);
-    for (size_t child_i = 0; child_i<_children.size() && line->sharers>0; child_i++) {
-        if (!bit(line->sharers, child_i)) continue; // a child is not a sharer, so continue
-        Cache *child = dynamic_cast<Cache *>(_children[child_i]); assert(child!=NULL);
-        for (Addr line_addr_iter=line->addr; line_addr_iter<line->addr+get_line_size(); line_addr_iter += child->get_line_size()) {
-            child->line_rm_recursive(line_addr_iter);
+    SharerIter sharers = _sharers.iter(line->sharers, this->sharers_ext(line));
+    for (size_t child_i; sharers.next(child_i); ) {
+        Cache *child = _children.child(child_i);
+        for (uint64_t blocks = line->child_subblocks; blocks; blocks &= blocks-1) {
+            const Addr block_addr = this->subblock_addr(line, blocks);
+            for (Addr line_addr_iter=block_addr; line_addr_iter<block_addr+this->subblock_bytes(); line_addr_iter += child->_line_size_bytes) {
+                child->line_rm_recursive(line_addr_iter);
+            }
         }
     }
 #ifdef HAS_HTM
@@ -461,24 +313,152 @@ void
 Cache :: line_evict(Addr addr)
 {
     Line *line = addr2line_internal(addr);
-    if (line==NULL) return;
-    this->line_evict(line);
+    if (line) {
+        this->line_evict(line);
+        return;
+    }
+    // a non-inclusive cache can miss lines that its children have
+    if (_inclusion == INCLUSION_INCLUSIVE) return;
+    const Addr line_addr = floor(addr, _line_size_bytes);
+    for (size_t child_i=0; child_i<_children.size(); child_i++) {
+        Cache *child = _children.child(child_i);
+        for (Addr line_addr_iter=line_addr; line_addr_iter<line_addr+_line_size_bytes; line_addr_iter += child->_line_size_bytes) {
+            child->line_evict(line_addr_iter);
+        }
+    }
 }
 
 void
-Cache :: line_evict(Line *line)
+Cache :: line_evict_children(Line *line)
 {
-    NVLOG1("%s\tline_evict addr 0x%lx data 0x%lx\n", this->_name.c_str(), line->addr, (Addr)line->pdata);
-    // evict in all child caches
-    for (size_t child_i = 0; child_i<_children.size() && line->sharers>0; child_i++) {
-        if (!bit(line->sharers, child_i)) continue; // a child is not a sharer, so continue
-        Cache *child = dynamic_cast<Cache *>(_children[child_i]); assert(child!=NULL);
-        for (Addr line_addr_iter=line->addr; line_addr_iter<line->addr+get_line_size(); line_addr_iter += child->get_line_size()) {
-            Line *child_line = child->addr2line_internal(line_addr_iter);
-            if (child_line == NULL) continue;
-            child->line_evict(child_line);
+    // evict in all child caches: only the sharers, and only the sub-blocks they have fetched
+    SharerIter sharers = _sharers.iter(line->sharers, this->sharers_ext(line));
+    for (size_t child_i; sharers.next(child_i); ) {
+        Cache *child = _children.child(child_i);
+        for (uint64_t blocks = line->child_subblocks; blocks; blocks &= blocks-1) {
+            const Addr block_addr = this->subblock_addr(line, blocks);
+            for (Addr line_addr_iter=block_addr; line_addr_iter<block_addr+this->subblock_bytes(); line_addr_iter += child->_line_size_bytes) {
+                child->line_evict(line_addr_iter);
+            }
+        }
+    }
+}
+
+void
+Cache :: line_detach_children(Line *line)
+{
+    // the children keep their parts of the line; they only lose the pointer to it
+    SharerIter sharers = _sharers.iter(line->sharers, this->sharers_ext(line));
+    for (size_t child_i; sharers.next(child_i); ) {
+        Cache *child = _children.child(child_i);
+        for (uint64_t blocks = line->child_subblocks; blocks; blocks &= blocks-1) {
+            const Addr block_addr = this->subblock_addr(line, blocks);
+            for (Addr line_addr_iter=block_addr; line_addr_iter<block_addr+this->subblock_bytes(); line_addr_iter += child->_line_size_bytes) {
+                Line *child_line = child->addr2line_internal(line_addr_iter);
+                if (child_line && child_line->parent_line == line) child_line->parent_line = NULL;
+            }
+        }
+    }
+}
+
+void
+Cache :: line_replace(Line *line)
+{
+    // an exclusive parent gets the replaced line (as a victim cache)
+    const bool victim_fill = _parent_cache && _parent_cache->_inclusion == INCLUSION_EXCLUSIVE && line->state != LINE_INV;
+    if (_inclusion == INCLUSION_INCLUSIVE && !victim_fill) {
+        this->line_evict(line);
+        return;
+    }
+    NVLOG1("%s\tline_replace addr 0x%lx data 0x%lx\n", this->_name.c_str(), line->addr, (Addr)line->pdata);
+    if (_inclusion == INCLUSION_INCLUSIVE) {
+        this->line_evict_children(line);
+    } else {
+        this->line_detach_children(line);
+    }
+#ifdef HAS_HTM
+    if (pprocessor) {
+        pprocessor->cb_line_evicted(line);
+    }
+#endif
+    if (victim_fill) {
+        _parent_cache->line_victim_fill(line, _index_in_parent);
+    } else {
+        this->line_data_writeback(line);
+    }
+    free(line->pdata);
+    line->pdata = NULL;
+    this->line_rm(line);
+}
+
+bool
+Cache :: line_serves(const Addr addr, const uint8_t line_state_req, const unsigned child_index)
+{
+    // a victim cache moves its lines down; leave that to the request itself
+    if (_inclusion == INCLUSION_EXCLUSIVE) return false;
+    Line *line = this->addr2line_internal(addr);
+    if (line == NULL || line->state == LINE_INV || !(line->sector_valid & this->sector_bit(line, addr))) return false;
+    // the data would come from the parent line, or the line would move to the child
+    if (line->pdata == NULL && !_tag_only) return false;
+    if (_parent_cache && line->parent_line && _parent_cache->_inclusion == INCLUSION_EXCLUSIVE) return false;
+    switch (line_state_req) {
+        case LINE_MOD:
+        case LINE_EXC:
+            // the last cache upgrades the line by itself
+            if (!_parent_cache) return true;
+            return (line->state & (LINE_MOD | LINE_EXC)) && (line_state_req == LINE_EXC || _is_writeback_cache);
+        case LINE_SHR:
+            // the other children write an owned line back here, and it goes on to the parent
+            return !(line->state & (LINE_MOD | LINE_EXC)) || _sharers.is_only(line->sharers, this->sharers_ext(line), child_index);
+        default:
+            return false;
+    }
+}
+
+void
+Cache :: set_sharers(const Addr addr, std::vector<bool> &children)
+{
+    // a cache that does not include the lines of its children does not know who has them
+    children.assign(_children.size(), _inclusion != INCLUSION_INCLUSIVE);
+    if (_inclusion != INCLUSION_INCLUSIVE) return;
+    const size_t direct_entry = this->addr2directentry(addr);
+    if (!_entries.is_materialized(direct_entry)) return;
+    my_cam cam = _entries[direct_entry];
+    for (size_t slot=0; slot<cam.num_slots(); slot++) {
+        if (!cam.slot_valid(slot)) continue;
+        Line *line = cam.slot_line(slot);
+        SharerIter sharers = _sharers.iter(line->sharers, this->sharers_ext(line));
+        for (size_t child_i; sharers.next(child_i); ) {
+            children[child_i] = true;
+        }
+    }
+}
+
+bool
+Cache :: line_dirty(Line *line)
+{
+    if (line->state & LINE_MOD) return true;
+    // an inclusive cache first takes the modified data of the copies of its children
+    if (_inclusion != INCLUSION_INCLUSIVE) return false;
+    SharerIter sharers = _sharers.iter(line->sharers, this->sharers_ext(line));
+    for (size_t child_i; sharers.next(child_i); ) {
+        Cache *child = _children.child(child_i);
+        for (uint64_t blocks = line->child_subblocks; blocks; blocks &= blocks-1) {
+            const Addr block_addr = this->subblock_addr(line, blocks);
+            for (Addr line_addr_iter=block_addr; line_addr_iter<block_addr+this->subblock_bytes(); line_addr_iter += child->_line_size_bytes) {
+                Line *child_line = child->addr2line_internal(line_addr_iter);
+                if (child_line ? child->line_dirty(child_line) : child->line_held(line_addr_iter, LINE_MOD)) return true;
+            }
         }
     }
+    return false;
+}
+
+void
+Cache :: line_evict(Line *line)
+{
+    NVLOG1("%s\tline_evict addr 0x%lx data 0x%lx\n", this->_name.c_str(), line->addr, (Addr)line->pdata);
+    this->line_evict_children(line);
 #ifdef HAS_HTM
     if (pprocessor) {
         pprocessor->cb_line_evicted(line);
@@ -502,8 +482,9 @@ Cache :: line_evict(Line *line)
 Line *
 Cache :: addr2line_internal(const Addr addr, const bool search_reverse)
 {
-    Addr line_addr = floor(addr, get_line_size());
+    Addr line_addr = floor(addr, _line_size_bytes);
     size_t direct_entry = this->addr2directentry(line_addr);
+    if (!_entries.is_materialized(direct_entry)) return NULL;
     if (search_reverse) {
         Line *line = _entries[direct_entry].get_no_reorder_reverse(line_addr);
         return line;
@@ -516,7 +497,7 @@ Cache :: addr2line_internal(const Addr addr, const bool search_reverse)
 Line *
 Cache :: addr2line(const Addr addr, bool &set_overflow, Line *&overflow_line)
 {
-    Addr line_addr = floor(addr, this->get_line_size());
+    Addr line_addr = floor(addr, _line_size_bytes);
     size_t direct_entry = this->addr2directentry(line_addr);
     assert(_entries[direct_entry].size() <= _associativity);
     Line *line = _entries[direct_entry].get(line_addr, set_overflow, overflow_line);
@@ -558,12 +539,9 @@ Cache :: line_data_get_internal(const Addr addr, uint8_t *&pdata)
 size_t
 Cache :: get_num_valid_entries()
 {
-    tCacheEntries::iterator iter;
     size_t cnt_valid = 0;
-    size_t idx = 0;
-    for (iter=_entries.begin(); iter!=_entries.end(); iter++, idx++) {
-        iter->rm_invalid_entries();
-        cnt_valid += iter->size();
+    for (size_t idx=0; idx<_entries.size(); idx++) {
+        cnt_valid += this->get_num_valid_entries(idx);
     }
     return cnt_valid;
 }
@@ -571,8 +549,10 @@ Cache :: get_num_valid_entries()
 inline size_t
 Cache :: get_num_valid_entries(size_t direct_entry)
 {
-    _entries[direct_entry].rm_invalid_entries();
-    return this->_entries[direct_entry].size();
+    if (!_entries.is_materialized(direct_entry)) return 0;
+    my_cam cam = _entries[direct_entry];
+    cam.rm_invalid_entries();
+    return cam.size();
 }
 
 void
@@ -619,15 +599,21 @@ Cache :: line_get_as_modified(Addr addr)
 void
 Cache :: line_data_writeback(Line *line)
 {
-    if (line->pdata == NULL) return;
+    // a tag-only line has no data, but its modified state still goes to the parent
+    if (line->pdata == NULL && !_tag_only) return;
     assert(! ((line->state & (LINE_MOD | LINE_EXC)) && (line->state & LINE_TXW)) );
     if (!(line->state & (LINE_MOD | LINE_TXW))) return;
     if (_parent_cache && line->parent_line)
     {
         NVLOG1("%s\tline_data_writeback to %s 0x%lx data 0x%lx -> 0x%lx\n", this->_name.c_str(), _parent_cache->_name.c_str(), line->addr, (Addr)line->pdata, (Addr)line->parent_line->pdata);
-        assert(line->parent_line->pdata != NULL);
-        memcpy(line->parent_line->pdata+(line->addr - line->parent_line->addr), line->pdata, get_line_size());
-        if (line->state & LINE_MOD) { line->parent_line->state |= LINE_MOD; } // propagate modified state
+        if (line->pdata && line->parent_line->pdata) {
+            memcpy(line->parent_line->pdata+(line->addr - line->parent_line->addr), line->pdata, get_line_size());
+        }
+        if (line->state & LINE_MOD) { // propagate modified state
+            if (_parent_cache->_profiler) _parent_cache->profile_writeback(line->addr);
+            line->parent_line->state |= LINE_MOD;
+            line->parent_line->sector_dirty |= _parent_cache->sector_bit(line->parent_line, line->addr);
+        }
         NVLOG1("%s\t0x%lx\t new state %s sharers %lx\n",  _parent_cache->_name.c_str(),  line->parent_line->addr,  state2str(line->parent_line->state).c_str(), line->parent_line->sharers );
     }
     else
@@ -636,13 +622,216 @@ Cache :: line_data_writeback(Line *line)
         // write the line data to the memory
 //        Fault fault = rw_array_silent(line->addr, get_line_size(), line->pdata, true);
 //        assert(fault == NoFault);
+        if (line->state & LINE_MOD) {
+            // only the modified sectors are written; a line that got its modified state
+            // from a parent (not from a write) writes all its sectors
+            uint64_t dirty = line->sector_dirty ? line->sector_dirty : line->sector_valid;
+            const size_t sector_bytes = this->get_sector_size();
+            for (; dirty; dirty &= dirty-1) {
+                _parent->data_writeback(line->addr + __builtin_ctzll(dirty)*sector_bytes, sector_bytes);
+            }
+        }
+    }
+    line->sector_dirty = 0;
+}
+
+void
+Cache :: set_sector_size(size_t sector_bytes)
+{
+    assert(is_power_of_2(sector_bytes));
+    assert(sector_bytes <= (size_t)_line_size_bytes && _line_size_bytes/sector_bytes <= 64);
+    assert(this->get_num_valid_entries() == 0 && "sectors can only be changed on an empty cache");
+    // a child line has to fit in one sector (of an exclusive cache: be one sector)
+    for (size_t child_i=0; child_i<_children.size(); child_i++) {
+        assert((size_t)_children[child_i]->_line_size_bytes <= sector_bytes);
+        assert(_inclusion != INCLUSION_EXCLUSIVE || (size_t)_children[child_i]->_line_size_bytes == sector_bytes);
+    }
+    _sector_bits = log2power2(sector_bytes);
+}
+
+void
+Cache :: set_shard_bits(size_t low_bit, size_t bits)
+{
+    assert(this->get_num_valid_entries() == 0 && "shard bits can only be changed on an empty cache");
+    // the shard bits have to be set index bits (of the cache with all the sets)
+    assert(low_bit >= _line_bits);
+    assert(low_bit <= _line_bits + log2power2(_num_direct_entries));
+    _shard_low_mask = (1UL << (low_bit - _line_bits)) - 1;
+    _shard_bits = bits;
+}
+
+void
+Cache :: set_sharer_format(SharerFormat format)
+{
+    assert(this->get_num_valid_entries() == 0 && "the sharer format can only be changed on an empty cache");
+    _sharers.configure(format, _children.size());
+    _entries.set_line_extra_bytes(_sharers.ext_bytes());
+}
+
+void
+Cache :: set_inclusion(InclusionPolicy inclusion)
+{
+    assert(inclusion < INCLUSION_NUM_POLICIES);
+    assert(this->get_num_valid_entries() == 0 && "the inclusion policy can only be changed on an empty cache");
+    if (inclusion == INCLUSION_EXCLUSIVE) {
+        // a child line moves between the levels as one sector
+        for (size_t child_i=0; child_i<_children.size(); child_i++) {
+            assert((size_t)_children[child_i]->_line_size_bytes == this->get_sector_size());
+        }
+    }
+    _inclusion = inclusion;
+}
+
+bool
+Cache :: line_held(const Addr addr, const uint8_t states)
+{
+    Line *line = this->addr2line_internal(addr);
+    if (line) return (line->state & states) != 0;
+    if (_inclusion == INCLUSION_INCLUSIVE) return false;
+    const Addr line_addr = floor(addr, _line_size_bytes);
+    for (size_t child_i=0; child_i<_children.size(); child_i++) {
+        Cache *child = _children.child(child_i);
+        for (Addr line_addr_iter=line_addr; line_addr_iter<line_addr+_line_size_bytes; line_addr_iter += child->_line_size_bytes) {
+            if (child->line_held(line_addr_iter, states)) return true;
+        }
+    }
+    return false;
+}
+
+void
+Cache :: line_snoop_children(const Addr addr, const size_t bytes, Line *line, const uint8_t line_state_req, const unsigned child_index, size_t &latency)
+{
+    // A non-inclusive cache does not know which children have the parts of a line that it
+    // does not have: look them up, and make their copies coherent with the request of child_index.
+    // If this cache allocated the line, the children that keep a copy become its sharers
+    // (the requesting child too: it can have other parts of the line).
+    for (size_t child_i=0; child_i<_children.size(); child_i++) {
+        if (child_i == child_index && line == NULL) continue;
+        Cache *child = _children.child(child_i);
+        for (Addr line_addr_iter=addr; line_addr_iter<addr+bytes; line_addr_iter += child->_line_size_bytes) {
+            if (!child->line_held(line_addr_iter)) continue;
+            NVLOG1("%s\tline_snoop_children 0x%lx found in %s\n", this->_name.c_str(), line_addr_iter, child->_name.c_str());
+            if (child_i == child_index) {
+                // nothing to do for coherence
+            } else if (line_state_req & (LINE_MOD | LINE_EXC)) {
+                child->line_evict(line_addr_iter);
+                continue;
+            } else if (child->line_held(line_addr_iter, LINE_MOD | LINE_EXC)) {
+                child->line_writer_to_sharer(line_addr_iter, latency);
+            }
+            if (line) {
+                _sharers.add(line->sharers, this->sharers_ext(line), child_i);
+                line->child_subblocks |= this->subblock_bit(line, line_addr_iter);
+                Line *child_line = child->addr2line_internal(line_addr_iter);
+                if (child_line) child_line->parent_line = line;
+            }
+        }
+    }
+}
+
+void
+Cache :: line_hand_over(Line *child_line)
+{
+    // an exclusive cache gives the line (sector) up to the child that fetched it
+    Line *line = child_line->parent_line;
+    const uint64_t sector = this->sector_bit(line, child_line->addr);
+    if ((line->sector_dirty & sector) || ((line->state & LINE_MOD) && line->sector_dirty == 0)) {
+        child_line->state |= LINE_MOD;
+    }
+    NVLOG1("%s\tline_hand_over 0x%lx to a child as %s\n", this->_name.c_str(), child_line->addr, state2str(child_line->state).c_str());
+    child_line->parent_line = NULL;
+    const uint64_t line_dirty = line->sector_dirty;
+    line->sector_valid &= ~sector;
+    line->sector_dirty &= ~sector;
+    if (line_dirty && !line->sector_dirty) line->state &= ~LINE_MOD;
+    if (line->sector_valid) return;
+    this->line_detach_children(line);
+    free(line->pdata);
+    line->pdata = NULL;
+    this->line_rm(line);
+}
+
+void
+Cache :: line_victim_fill(Line *child_line, const unsigned child_index)
+{
+    // a line replaced in a child moves to this (exclusive) cache
+    bool set_overflow = false;
+    Line *overflow_line = NULL;
+    Line *line = addr2line(child_line->addr, set_overflow, overflow_line);
+    if (set_overflow) {
+        NVLOG1("%s\tline_victim_fill overflow 0x%lx\n", _name.c_str(), overflow_line->addr);
+        this->line_replace(overflow_line);
+    }
+    if (line->state == LINE_INV) {
+        line->sector_valid = 0;
+        line->sector_dirty = 0;
+        if (_parent_cache) {
+            // the parent has to know about the line, or its evictions miss the pointer to it
+            Line *parent_line = _parent_cache->addr2line_internal(line->addr);
+            if (parent_line) {
+                _parent_cache->_sharers.add(parent_line->sharers, _parent_cache->sharers_ext(parent_line), _index_in_parent);
+                parent_line->child_subblocks |= _parent_cache->subblock_bit(parent_line, line->addr);
+            }
+            line->parent_line = parent_line;
+        }
+    }
+    const uint64_t sector = this->sector_bit(line, child_line->addr);
+    line->state |= child_line->state & (LINE_SHR | LINE_EXC | LINE_MOD);
+    line->sector_valid |= sector;
+    if (child_line->state & LINE_MOD) line->sector_dirty |= sector;
+    if (!_tag_only) {
+        if (line->pdata == NULL) line->pdata = (uint8_t*)malloc(get_line_size());
+        if (child_line->pdata) {
+            memcpy(line->pdata+(child_line->addr - line->addr), child_line->pdata, _children.child(child_index)->_line_size_bytes);
+        }
+    }
+    // other children can still share the line
+    size_t latency = 0; // off the critical path
+    this->line_snoop_children(line->addr, _line_size_bytes, line, LINE_SHR, child_index, latency);
+    this->stats.victim_fills_inc();
+    NVLOG1("%s\tline_victim_fill 0x%lx\t state %s sectors 0x%lx\n", _name.c_str(), child_line->addr, state2str(line->state).c_str(), line->sector_valid);
+}
+
+void
+Cache :: data_writeback(const Addr addr, const size_t bytes)
+{
+    // modified data of a child line that has no parent line, which only happens below a
+    // non-inclusive cache: keep it here if the line is here, otherwise pass it on
+    if (_profiler) this->profile_writeback(addr);
+    Line *line = this->addr2line_internal(addr);
+    if (line && line->state != LINE_INV && (line->sector_valid & this->sector_bit(line, addr))) {
+        line->state |= LINE_MOD;
+        line->sector_dirty |= this->sector_bit(line, addr);
+        return;
     }
+    _parent->data_writeback(addr, bytes);
+}
+
+void
+Cache :: profile_access(const Addr addr, const uint8_t line_state_req)
+{
+    _profiler->access(addr, (line_state_req & LINE_MOD) != 0);
+}
+
+void
+Cache :: profile_writeback(const Addr addr)
+{
+    _profiler->writeback(addr);
 }
 
 void
 Cache :: add_child(Cache *child) {
     // Add this cache to the list of child caches
     _children.add_child(child);
+    assert(_inclusion != INCLUSION_EXCLUSIVE || (size_t)child->_line_size_bytes == this->get_sector_size());
+    _sharers.configure(_sharers.format, _children.size());
+    _entries.set_line_extra_bytes(_sharers.ext_bytes());
+    size_t min_child_line_bits = _line_bits;
+    for (size_t child_i=0; child_i<_children.size(); child_i++) {
+        min_child_line_bits = MIN2(min_child_line_bits, (size_t)log2power2(_children.child(child_i)->_line_size_bytes));
+    }
+    const size_t min_subblock_bits = (_line_bits > 6) ? _line_bits-6 : 0; // up to 64 sub-blocks
+    _subblock_bits = MAX2(min_child_line_bits, min_subblock_bits);
     if (_children.size()>1) {
         this->_is_private_cache = false;
     } else {
@@ -681,12 +870,10 @@ Cache :: add_child(Cache *child) {
 
 std::ostream &
 Cache::dump(std::ostream &os) {
-    tCacheEntries::const_iterator citer;
-    size_t cnt=0;
-    for (citer=this->_entries.begin(); citer!=this->_entries.end(); citer++, cnt++) {
+    for (size_t cnt=0; cnt<this->_entries.size(); cnt++) {
         if (this->get_num_valid_entries(cnt)==0) continue;
         os << _name.c_str() << " " << cnt << ": ";
-        os << citer->str();
+        os << this->_entries[cnt].str();
         os << std::endl;
     }
     return os;
@@ -701,19 +888,29 @@ Cache::reset_stats() {
     this->stats.reset();
 }
 
+void
+Cache :: set_tag_only(bool tag_only)
+{
+    _tag_only = tag_only;
+    for (size_t child_i=0; child_i<_children.size(); child_i++) {
+        _children[child_i]->set_tag_only(tag_only);
+    }
+}
+
 void
 Cache :: flush_data() {
     NVLOG1("%s\tflush_data\n", this->_name.c_str());
-    tCacheEntries::iterator set_iter;
-    my_cam::iterator set_iter2;
-    for (set_iter=this->_entries.begin(); set_iter!=this->_entries.end(); ++set_iter) {
-        for (set_iter2=set_iter->begin(); set_iter2!=set_iter->end(); ++set_iter2) {
-            Line *line = *set_iter2;
+    for (size_t set=0; set<this->_entries.size(); ++set) {
+        if (!this->_entries.is_materialized(set)) continue;
+        my_cam cam = this->_entries[set];
+        for (size_t slot=0; slot<cam.num_slots(); ++slot) {
+            if (!cam.slot_valid(slot)) continue;
+            Line *line = cam.slot_line(slot);
             this->line_data_writeback(line);
             free(line->pdata);
             line->pdata = NULL;
         }
-        set_iter->clear();
+        cam.clear();
     }
 }
 
@@ -727,11 +924,193 @@ Cache::reset() {
     this->flush_data();
 };
 
+// Anonymous memory for the tag store; a region of LARGE_PAGE_BYTES is backed by
+// a huge page if the system has one to spare (or by transparent huge pages)
+static uint8_t *
+tag_store_region_alloc(size_t bytes)
+{
+    void *region;
+#ifdef MAP_HUGETLB
+    if (bytes % LARGE_PAGE_BYTES == 0) {
+        region = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED) return (uint8_t *)region;
+    }
+#endif
+    region = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+    if (bytes % LARGE_PAGE_BYTES == 0) {
+        madvise(region, bytes, MADV_HUGEPAGE);
+    }
+#endif
+    return (uint8_t *)region;
+}
+
+void
+TagStore :: init(size_t num_sets, size_t capacity, ReplPolicy repl_policy)
+{
+    assert(_dir == NULL);
+    assert(capacity > 0 && capacity < WAY_VICTIM);
+    assert(is_power_of_2(num_sets));
+    _repl_state.policy = repl_policy;
+    if (repl_policy == REPL_PLRU) {
+        assert(is_power_of_2(capacity) && capacity <= 64);
+    }
+    _num_sets = num_sets;
+    _capacity = capacity;
+    _num_slots = capacity+1; // one spare slot for the line that is being filled
+    _tag_slots = ceil(_num_slots, TAG_MATCH_STEP);
+    this->layout();
+    _dir = (uint8_t **)calloc(_num_chunks, sizeof(uint8_t *));
+    assert(_dir != NULL);
+}
+
+void
+TagStore :: layout()
+{
+    // set layout: tags | header | slot2way | way2slot | repl | lines, padded to whole cache lines
+    _off_hdr = _tag_slots*sizeof(Addr);
+    _off_slot2way = _off_hdr + sizeof(my_cam_hdr);
+    _off_way2slot = _off_slot2way + _num_slots;
+    _off_repl = _off_way2slot + _capacity;
+    _off_lines = ceil(_off_repl + _capacity, sizeof(Addr));
+    _set_bytes = ceil(_off_lines + _num_slots*_line_stride, 64);
+    // sets are allocated lazily, in chunks
+    const size_t chunk_sets = MIN2(_num_sets, TAG_STORE_CHUNK_SETS);
+    _chunk_shift = log2power2(chunk_sets);
+    _num_chunks = _num_sets / chunk_sets;
+    _chunk_bytes = chunk_sets*_set_bytes;
+    const size_t all_bytes = _num_chunks*_chunk_bytes;
+    if (all_bytes < LARGE_PAGE_BYTES) {
+        _region_bytes = ceil(all_bytes, (size_t)getpagesize());
+    } else {
+        _region_bytes = ceil(_chunk_bytes, LARGE_PAGE_BYTES);
+    }
+}
+
+void
+TagStore :: set_line_extra_bytes(size_t bytes)
+{
+    assert(bytes % sizeof(uint64_t) == 0);
+    if (sizeof(Line) + bytes == _line_stride) return;
+    assert(_num_chunks_used == 0 && "the line layout can only be changed before the cache is used");
+    _line_stride = sizeof(Line) + bytes;
+    this->layout();
+}
+
+uint8_t *
+TagStore :: materialize(size_t chunk)
+{
+    assert(_dir[chunk] == NULL);
+    if (_region_left < _chunk_bytes) {
+        _region_free = tag_store_region_alloc(_region_bytes);
+        if (_region_free == NULL) {
+            fprintf(stderr, "CACHE ERROR: cannot allocate %lu bytes for cache sets\n", (unsigned long)_region_bytes);
+            abort();
+        }
+        _regions.push_back(std::make_pair(_region_free, _region_bytes));
+        _region_left = _region_bytes;
+    }
+    uint8_t *chunk_base = _region_free;
+    _region_free += _chunk_bytes;
+    _region_left -= _chunk_bytes;
+    const size_t first_set = chunk << _chunk_shift;
+    for (size_t set=0; set < (1UL << _chunk_shift); set++) {
+        this->view(chunk_base + set*_set_bytes, first_set + set).reset();
+    }
+    _dir[chunk] = chunk_base;
+    _num_chunks_used++;
+    return chunk_base;
+}
+
+size_t
+TagStore :: metadata_bytes() const
+{
+    size_t bytes = _num_chunks*sizeof(uint8_t *);
+    for (size_t i=0; i<_regions.size(); i++) {
+        bytes += _regions[i].second;
+    }
+    return bytes;
+}
+
+void
+TagStore :: set_repl_policy(ReplPolicy repl_policy)
+{
+    if (repl_policy == _repl_state.policy) return;
+    if (repl_policy == REPL_PLRU) {
+        assert(is_power_of_2(_capacity) && _capacity <= 64);
+    }
+    // the replacement metadata of one policy means nothing to another
+    for (size_t set=0; set<_num_sets; set++) {
+        if (!this->is_materialized(set)) continue;
+        my_cam cam = (*this)[set];
+        assert(cam.size() == 0 && "replacement policy can only be changed on an empty cache");
+        cam.reset();
+    }
+    _repl_state = ReplState();
+    _repl_state.policy = repl_policy;
+}
+
+TagStore :: ~TagStore()
+{
+    if (_dir == NULL) return;
+    for (size_t set=0; set<_num_sets; set++) {
+        if (!this->is_materialized(set)) continue;
+        my_cam cam = (*this)[set];
+        for (size_t slot=0; slot<_num_slots; slot++) {
+            if (cam.slot_valid(slot)) free(cam.slot_line(slot)->pdata);
+        }
+    }
+    for (size_t i=0; i<_regions.size(); i++) {
+        munmap(_regions[i].first, _regions[i].second);
+    }
+    free(_dir);
+}
+
+void
+my_cam :: reset()
+{
+    for (size_t slot=0; slot<__slots; slot++) {
+        tags[slot] = LINE_ADDR_NONE;
+        slot2way[slot] = WAY_NONE;
+    }
+    for (size_t slot=__slots; slot<__tag_slots; slot++) {
+        tags[slot] = LINE_ADDR_PAD;
+    }
+    for (size_t way=0; way<__capacity; way++) {
+        way2slot[way] = WAY_NONE;
+        repl[way] = REPL_NONE;
+    }
+    hdr->size = 0;
+    hdr->mapped = 0;
+    hdr->repl_bits = 0;
+}
+
+std::string
+my_cam :: str() const
+{
+    // print lines in the order of their replacement metadata;
+    // with LRU this is from the most to the least recently used line
+    std::vector<std::pair<unsigned, size_t> > order;
+    for (size_t slot=0; slot<__slots; slot++) {
+        if (tags[slot]==LINE_ADDR_NONE) continue;
+        const uint8_t way = slot2way[slot];
+        order.push_back(std::make_pair((way<WAY_VICTIM) ? repl[way] : 0x100U, slot));
+    }
+    std::sort(order.begin(), order.end());
+    std::ostringstream outputString;
+    outputString << "{ ";
+    for (size_t i=0; i<order.size(); i++) {
+        outputString << this->slot_line(order[i].second)->str() << ", ";
+    }
+    outputString << "}";
+    return outputString.str();
+}
+
 void
 ChildMemories :: add_child(Cache *child)
 {
-    // built-in limit, for now!
-    assert(this->size() <= 64);
+    // the sharer format of the parent (see sharers.h) limits the number of children
     this->push_back(child);
 }
 
@@ -749,14 +1128,6 @@ ChildMemories :: child_find_idx(Cache *child, int &child_index)
     return false;
 }
 
-size_t
-Cache :: addr2directentry(Addr addr)
-{
-    size_t line_bits = (size_t)log2power2(_line_size_bytes);
-    size_t entry_bits = (size_t)log2power2(_num_direct_entries);
-    return (size_t)bits(addr, line_bits, entry_bits);
-}
-
 std::ostream& operator << ( std::ostream &os, Cache &obj)
 {
     return obj.dump(os);
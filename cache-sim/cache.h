@@ -21,14 +21,19 @@
 #include <assert.h>
 #include <ctime>
 #include <malloc.h>
-#include <deque>
+#include <new>
+#include <string.h>
 #include "globals.h"
+#include "tagmatch.h"
+#include "replacement.h"
+#include "sharers.h"
 #ifdef HAS_HTM
   #include "proc_cache_interface.h"
 #endif
 
 struct Cache;
 struct GenericMemory;
+class StackDistance;
 
 extern char *strbuf;
 extern bool shutdown_started;
@@ -43,11 +48,27 @@ const uint8_t LINE_TXW = 1<<4;
 
 const std::string state2str (const uint8_t state);
 
+// What a cache keeps of the lines of its children
+enum InclusionPolicy {
+    INCLUSION_INCLUSIVE = 0, // every child line is also here; evicting a line evicts it in the children
+    INCLUSION_NINE,          // non-inclusive non-exclusive: fills allocate here, but evicting a line
+                             // leaves the children alone
+    INCLUSION_EXCLUSIVE,     // a victim cache of the children: a fill goes straight to the child,
+                             // a hit moves the line to the child, child evictions are filled here
+    INCLUSION_NUM_POLICIES
+};
+
+const char *inclusion2str(const InclusionPolicy inclusion);
+bool str2inclusion(const char *name, InclusionPolicy &inclusion);
+
 struct Line
 {
     Addr addr;
     uint8_t state;
-    uint64_t sharers;
+    uint64_t sharers; // the first word of the sharer state (see sharers.h)
+    uint64_t sector_valid; // sectors of the line that were fetched
+    uint64_t sector_dirty; // sectors of the line that were modified
+    uint64_t child_subblocks; // sub-blocks of the line that a child cache may hold
     uint8_t *pdata; // a pointer to the line data
     // a pointer to the same line in parent cache
     Line *parent_line;
@@ -61,6 +82,9 @@ struct Line
         this->addr = addr;
         this->state = LINE_INV;
         this->sharers = 0;
+        this->sector_valid = 0;
+        this->sector_dirty = 0;
+        this->child_subblocks = 0;
         this->pdata = NULL;
         this->parent_line = NULL;
     }
@@ -69,122 +93,270 @@ private:
 public:
 };
 
-// This CAM employs LRU replacement algorithm -> so we use deque underneath
-struct my_cam : private std::deque<Line *>
+// Tag of an empty way. Line addresses are line-aligned, so it never matches a real line.
+const Addr LINE_ADDR_NONE = (Addr)-1;
+
+// slot2way/way2slot value of an unmapped slot or way
+const uint8_t WAY_NONE = 0xff;
+// slot2way value of a replaced line that is still being evicted
+const uint8_t WAY_VICTIM = 0xfe;
+
+struct my_cam_hdr
 {
-    size_t __capacity;
-    typedef std::deque<Line *>::iterator iterator;
-    typedef std::deque<Line *>::const_iterator const_iterator;
-    iterator begin() { return std::deque<Line *>::begin(); }
-    iterator end() { return std::deque<Line *>::end(); }
-    const_iterator begin() const { return std::deque<Line *>::begin(); }
-    const_iterator end() const { return std::deque<Line *>::end(); }
+    uint32_t size;      // number of occupied slots (including a line being evicted)
+    uint32_t mapped;    // number of occupied ways
+    uint64_t repl_bits; // per-set replacement state (tree-PLRU)
+};
 
-    my_cam() : __capacity(0) { } // it won't work with capacity==0 !!!
-    ~my_cam() { while (this->size() > 0) { if (this->back()->pdata) free(this->back()->pdata); delete this->back(); this->pop_back(); } }
+struct TagStore;
 
-    inline void set_capacity(size_t capacity) {
-        __capacity = capacity;
-    }
+// One set of a cache (a CAM).
+// A my_cam is only a view of one set in the flat TagStore, where the set is laid out as
+//   tags[tag_slots] | header | slot2way[slots] | way2slot[ways] | repl[ways] | lines[slots]
+// A line slot is line_stride bytes: the Line, followed by the extra sharer words of a wide
+// sharer bitmap (if any).
+// Lines are kept in slots and never move, so a Line pointer stays valid until the line
+// is erased. The replacement policy works on (logical) ways, which are mapped to slots.
+// There is one slot more than ways: the incoming line goes there while the caller
+// evicts the overflow line (the old deque-based set grew the same way).
+// The tag array is padded to whole TAG_MATCH_STEPs, so a lookup is a few SIMD compares.
+struct my_cam
+{
+    Addr *tags;
+    my_cam_hdr *hdr;
+    uint8_t *slot2way;
+    uint8_t *way2slot;
+    uint8_t *repl;
+    Line *lines;
+    ReplState *repl_state;
+    size_t __set;
+    size_t __capacity;
+    size_t __slots;
+    size_t __tag_slots;
+    size_t __line_stride;
 
-    inline std::string str() const {
-        std::ostringstream outputString;
-        outputString << "{ ";
-        for (const_iterator cit = this->begin(); cit!= this->end(); ++cit) {
-            outputString << (*cit)->str() << ", ";
-        }
-        outputString << "}";
-        return outputString.str();
+    std::string str() const;
+    inline size_t size() const { return hdr->size; }
+    inline size_t num_slots() const { return __slots; }
+    inline bool slot_valid(size_t slot) const { return tags[slot]!=LINE_ADDR_NONE; }
+    inline Line *slot_line(size_t slot) const { return (Line *)((uint8_t *)lines + slot*__line_stride); }
+    inline int find(const Addr addr) const {
+        return tag_match(tags, __tag_slots, addr);
     }
-    inline size_t size() { return std::deque<Line *>::size(); }
     inline Line * get_no_reorder(const Addr addr) {
-	//NVLOG1("getting %lx w/o reordering\n", addr);
-        for (const_iterator it = this->begin(); it!= this->end(); ++it) {
-            if ((*it)->addr == addr)
-                return *it;
-        }
-        return NULL;
+        int slot = this->find(addr);
+        return (slot<0) ? NULL : this->slot_line(slot);
     }
     inline Line *get_no_reorder_reverse(const Addr addr) {
-        const const_reverse_iterator crend = this->rend();
-        for (const_reverse_iterator it = this->rbegin(); it!= crend; ++it) {
-            if ((*it)->addr == addr)
-                return *it;
+        // tags are unique within a set, so the search order does not matter any more
+        return this->get_no_reorder(addr);
+    }
+    inline Line * get(const Addr addr, bool &overflow, Line *&overflow_elem) {
+        switch (repl_state->policy) {
+            case REPL_LRU: return this->get<ReplLRU>(addr, overflow, overflow_elem);
+            case REPL_PLRU: return this->get<ReplPLRU>(addr, overflow, overflow_elem);
+            case REPL_SRRIP: return this->get<ReplSRRIP>(addr, overflow, overflow_elem);
+            case REPL_BRRIP: return this->get<ReplBRRIP>(addr, overflow, overflow_elem);
+            case REPL_DIP: return this->get<ReplDIP>(addr, overflow, overflow_elem);
+            case REPL_RANDOM: return this->get<ReplRandom>(addr, overflow, overflow_elem);
+            default: assert(false && "invalid replacement policy"); return NULL;
+        }
+    }
+    // the line in this slot was hit (without a full get())
+    inline void touch(size_t slot) {
+        const uint8_t way = slot2way[slot];
+        if (way >= WAY_VICTIM) return;
+        ReplSet rs = this->repl_set();
+        switch (repl_state->policy) {
+            case REPL_LRU: ReplLRU::touch(rs, way); break;
+            case REPL_PLRU: ReplPLRU::touch(rs, way); break;
+            case REPL_SRRIP: ReplSRRIP::touch(rs, way); break;
+            case REPL_BRRIP: ReplBRRIP::touch(rs, way); break;
+            case REPL_DIP: ReplDIP::touch(rs, way); break;
+            case REPL_RANDOM: ReplRandom::touch(rs, way); break;
+            default: assert(false && "invalid replacement policy");
         }
-        return NULL;
     }
+    template <class Policy>
     inline Line * get(const Addr addr, bool &overflow, Line *&overflow_elem) {
-	//NVLOG1("getting %lx entries %ld/%ld %s\n", addr, this->size(), __capacity, this->str().c_str());
         overflow = false;
         overflow_elem = NULL;
-        for (iterator it = this->begin(); it!= this->end(); ++it) {
-            if ((*it)->addr == addr)
-            { // ELEMENT RE-ACCESSING! move it to the end of the LRU
-                if (it!=this->begin()) {
-                    Line *tmp = *it;
-                    std::deque<Line *>::erase(it);
-                    this->push_front(tmp);
-                }
-		//NVLOG1("Found! entries %ld/%ld %s\n", this->size(), __capacity, this->str().c_str());
-                return this->front();
-            }
+        ReplSet rs = this->repl_set();
+        int slot = this->find(addr);
+        if (slot >= 0)
+        { // ELEMENT RE-ACCESSING! update the replacement state
+            const uint8_t way = slot2way[slot];
+            if (way < WAY_VICTIM) Policy::touch(rs, way);
+            return this->slot_line(slot);
         }
         // if we got to here, the element WAS NOT FOUND!
-	//NVLOG1("Adding! entries %ld/%ld %s\n", this->size(), __capacity, this->str().c_str());
-        this->push_front(new Line(addr));
-        // Maybe we have to remove one element?
-        if (this->size() > __capacity)
-        {
+        slot = this->find(LINE_ADDR_NONE);
+        assert(slot >= 0);
+        size_t way;
+        if (hdr->mapped < __capacity) {
+            for (way=0; way2slot[way]!=WAY_NONE; way++);
+            hdr->mapped++;
+        } else {
+            // we have to remove one element
+            way = Policy::victim(rs);
             overflow = true;
-            overflow_elem = this->back(); // remove last element
-	    //NVLOG1("overflow cap %ld/%ld: to remove %lx\n", this->size(), __capacity, overflow_elem->addr);
+            overflow_elem = this->slot_line(way2slot[way]);
+            slot2way[way2slot[way]] = WAY_VICTIM;
         }
-        return this->front();
+        tags[slot] = addr;
+        Line *line = new (this->slot_line(slot)) Line(addr);
+        if (__line_stride > sizeof(Line)) memset((uint8_t *)(line+1), 0, __line_stride - sizeof(Line));
+        slot2way[slot] = way;
+        way2slot[way] = slot;
+        hdr->size++;
+        Policy::insert(rs, way);
+        return line;
     }
     inline void clear() {
-        while (this->size() > 0)
-        {
-            assert(this->back()->pdata == NULL);
-            delete this->back();
-            this->pop_back();
+        for (size_t slot=0; slot<__slots; slot++) {
+            if (tags[slot]!=LINE_ADDR_NONE) {
+                assert(this->slot_line(slot)->pdata == NULL);
+            }
         }
-        // deque.clear() also has linear complexity, so it's OK to do it this way
+        this->reset();
     }
+    void reset();
     inline void erase(Line *to_rm) {
-	//NVLOG1("removing %lx addr %lx data 0x%lx from %s ", (Addr)to_rm, to_rm->addr, (Addr)to_rm->pdata, this->str().c_str());
-        for (iterator it = this->begin(); it!= this->end(); ++it)
-        {
-            //if ((*it)->addr == to_rm->addr) {
-            if (*it == to_rm) {
-                assert((*it)->pdata == NULL);
-                delete *it;
-                std::deque<Line *>::erase(it);
-		//NVLOG1("removed!\n");
-                return;
-            }
+        switch (repl_state->policy) {
+            case REPL_LRU: this->erase<ReplLRU>(to_rm); break;
+            case REPL_PLRU: this->erase<ReplPLRU>(to_rm); break;
+            case REPL_SRRIP: this->erase<ReplSRRIP>(to_rm); break;
+            case REPL_BRRIP: this->erase<ReplBRRIP>(to_rm); break;
+            case REPL_DIP: this->erase<ReplDIP>(to_rm); break;
+            case REPL_RANDOM: this->erase<ReplRandom>(to_rm); break;
+            default: assert(false && "invalid replacement policy");
         }
-	//NVLOG1("not found!\n");
+    }
+    template <class Policy>
+    inline void erase(Line *to_rm) {
+        const size_t slot = ((uint8_t *)to_rm - (uint8_t *)lines) / __line_stride;
+        assert(slot < __slots && tags[slot] == to_rm->addr);
+        assert(to_rm->pdata == NULL);
+        const uint8_t way = slot2way[slot];
+        if (way != WAY_VICTIM) {
+            ReplSet rs = this->repl_set();
+            Policy::erase(rs, way);
+            way2slot[way] = WAY_NONE;
+            hdr->mapped--;
         }
-        inline void rm_invalid_entries() {
-            for (iterator it = this->begin(); it!= this->end();)
-            {
-                if ((*it)->state>LINE_INV) {
-                    ++it;
-                } else {
-                    delete *it;
-                    it = std::deque<Line *>::erase(it);
-                }
+        tags[slot] = LINE_ADDR_NONE;
+        slot2way[slot] = WAY_NONE;
+        hdr->size--;
+    }
+    inline void rm_invalid_entries() {
+        for (size_t slot=0; slot<__slots; slot++) {
+            if (tags[slot]!=LINE_ADDR_NONE && this->slot_line(slot)->state==LINE_INV) {
+                this->erase(this->slot_line(slot));
             }
         }
-        inline bool exists(const Addr addr) {
-            for (iterator it = this->begin(); it!= this->end(); ++it)
-            {
-                if ((*it)->addr == addr) {
-                    return true;
-                }
-            }
-            return false;
+    }
+    inline bool exists(const Addr addr) const {
+        return this->find(addr) >= 0;
+    }
+private:
+    inline ReplSet repl_set() {
+        ReplSet rs;
+        rs.meta = repl;
+        rs.bits = &hdr->repl_bits;
+        rs.ways = __capacity;
+        rs.set = __set;
+        rs.state = repl_state;
+        return rs;
+    }
+};
+
+// Sets of the tag store are allocated in chunks of this many sets
+const size_t TAG_STORE_CHUNK_SETS = 64;
+// Chunks are carved from regions of this size (a large page), when the cache is big enough
+const size_t LARGE_PAGE_BYTES = 2*1024*1024;
+
+// All sets of a cache, laid out in cache-line-aligned chunks of TAG_STORE_CHUNK_SETS sets.
+// The sets are of the same size; my_cam views are handed out on demand.
+// A chunk is only allocated when one of its sets is first used, so a huge (DRAM) cache
+// costs only its directory (a pointer per chunk) until the application touches it.
+// Lookups that do not insert (is_materialized) never allocate.
+struct TagStore
+{
+    uint8_t **_dir;         // chunk directory; NULL for a chunk that was never used
+    ReplState _repl_state;
+    size_t _num_sets;
+    size_t _capacity;
+    size_t _num_slots;
+    size_t _tag_slots;
+    size_t _set_bytes;
+    size_t _off_hdr;
+    size_t _off_slot2way;
+    size_t _off_way2slot;
+    size_t _off_repl;
+    size_t _off_lines;
+    size_t _line_stride;
+    size_t _num_chunks;
+    size_t _chunk_shift;    // chunk = set >> _chunk_shift
+    size_t _chunk_bytes;
+    size_t _num_chunks_used;
+    size_t _region_bytes;
+    uint8_t *_region_free;  // unused rest of the last region
+    size_t _region_left;
+    std::vector<std::pair<uint8_t *, size_t> > _regions;
+
+    TagStore() : _dir(NULL), _num_sets(0), _capacity(0), _num_slots(0), _tag_slots(0), _set_bytes(0),
+        _off_hdr(0), _off_slot2way(0), _off_way2slot(0), _off_repl(0), _off_lines(0), _line_stride(sizeof(Line)),
+        _num_chunks(0), _chunk_shift(0), _chunk_bytes(0), _num_chunks_used(0),
+        _region_bytes(0), _region_free(NULL), _region_left(0) { }
+    ~TagStore();
+    void init(size_t num_sets, size_t capacity, ReplPolicy repl_policy);
+    void set_repl_policy(ReplPolicy repl_policy);
+    inline ReplPolicy get_repl_policy() const { return _repl_state.policy; }
+    // keep this many bytes after every Line; only allowed before any set is used
+    void set_line_extra_bytes(size_t bytes);
+    inline size_t size() const { return _num_sets; }
+    // a set that was never used is empty
+    inline bool is_materialized(size_t set) const { return _dir[set >> _chunk_shift] != NULL; }
+    inline size_t num_sets_materialized() const { return _num_chunks_used << _chunk_shift; }
+    // bytes of the directory and all allocated sets
+    size_t metadata_bytes() const;
+    // bring the tags and the header of a set into the host cache; never allocates
+    inline void prefetch(size_t set) const {
+        const uint8_t *chunk_base = _dir[set >> _chunk_shift];
+        if (chunk_base != NULL) {
+            const uint8_t *set_base = chunk_base + (set & ((1UL << _chunk_shift) - 1))*_set_bytes;
+            __builtin_prefetch(set_base);
+            __builtin_prefetch(set_base + _off_hdr);
         }
+    }
+    inline my_cam operator[](size_t set) {
+        uint8_t *chunk_base = _dir[set >> _chunk_shift];
+        if (__builtin_expect(chunk_base == NULL, 0)) {
+            chunk_base = this->materialize(set >> _chunk_shift);
+        }
+        return this->view(chunk_base + (set & ((1UL << _chunk_shift) - 1))*_set_bytes, set);
+    }
+private:
+    void layout();
+    uint8_t *materialize(size_t chunk);
+    inline my_cam view(uint8_t *set_base, size_t set) {
+        my_cam cam;
+        cam.tags = (Addr *)set_base;
+        cam.hdr = (my_cam_hdr *)(set_base + _off_hdr);
+        cam.slot2way = set_base + _off_slot2way;
+        cam.way2slot = set_base + _off_way2slot;
+        cam.repl = set_base + _off_repl;
+        cam.lines = (Line *)(set_base + _off_lines);
+        cam.repl_state = &_repl_state;
+        cam.__set = set;
+        cam.__capacity = _capacity;
+        cam.__slots = _num_slots;
+        cam.__tag_slots = _tag_slots;
+        cam.__line_stride = _line_stride;
+        return cam;
+    }
+    TagStore(const TagStore &);
+    TagStore &operator=(const TagStore &);
 };
 
 template <class T>
@@ -203,7 +375,7 @@ struct dbg_vector : std::vector<T>
     }
 };
 
-typedef dbg_vector<my_cam> tCacheEntries;
+typedef TagStore tCacheEntries;
 typedef GenericMemory *GenericMemoryPtr;
 
 struct CacheStats
@@ -216,9 +388,11 @@ struct CacheStats
     size_t misses_ld;
     size_t misses_st;
     size_t writebacks;
+    size_t sector_misses;
+    size_t victim_fills;
 
     CacheStats() :
-	ticks(0), hits(0), hits_rd(0), hits_wr(0), misses(0), misses_ld(0), misses_st(0), writebacks(0)
+	ticks(0), hits(0), hits_rd(0), hits_wr(0), misses(0), misses_ld(0), misses_st(0), writebacks(0), sector_misses(0), victim_fills(0)
     {};
     inline void reset() { ticks=0; hits=0; misses=0; }
     inline void ticks_inc(size_t cnt=1) { ticks+=cnt; }
@@ -229,6 +403,21 @@ struct CacheStats
     inline void misses_ld_inc(size_t cnt=1) { misses_ld+=cnt; }
     inline void misses_st_inc(size_t cnt=1) { misses_st+=cnt; }
     inline void writebacks_inc(size_t cnt=1) { writebacks+=cnt; }
+    inline void sector_misses_inc(size_t cnt=1) { sector_misses+=cnt; }
+    inline void victim_fills_inc(size_t cnt=1) { victim_fills+=cnt; }
+    // add the counts of other (e.g. of a shard of this cache)
+    inline void merge(const CacheStats &other) {
+        ticks += other.ticks;
+        hits += other.hits;
+        hits_rd += other.hits_rd;
+        hits_wr += other.hits_wr;
+        misses += other.misses;
+        misses_ld += other.misses_ld;
+        misses_st += other.misses_st;
+        writebacks += other.writebacks;
+        sector_misses += other.sector_misses;
+        victim_fills += other.victim_fills;
+    }
     inline std::ostream & dump(std::ostream &os, const char *prefix, size_t indentation) {
         os << nspaces(indentation).c_str() << prefix << ":\n";
         os << nspaces(indentation+4).c_str() << "Ticks: " << this->ticks << std::endl;
@@ -239,10 +428,37 @@ struct CacheStats
         os << nspaces(indentation+4).c_str() << "Misses Load: " << this->misses_ld << std::endl;
         os << nspaces(indentation+4).c_str() << "Misses Store: " << this->misses_st << std::endl;
         os << nspaces(indentation+4).c_str() << "Writebacks: " << this->writebacks << std::endl;
+        if (this->sector_misses) {
+            os << nspaces(indentation+4).c_str() << "Sector Misses: " << this->sector_misses << std::endl;
+        }
+        if (this->victim_fills) {
+            os << nspaces(indentation+4).c_str() << "Victim Fills: " << this->victim_fills << std::endl;
+        }
         return os;
     }
 };
 
+// One memory reference of a batch. The layout is plain (no padding to fill), so a tracer
+// can write references straight into an array of these (e.g. with INS_InsertFillBuffer).
+struct Access
+{
+    Addr addr;
+    uint32_t line_state;    // LINE_SHR for loads, LINE_MOD (or LINE_EXC) for stores
+    uint32_t reserved;
+};
+
+// Totals of access_batch calls; every call adds to them
+struct BatchResult
+{
+    size_t accesses;
+    size_t latency;
+    size_t hits;        // accesses that did not miss in the first level
+    BatchResult() : accesses(0), latency(0), hits(0) {}
+};
+
+// The sets of the references this far ahead are prefetched in every level
+const size_t ACCESS_BATCH_LOOKAHEAD = 8;
+
 struct GenericMemory
 {
     std::ofstream *_stats_file;
@@ -258,6 +474,8 @@ struct GenericMemory
     virtual void add_child(Cache *child)=0;
     virtual void reset()=0;
     virtual void line_data_writeback(Line *line)=0;
+    // modified data written to this memory by a child cache that has no parent cache
+    virtual void data_writeback(const Addr addr, const size_t bytes) {};
     virtual void reset_stats() {};
     virtual void dump_stats(const char *description=NULL, std::ofstream *stats_file=NULL, size_t indentation=4)=0;
     std::ofstream *get_stats_file() {
@@ -272,11 +490,25 @@ struct GenericMemory
     }
 };
 
+// The parent of a cache in the generic request path (see Cache::line_get_from)
+struct ParentMemory
+{
+    GenericMemory *memory;
+    explicit ParentMemory(GenericMemory *memory) : memory(memory) {}
+    inline void line_get_intercache(const Addr addr, const uint8_t line_state, size_t &latency,
+                                    const unsigned child_index, Line *&parent_line) {
+        memory->line_get_intercache(addr, line_state, latency, child_index, parent_line);
+    }
+    inline void line_replaced(Cache &cache, Line *line) {}
+};
+
 struct Cache;
 typedef dbg_vector<Cache*> childvec_t;
 struct ChildMemories : childvec_t
 {
     Cache *operator[](size_t idx) { return childvec_t :: at(idx);  }
+    // unchecked, for the walks over the sharers of a line
+    inline Cache *child(size_t idx) { return childvec_t :: operator[](idx); }
     void add_child(Cache *child);
     bool child_find_idx(Cache *child, int &child_index);
 };
@@ -302,6 +534,24 @@ struct Cache : GenericMemory
     size_t _associativity;
     int _line_size_bytes;
     size_t _hit_latency;
+    // set index = (addr >> _line_bits) & _set_mask, without the shard bits (see set_shard_bits)
+    size_t _line_bits;
+    size_t _set_mask;
+    size_t _shard_low_mask;
+    size_t _shard_bits;
+    // sector = (addr - line addr) >> _sector_bits; a line of an unsectored cache is one sector
+    size_t _sector_bits;
+    // sub-block = (addr - line addr) >> _subblock_bits; a sub-block is a line of the child
+    // with the smallest lines, or 1/64 of a line
+    size_t _subblock_bits;
+    // do not keep line data, only tags and states (see set_tag_only)
+    bool _tag_only;
+    // which children may hold a line (the format of Line::sharers)
+    SharerDirectory _sharers;
+    // inclusion of the lines of the children (see set_inclusion)
+    InclusionPolicy _inclusion;
+    // stack distance profile of the requests to this cache (see set_profiler); NULL for none
+    StackDistance *_profiler;
     bool _is_private_cache;
     bool _is_writeback_cache;
 #ifdef HAS_HTM
@@ -319,10 +569,11 @@ struct Cache : GenericMemory
             const size_t hit_latency=DEFAULT_CACHE_ACCESS_TICKS,
 #ifdef HAS_HTM
             const bool is_writeback=true,
-            CacheContainer *processor=NULL
+            CacheContainer *processor=NULL,
 #else
-            const bool is_writeback=true
+            const bool is_writeback=true,
 #endif
+            const ReplPolicy repl_policy=REPL_LRU
           ) :
         _name(name),
         _parent(parent_memory),
@@ -330,6 +581,9 @@ struct Cache : GenericMemory
         _associativity(capacity),
         _line_size_bytes(line_size_bytes),
         _hit_latency(hit_latency),
+        _tag_only(false),
+        _inclusion(INCLUSION_INCLUSIVE),
+        _profiler(NULL),
         _is_private_cache(true),
 #ifdef HAS_HTM
         _is_writeback_cache(is_writeback),
@@ -343,11 +597,14 @@ struct Cache : GenericMemory
             assert(is_power_of_2(line_size_bytes));
             assert(is_power_of_2(capacity));
             assert(hit_latency>=0);
+            _line_bits = (size_t)log2power2(line_size_bytes);
+            _set_mask = num_direct_entries-1;
+            _shard_low_mask = 0;
+            _shard_bits = 0;
+            _sector_bits = _line_bits;
+            _subblock_bits = _line_bits;
             // allocate all direct entries
-            _entries.resize(num_direct_entries);
-            for (size_t i=0; i<num_direct_entries; i++) {
-                _entries[i].set_capacity(capacity);
-            }
+            _entries.init(num_direct_entries, capacity, repl_policy);
             _parent_cache = dynamic_cast<Cache *>(_parent);
             // connect to a parent memory
             _parent->add_child(this);
@@ -361,18 +618,110 @@ struct Cache : GenericMemory
 
     virtual void line_get(const Addr addr, const uint8_t line_state, size_t &latency, uint8_t *&pdata);
     virtual void line_get_intercache(const Addr addr, const uint8_t line_state, size_t &latency, const unsigned child_index, Line *&parent_line);
+    // The request path of line_get and line_get_intercache, with the requests to the parent
+    // going to parent (ParentMemory, or the next level of a StaticHierarchy), which also
+    // sees every line that this cache replaces on the way (line_replaced).
+    template <class Parent>
+    void line_get_from(Parent &parent, const Addr addr, const uint8_t line_state_req, size_t &latency, uint8_t *&pdata);
+    template <class Parent>
+    void line_get_intercache_from(Parent &parent, const Addr addr, const uint8_t line_state_req, size_t &latency,
+                                  const unsigned child_index, Line *&parent_line);
+    // line_get for n references in order, prefetching the sets of the upcoming ones
+    void access_batch(const Access *refs, const size_t n, BatchResult &out);
+    // prefetch the set of addr in this cache and in all parent caches
+    inline void prefetch_sets(const Addr addr) {
+        for (Cache *cache=this; cache!=NULL; cache=cache->_parent_cache) {
+            cache->_entries.prefetch(cache->addr2directentry(addr));
+        }
+    }
     void line_data_get_internal(const Addr addr, uint8_t *&pdata);
     bool line_make_owner_in_child_caches(Line *line, unsigned child_index);
     virtual void line_evict(Addr addr);
     virtual void line_evict(Line *line);
+    // evict a replaced line; unlike line_evict this follows the inclusion policies
+    void line_replace(Line *line);
+    // replacing the line writes modified data back (its own, or that of a child's copy)
+    bool line_dirty(Line *line);
+    // A request of child_index would be served here without the parent: the line is here in
+    // a state that needs no request to the parent, and nothing is written back to it.
+    // Changes nothing; a victim (exclusive) cache never serves a request by itself.
+    bool line_serves(const Addr addr, const uint8_t line_state_req, const unsigned child_index);
+    // the children that may hold a line of the set of addr (one that a request to the set can
+    // invalidate, downgrade or replace): the sharers of its lines, or all children of a cache
+    // that does not include their lines
+    void set_sharers(const Addr addr, std::vector<bool> &children);
     virtual void line_rm(Line *line);
     virtual void line_rm_recursive(Addr addr);
+    virtual void data_writeback(const Addr addr, const size_t bytes);
     inline virtual int get_line_size() { return _line_size_bytes; }
+    inline ReplPolicy get_repl_policy() const { return _entries.get_repl_policy(); }
+    // select another replacement policy; only allowed while the cache is empty
+    inline void set_repl_policy(ReplPolicy repl_policy) { _entries.set_repl_policy(repl_policy); }
+    // Tag-only simulation: lines get no data buffers, so nothing is allocated, copied or freed,
+    // and line_get returns pdata=NULL. Hit/miss/writeback statistics stay the same.
+    // Applies to this cache and all its children.
+    void set_tag_only(bool tag_only);
+    inline bool is_tag_only() const { return _tag_only; }
+    // Sharer tracking format of this level (see sharers.h). The default exact bitmap grows
+    // with the number of children; only allowed while the cache is empty.
+    void set_sharer_format(SharerFormat format);
+    inline SharerFormat get_sharer_format() const { return _sharers.format; }
+    // sharer words kept after the line in the tag store (a wide sharer bitmap)
+    inline uint64_t *sharers_ext(Line *line) const { return (uint64_t *)(line+1); }
+    inline bool line_has_other_sharers(Line *line, size_t child_index) const {
+        size_t sharer;
+        SharerIter sharers = _sharers.iter(line->sharers, this->sharers_ext(line), child_index);
+        return sharers.next(sharer);
+    }
     inline bool is_line_present(const Addr addr) { return this->addr2line_internal(addr)!=NULL; }
     size_t get_num_valid_entries();
     size_t get_num_valid_entries(size_t direct_entry);
+    // Sectored lines: a line is allocated as a whole, but its sectors are fetched from
+    // the parent and written back separately (with per-sector valid and dirty bits).
+    // A sector has to hold a whole child line; only allowed while the cache is empty.
+    void set_sector_size(size_t sector_bytes);
+    inline size_t get_sector_size() const { return 1UL << _sector_bits; }
+    inline uint64_t sector_bit(const Line *line, const Addr addr) const {
+        return 1ULL << ((addr - line->addr) >> _sector_bits);
+    }
+    template <class Parent>
+    inline void sector_fetch(Parent &parent, Line *line, const Addr addr, size_t &latency) {
+        NVLOG1("%s\tsector_fetch 0x%lx sectors 0x%lx\n", this->_name.c_str(), addr, line->sector_valid);
+        parent.line_get_intercache(addr, LINE_SHR, latency, _index_in_parent, line->parent_line);
+        this->stats.sector_misses_inc();
+    }
+    inline uint64_t subblock_bit(const Line *line, const Addr addr) const {
+        return 1ULL << ((addr - line->addr) >> _subblock_bits);
+    }
+    inline Addr subblock_addr(const Line *line, const uint64_t subblocks) const {
+        return line->addr + ((Addr)__builtin_ctzll(subblocks) << _subblock_bits);
+    }
+    inline Addr subblock_bytes() const { return (Addr)1 << _subblock_bits; }
+    // simulator memory used for the tags and states of this cache
+    // Inclusion of the children's lines (see InclusionPolicy); only allowed while the cache
+    // is empty. An exclusive cache needs child lines of its sector size.
+    void set_inclusion(InclusionPolicy inclusion);
+    inline InclusionPolicy get_inclusion() const { return _inclusion; }
+    // this cache, or a child of a non-inclusive cache, has the line in one of the states
+    bool line_held(const Addr addr, const uint8_t states=LINE_SHR|LINE_EXC|LINE_MOD);
+    inline size_t get_metadata_bytes() const { return _entries.metadata_bytes(); }
+    inline size_t get_num_sets_used() const { return _entries.num_sets_materialized(); }
+    // Feeds the requests from above (line_get, line_get_intercache) and the modified data
+    // written back by the children to profiler, which the caller owns; NULL stops it.
+    // The profile is that of an inclusive LRU level: for an exclusive level, whose lines
+    // come from the victims of its children, it is an approximation.
+    inline void set_profiler(StackDistance *profiler) { _profiler = profiler; }
+    void profile_access(const Addr addr, const uint8_t line_state_req);
+    void profile_writeback(const Addr addr);
     virtual void add_child(Cache *child);
-    size_t addr2directentry(Addr addr);
+    inline size_t addr2directentry(Addr addr) const {
+        const size_t entry = (size_t)(addr >> _line_bits);
+        return ((entry & _shard_low_mask) | ((entry >> _shard_bits) & ~_shard_low_mask)) & _set_mask;
+    }
+    // The cache holds the sets of one shard: address bits [low_bit, low_bit+bits), which all
+    // addresses of the shard have in common, are left out of the set index.
+    // Only allowed on an empty cache.
+    void set_shard_bits(size_t low_bit, size_t bits);
     void flush_data();
     virtual void reset();
     virtual void reset_stats();
@@ -387,6 +736,12 @@ struct Cache : GenericMemory
     void line_writer_to_sharer(Line *line, size_t &latency, bool children_only=false);
     void line_get_as_modified(Addr addr);
     void line_mark_in_parent(Addr addr, uint8_t line_state_req, size_t &latency);
+    // non-inclusive levels
+    void line_evict_children(Line *line);
+    void line_detach_children(Line *line);
+    void line_snoop_children(const Addr addr, const size_t bytes, Line *line, const uint8_t line_state_req, const unsigned child_index, size_t &latency);
+    void line_hand_over(Line *child_line);
+    void line_victim_fill(Line *child_line, const unsigned child_index);
 
     Line *addr2line_internal(const Addr addr, const bool search_reverse=false);
     Line *addr2line(const Addr addr, bool &overflow, Line *&overflow_line);
@@ -395,6 +750,470 @@ struct Cache : GenericMemory
     friend std::ostream & operator<<(std::ostream &cout, Cache &obj);
 };
 
+// The request path of a cache (see Cache::line_get_from). It is here, in the header, so that
+// a StaticHierarchy can instantiate it with the next level as the parent.
+template <class Parent>
+void
+Cache :: line_get_from(Parent &parent, const Addr addr, const uint8_t line_state_req, size_t &latency, uint8_t *&pdata)
+{
+    //////////////////////////////////////////////////////////////////
+    //
+    //  proudly serving cache requests
+    //  since september 2008
+    //
+    //////////////////////////////////////////////////////////////////
+    //
+    // line_state_req(uest) values:
+    // LINE_SHR - request a read
+    // LINE_EXC - request an exclusive access (invalidate other readers)
+    // LINE_MOD - perform a write (invalidate other readers and mark line as dirty)
+
+    bool set_overflow = false;
+    Line *overflow_line = NULL;
+    // this adds a line (if it's not already in the cache) but with LINE_INV state
+    Line *line = addr2line(addr, set_overflow, overflow_line);
+    // if some line has been replaced, get the value and evict/invalidate the same line and its parts
+    // in all child caches
+    if (set_overflow) {
+        NVLOG1("%s\tline_get overflow 0x%lx\n", _name.c_str(), overflow_line->addr);
+        parent.line_replaced(*this, overflow_line);
+        this->line_replace(overflow_line);
+    }
+    uint8_t __attribute__((unused)) line_state_orig = line->state;
+    uint64_t __attribute__((unused)) line_sharers_orig = line->sharers;
+
+    bool hit = true;
+    size_t old_ticks = latency;
+
+    // a sectored line can be here without the requested sector
+    const uint64_t sector = this->sector_bit(line, addr);
+    bool sector_miss = false;
+    if (line->state == LINE_INV) {
+        line->sector_valid = 0;
+        line->sector_dirty = 0;
+    } else if (!(line->sector_valid & sector)) {
+        this->sector_fetch(parent, line, addr, latency);
+        sector_miss = true;
+    }
+
+    if (line->state & LINE_MOD)
+    {
+        switch (line_state_req) {
+            case LINE_MOD:
+            case LINE_EXC:
+            case LINE_SHR:
+                break;
+            default:
+                assert(!"invalid line_state request!");
+        }
+    }
+    else if (line->state & LINE_EXC)
+    { // line is EXCLUSIVE when it is not modified and there is no other line sharer
+        // TODO update the functionality to reflect this;
+        // first line sharer should automatically get exclusive access;
+        // this exclusive access should be reduced to shared when another core requests line copy (for read)
+        switch (line_state_req) {
+            case LINE_MOD:
+                if (_is_writeback_cache || !_parent_cache) {
+                    // mark line as dirty (for writeback)
+                    line->state |= line_state_req;
+                } else {
+                    // write latency should include writing to the parent
+                    parent.line_get_intercache(addr, line_state_req, latency, _index_in_parent, line->parent_line);
+                    // TODO should also write data to the parent cache
+                    hit = false;
+                    break;
+                }
+            case LINE_EXC:
+            case LINE_SHR:
+                break;
+            default:
+                assert(!"invalid line_state request!");
+        }
+    }
+    else if (line->state & LINE_SHR)
+    {
+        switch (line_state_req) {
+            case LINE_MOD:
+            case LINE_EXC:
+                if (_parent_cache) {
+                    if (_is_writeback_cache) {
+                        parent.line_get_intercache(addr, LINE_EXC, latency, _index_in_parent, line->parent_line);
+                    } else {
+                        parent.line_get_intercache(addr, line_state_req, latency, _index_in_parent, line->parent_line);
+                    }
+                    hit = false;
+                }
+                line->state |= line_state_req;
+                break;
+            case LINE_SHR:
+                break;
+            default:
+                assert(!"invalid line_state request!");
+        }
+    }
+    else if (line->state == LINE_INV)
+    {
+        hit = false;
+        switch (line_state_req) {
+            case LINE_TXW:
+            case LINE_TXR:
+                parent.line_get_intercache(addr, LINE_SHR, latency, _index_in_parent, line->parent_line);
+                line->state |= line->parent_line->state & ( LINE_TXR | LINE_TXW);
+                line->state |= (LINE_SHR | line_state_req);
+                break;
+            case LINE_MOD:
+            case LINE_EXC:
+                if (_is_writeback_cache) {
+                    parent.line_get_intercache(addr, LINE_EXC, latency, _index_in_parent, line->parent_line);
+                } else {
+                    parent.line_get_intercache(addr, line_state_req, latency, _index_in_parent, line->parent_line);
+                }
+                line->state |= line_state_req;
+                break;
+            case LINE_SHR:
+                parent.line_get_intercache(addr, LINE_SHR, latency, _index_in_parent, line->parent_line);
+                line->state |= line_state_req;
+                break;
+            default:
+                assert(!"invalid line_state request!");
+        }
+    }
+    else
+    {
+        NVLOG_ERROR("invalid current line_state %x\n", line->state);
+        assert(false && "invalid current line_state!");
+    }
+    line->sector_valid |= sector;
+    if ((line->state & LINE_MOD) && line_state_req == LINE_MOD) {
+        line->sector_dirty |= sector;
+    }
+    if (sector_miss) hit = false;
+
+
+    if (line->pdata == NULL && !_tag_only) {
+        line->pdata = (uint8_t*)malloc(get_line_size());
+        if (_parent_cache && line->parent_line && line->parent_line->pdata) { // if data found in parent cache
+            NVLOG1("%s\tline_get data copy from %s 0x%lx data 0x%lx -> 0x%lx\n", this->_name.c_str(), _parent_cache->_name.c_str(), line->addr, (Addr)line->parent_line->pdata, (Addr)line->pdata);
+            memcpy(line->pdata, line->parent_line->pdata+(line->addr - line->parent_line->addr), get_line_size());
+        } else {
+            // get the data from the memory
+            NVLOG1("%s\tline_get data copy from memory 0x%lx data -> 0x%lx\n", this->_name.c_str(), line->addr, (Addr)line->pdata);
+	    //Fault fault = rw_array_silent(line->addr, get_line_size(), line->pdata, false/*READ*/);
+	    //assert(fault == NoFault);
+        }
+    }
+    if (_parent_cache && line->parent_line && _parent_cache->_inclusion == INCLUSION_EXCLUSIVE) {
+        _parent_cache->line_hand_over(line);
+    }
+    pdata = line->pdata;
+
+    latency += _hit_latency;
+    // update statistics
+    if (hit) {
+        this->stats.hits_inc();
+    } else {
+        this->stats.misses_inc();
+        if (line_state_req & LINE_MOD || line_state_req & LINE_EXC)
+        { this->stats.misses_st_inc(); }
+        else
+        { this->stats.misses_ld_inc(); }
+    }
+    this->stats.ticks_inc(latency - old_ticks);
+    NVLOG1("%s\tline_get 0x%lx\t state %s->%s sharers 0x%lx->0x%lx\n",  _name.c_str(),  line->addr,  state2str(line_state_orig).c_str(), state2str(line->state).c_str(), line_sharers_orig, line->sharers);
+    assert(! ((line->state & (LINE_MOD | LINE_EXC)) && (line->state & LINE_TXW)) );
+    // profiled after the request, so that the writebacks of its evictions see the stack before it
+    if (__builtin_expect(_profiler != NULL, 0)) this->profile_access(addr, line_state_req);
+}
+
+template <class Parent>
+void
+Cache :: line_get_intercache_from(Parent &parent, const Addr addr, const uint8_t line_state_req, size_t &latency, const unsigned child_index, Line *&parent_line)
+{
+    //////////////////////////////////////////////////////////////////////
+    // serving line relocations inside the cache hierarchy
+    //////////////////////////////////////////////////////////////////////
+
+    if (_inclusion == INCLUSION_EXCLUSIVE) {
+        Line *line = addr2line_internal(addr);
+        if (line == NULL || line->state == LINE_INV || !(line->sector_valid & this->sector_bit(line, addr))) {
+            // a miss in a victim cache: the line goes from the parent straight to the child
+            size_t old_ticks = latency;
+            const size_t child_line_bytes = _children.child(child_index)->_line_size_bytes;
+            this->line_snoop_children(floor(addr, child_line_bytes), child_line_bytes, NULL, line_state_req, child_index, latency);
+            Line *bypassed_line = NULL;
+            const uint8_t parent_state_req = (_is_writeback_cache && (line_state_req & (LINE_MOD | LINE_EXC))) ? LINE_EXC : line_state_req;
+            parent.line_get_intercache(addr, parent_state_req, latency, _index_in_parent, bypassed_line);
+            parent_line = NULL;
+            if (line && line->state != LINE_INV) {
+                // other sectors of the line stay here; evicting it has to find this one in the child
+                _sharers.add(line->sharers, this->sharers_ext(line), child_index);
+                line->child_subblocks |= this->subblock_bit(line, addr);
+            }
+            latency += _hit_latency;
+            this->stats.misses_inc();
+            if (line_state_req & (LINE_MOD | LINE_EXC))
+            { this->stats.misses_st_inc(); }
+            else
+            { this->stats.misses_ld_inc(); }
+            this->stats.ticks_inc(latency - old_ticks);
+            NVLOG1("%s\tline_get 0x%lx\t bypassed to the child\n", _name.c_str(), addr);
+            if (__builtin_expect(_profiler != NULL, 0)) this->profile_access(addr, line_state_req);
+            return;
+        }
+    }
+
+    bool set_overflow = false;
+    Line *overflow_line = NULL;
+    // this adds a line (if it's not already in the cache) but with LINE_INV state
+    Line *line = addr2line(addr, set_overflow, overflow_line);
+    if (set_overflow) {
+        // if some line has been replaced, get the value and invalidate the same line and its parts
+        // in all child caches
+        NVLOG1("%s\tline_get overflow 0x%lx\n", _name.c_str(), overflow_line->addr);
+        parent.line_replaced(*this, overflow_line);
+        this->line_replace(overflow_line);
+    }
+    uint8_t __attribute__((unused)) line_state_orig = line->state;
+    uint64_t __attribute__((unused)) line_sharers_orig = line->sharers;
+
+    bool hit = true;
+    size_t old_ticks = latency;
+    if (line->state == LINE_INV && _inclusion != INCLUSION_INCLUSIVE) {
+        // the children may have kept parts of the line after this cache evicted it
+        this->line_snoop_children(line->addr, _line_size_bytes, line, line_state_req, child_index, latency);
+    }
+
+    // a sectored line can be here without the requested sector
+    const uint64_t sector = this->sector_bit(line, addr);
+    bool sector_miss = false;
+    if (line->state == LINE_INV) {
+        line->sector_valid = 0;
+        line->sector_dirty = 0;
+    } else if (!(line->sector_valid & sector)) {
+        this->sector_fetch(parent, line, addr, latency);
+        sector_miss = true;
+    }
+
+    if (line->state & (LINE_MOD | LINE_EXC))
+    {
+        // this directory already owns a line (exclusively)
+        // just in case we'll invalidate the line in
+        // all other child-caches
+        switch (line_state_req) {
+            case LINE_MOD:
+                if (!_sharers.is_only(line->sharers, this->sharers_ext(line), child_index)) {
+                    this->line_make_owner_in_child_caches(line, child_index);
+                }
+                if (_is_writeback_cache || !_parent_cache) {
+                    line->state |= line_state_req;
+                } else {
+                    parent.line_get_intercache(addr, line_state_req, latency, _index_in_parent, line->parent_line);
+                    hit = false;
+                    break;
+                }
+                break;
+            case LINE_EXC:
+                // this processor wants to have an exclusive copy
+                // (and it didn't have it until now, as we got an intercache request)
+                if (!_sharers.is_only(line->sharers, this->sharers_ext(line), child_index)) {
+                    this->line_make_owner_in_child_caches(line, child_index);
+                }
+                break;
+            case LINE_SHR:
+                if (_inclusion == INCLUSION_EXCLUSIVE && !this->line_has_other_sharers(line, child_index)) {
+                    // the line moves to the child as it is (line_hand_over)
+                    _sharers.add(line->sharers, this->sharers_ext(line), child_index);
+                } else if (!_sharers.is_only(line->sharers, this->sharers_ext(line), child_index)) {
+                    this->line_writer_to_sharer(line, latency);
+                    // and do not write the data up in the memory hierarchy
+                    _sharers.add(line->sharers, this->sharers_ext(line), child_index);
+                }
+                break;
+            default:
+                assert(!"invalid line_state request!");
+        }
+        //assert(line_state_req == LINE_SHR || line_state_req == LINE_EXC || line_state_req == LINE_MOD);
+        line->state |= line_state_req; // we might also reduce from writer to LINE_SHR in this cache
+    }
+    else if (line->state & LINE_SHR)
+    {
+        switch (line_state_req) {
+            case LINE_MOD:
+            case LINE_EXC:
+                this->line_make_owner_in_child_caches(line, child_index);
+                if (_parent_cache) {
+                    if (_is_writeback_cache) {
+                        parent.line_get_intercache(addr, LINE_EXC, latency, _index_in_parent, line->parent_line);
+                    } else {
+                        parent.line_get_intercache(addr, line_state_req, latency, _index_in_parent, line->parent_line);
+                    }
+                    hit = false;
+                }
+                line->state |= line_state_req;
+                break;
+            case LINE_SHR:
+                _sharers.add(line->sharers, this->sharers_ext(line), child_index);
+                break;
+            default:
+                assert(!"invalid line_state request!");
+        }
+    }
+    else if (line->state == LINE_INV)
+    {
+        hit = false;
+        switch (line_state_req) {
+            case LINE_MOD:
+            case LINE_EXC:
+                if (_is_writeback_cache) {
+                    parent.line_get_intercache(addr, LINE_EXC, latency, _index_in_parent, line->parent_line);
+                } else {
+                    parent.line_get_intercache(addr, line_state_req, latency, _index_in_parent, line->parent_line);
+                }
+                if (line->parent_line) { line->state = line->parent_line->state; }
+                line->state |= line_state_req;
+                _sharers.add(line->sharers, this->sharers_ext(line), child_index);
+                break;
+            case LINE_SHR:
+                parent.line_get_intercache(addr, LINE_SHR, latency, _index_in_parent, line->parent_line);
+                if (line->parent_line) { line->state = line->parent_line->state; }
+                line->state |= line_state_req;
+                _sharers.add(line->sharers, this->sharers_ext(line), child_index);
+                break;
+            default:
+                assert(!"invalid line_state request!");
+        }
+    }
+    else
+    {
+        NVLOG_ERROR("invalid current line_state %x\n", line->state);
+        assert(false && "invalid current line_state!");
+    }
+    line->sector_valid |= sector;
+    if ((line->state & LINE_MOD) && line_state_req == LINE_MOD) {
+        line->sector_dirty |= sector;
+    }
+    if (sector_miss) hit = false;
+    line->child_subblocks |= this->subblock_bit(line, addr);
+
+    if (line->pdata == NULL && !_tag_only) {
+        line->pdata = (uint8_t*)malloc(get_line_size());
+        if (_parent_cache && line->parent_line && line->parent_line->pdata) { // if data found in any parent cache
+            NVLOG1("%s\tline_get data copy from %s 0x%lx data 0x%lx -> 0x%lx\n", this->_name.c_str(), _parent_cache->_name.c_str(), line->addr, (Addr)line->parent_line->pdata, (Addr)line->pdata);
+            memcpy(line->pdata, line->parent_line->pdata+(line->addr - line->parent_line->addr), get_line_size());
+        } else {
+            // get the data from the memory
+            NVLOG1("%s\tline_get data copy from memory 0x%lx data 0x%lx\n", this->_name.c_str(), line->addr, (Addr)line->pdata);
+//            Fault fault = rw_array_silent(line->addr, get_line_size(), line->pdata, false/*READ*/);
+//            assert(fault == NoFault);
+        }
+    }
+    if (_parent_cache && line->parent_line && _parent_cache->_inclusion == INCLUSION_EXCLUSIVE) {
+        _parent_cache->line_hand_over(line);
+    }
+    parent_line = line;
+
+    latency += _hit_latency;
+    // update statistics
+    if (hit) {
+        this->stats.hits_inc();
+    } else {
+        this->stats.misses_inc();
+        if (line_state_req & LINE_MOD || line_state_req & LINE_EXC)
+        { this->stats.misses_st_inc(); }
+        else
+        { this->stats.misses_ld_inc(); }
+    }
+    this->stats.ticks_inc(latency - old_ticks);
+    NVLOG1("%s\tline_get 0x%lx\t state %s->%s sharers 0x%lx->0x%lx\n",  _name.c_str(),  line->addr,  state2str(line_state_orig).c_str(), state2str(line->state).c_str(), line_sharers_orig, line->sharers);
+    assert(! ((line->state & (LINE_MOD | LINE_EXC)) && (line->state & LINE_TXW)) );
+    // profiled after the request, so that the writebacks of its evictions see the stack before it
+    if (__builtin_expect(_profiler != NULL, 0)) this->profile_access(addr, line_state_req);
+}
+
+// A cache with its geometry fixed at compile time, for a hierarchy that is fully known
+// (like the one in nvramsim). Set indexing and tag extraction are constant shifts and masks,
+// the tag compare has a constant length, and a hit that needs no coherence action is served
+// inline, without virtual calls. Everything else goes to the generic Cache code, so the
+// behaviour (and statistics) are the same as those of a Cache(Sets, Ways, LineBytes).
+template <size_t Sets, size_t Ways, size_t LineBytes>
+struct StaticCache : Cache
+{
+    static const size_t LINE_BITS = log2compiletime(LineBytes);
+    static const Addr LINE_MASK = ~(Addr)(LineBytes-1);
+    static const size_t SET_MASK = Sets-1;
+    static const size_t TAG_SLOTS = (Ways+1 + TAG_MATCH_STEP-1) / TAG_MATCH_STEP * TAG_MATCH_STEP;
+
+    StaticCache (
+            std::string name,
+            GenericMemoryPtr parent_memory,
+            const size_t hit_latency=DEFAULT_CACHE_ACCESS_TICKS,
+#ifdef HAS_HTM
+            const bool is_writeback=true,
+            CacheContainer *processor=NULL,
+#else
+            const bool is_writeback=true,
+#endif
+            const ReplPolicy repl_policy=REPL_LRU
+          ) :
+#ifdef HAS_HTM
+        Cache(name, parent_memory, Sets, Ways, LineBytes, hit_latency, is_writeback, processor, repl_policy)
+#else
+        Cache(name, parent_memory, Sets, Ways, LineBytes, hit_latency, is_writeback, repl_policy)
+#endif
+        {
+            COMPILE_TIME_ASSERT(is_power_of_2(Sets) && is_power_of_2(Ways) && is_power_of_2(LineBytes));
+            assert(_entries._tag_slots == TAG_SLOTS);
+        }
+
+    static inline size_t set_index(const Addr addr) { return (size_t)(addr >> LINE_BITS) & SET_MASK; }
+
+    // serves a hit that needs no coherence action; false if the generic code has to run
+    inline bool line_hit(const Addr addr, const uint8_t line_state_req, size_t &latency, uint8_t *&pdata)
+    {
+        my_cam cam = _entries[set_index(addr)];
+        const int slot = tag_match(cam.tags, TAG_SLOTS, addr & LINE_MASK);
+        if (slot >= 0) {
+            Line *line = cam.slot_line(slot);
+            const uint8_t __attribute__((unused)) line_state_orig = line->state;
+            bool hit;
+            bool upgrade = false;
+            if (line->state & LINE_MOD) {
+                hit = (line_state_req & (LINE_MOD | LINE_EXC | LINE_SHR)) != 0;
+            } else if (line->state & LINE_EXC) {
+                upgrade = (line_state_req == LINE_MOD && (_is_writeback_cache || !_parent_cache));
+                hit = upgrade || line_state_req == LINE_EXC || line_state_req == LINE_SHR;
+            } else {
+                hit = (line->state & LINE_SHR) && line_state_req == LINE_SHR;
+            }
+            const uint64_t sector = this->sector_bit(line, addr);
+            // a line linked to a victim (exclusive) parent has to be handed over by the generic code
+            if (hit && (line->sector_valid & sector) && (line->pdata != NULL || _tag_only) &&
+                !(_parent_cache && line->parent_line && _parent_cache->_inclusion == INCLUSION_EXCLUSIVE)) {
+                if (upgrade) line->state |= LINE_MOD;
+                if (__builtin_expect(_profiler != NULL, 0)) this->profile_access(addr, line_state_req);
+                if (line_state_req == LINE_MOD) line->sector_dirty |= sector;
+                cam.touch(slot);
+                pdata = line->pdata;
+                latency += _hit_latency;
+                this->stats.hits_inc();
+                this->stats.ticks_inc(_hit_latency);
+                NVLOG1("%s\tline_get 0x%lx\t state %s->%s sharers 0x%lx->0x%lx\n",  _name.c_str(),  line->addr,  state2str(line_state_orig).c_str(), state2str(line->state).c_str(), line->sharers, line->sharers);
+                return true;
+            }
+        }
+        return false;
+    }
+    inline virtual void line_get(const Addr addr, const uint8_t line_state_req, size_t &latency, uint8_t *&pdata)
+    {
+        if (!line_hit(addr, line_state_req, latency, pdata)) {
+            // a miss or a coherence action
+            Cache::line_get(addr, line_state_req, latency, pdata);
+        }
+    }
+    inline virtual int get_line_size() { return LineBytes; }
+};
+
 struct MainMemory : GenericMemory
 {
 	Addr _address_space_size;
@@ -415,7 +1234,7 @@ struct MainMemory : GenericMemory
 		assert(hit_latency_read>=0);
 		assert(hit_latency_write>=0);
 	}
-	virtual void line_get(const Addr addr, const uint8_t line_state_req, size_t &latency, uint8_t *&pdata)
+	inline void access(const Addr addr, const uint8_t line_state_req, size_t &latency)
 	{
 		if (line_state_req==LINE_SHR) {
 			latency += _hit_latency_read;
@@ -431,6 +1250,10 @@ struct MainMemory : GenericMemory
 		}
 		stats.hits_inc();
 	}
+	virtual void line_get(const Addr addr, const uint8_t line_state_req, size_t &latency, uint8_t *&pdata)
+	{
+		this->access(addr, line_state_req, latency);
+	}
 	virtual void line_get_intercache(
 			const Addr addr,
 			const uint8_t line_state_req,
@@ -438,19 +1261,7 @@ struct MainMemory : GenericMemory
 			const unsigned child_index,
 			Line *&parent_line)
 	{
-		if (line_state_req==LINE_SHR) {
-			latency += _hit_latency_read;
-			stats.ticks_inc(_hit_latency_read);
-			stats.hits_rd_inc();
-		} else if (line_state_req == LINE_MOD || line_state_req == LINE_EXC) {
-			latency += _hit_latency_write;
-			stats.ticks_inc(_hit_latency_write);
-			stats.hits_wr_inc();
-		} else {
-			std::cerr << (void *)addr << " request for state: " << state2str(line_state_req) << "\n";
-			assert(false && "Unhandled line_state_req");
-		}
-		stats.hits_inc();
+		this->access(addr, line_state_req, latency);
 	}
 	virtual void line_evict(Addr addr) {assert(false);}
 	virtual void line_evict(Line *line) {assert(false);}
@@ -509,22 +1320,170 @@ struct MainMemory : GenericMemory
 		}
 		//*stats_file << this->_name.c_str() << " statistics dump.\n";
 		this->stats.dump(*stats_file, "- PCM", indentation);
+		this->dump_device_stats(*stats_file, indentation);
 
 		childvec_t :: const_iterator citer;
 		for (citer=_children.begin(); citer!=_children.end(); citer++) {
 			(*citer)->dump_stats(NULL, stats_file, indentation+4);
 		}
 	}
+	// the statistics of a device model behind the memory (see PcmMemory)
+	virtual void dump_device_stats(std::ofstream &stats_file, size_t indentation) {}
 	//  virtual size_t get_num_valid_entries() {return MIN2((size_t)-1, (size_t)_address_space_size);};
 	virtual void line_data_writeback(Line *line) {
 		stats.writebacks_inc();
 		stats.ticks_inc(_hit_latency_write);
 	}
+	virtual void data_writeback(const Addr addr, const size_t bytes) {
+		stats.writebacks_inc();
+		stats.ticks_inc(_hit_latency_write);
+	}
 	virtual void add_child(Cache *child) {
 		_children.add_child(child);
 	};
 };
 
 
+// Outcome of one access walked through a StaticHierarchy
+struct AccessResult
+{
+    size_t hit_level;   // 0 for the first level; the last level (main memory) always hits
+    size_t latency;
+    size_t writebacks;  // modified lines the access replaced in the levels it filled
+};
+
+struct HierarchyEnd {};
+
+// A hierarchy composed at compile time, from the first level down to main memory:
+//   StaticHierarchy<L1_t, StaticHierarchy<L2_t, StaticHierarchy<MainMemory> > >
+//       hierarchy(L1, StaticHierarchy<L2_t, StaticHierarchy<MainMemory> >(L2, PCM));
+// access() serves a first-level hit inline, without a single virtual call. A miss walks
+// down the levels: every level runs the generic request path (Cache::line_get_from), and
+// its requests to the parent go straight to the next level, again inline, down to the
+// level that has the line. The walk itself records the deepest level it reached (the hit
+// level) and the modified lines replaced on the way, so nothing else that uses the same
+// levels (another hierarchy over a shared level) changes the result.
+// The levels above the last have to be StaticCaches, each the parent of the one before.
+template <class Level, class Next=HierarchyEnd>
+struct StaticHierarchy
+{
+    Level &level;
+    Next next;
+
+    StaticHierarchy(Level &level, const Next &next=Next()) :
+        level(level), next(next)
+    {
+        assert(level._parent == (GenericMemory *)&next.level);
+    }
+
+    // the requests of the level, walked to the next one
+    struct Parent
+    {
+        Next &next;
+        AccessResult &result;
+        size_t depth;           // of the next level
+        inline void line_get_intercache(const Addr addr, const uint8_t line_state_req, size_t &latency,
+                                        const unsigned child_index, Line *&parent_line) {
+            result.hit_level = MAX2(result.hit_level, depth);
+            next.line_get_intercache(addr, line_state_req, latency, child_index, parent_line, result, depth);
+        }
+        inline void line_replaced(Cache &cache, Line *line) {
+            result.writebacks += cache.line_dirty(line);
+        }
+    };
+
+    inline AccessResult access(const Addr addr, const uint8_t line_state_req, uint8_t *&pdata)
+    {
+        AccessResult result;
+        result.hit_level = 0;
+        result.latency = 0;
+        result.writebacks = 0;
+        if (__builtin_expect(level.line_hit(addr, line_state_req, result.latency, pdata), 1)) {
+            return result;
+        }
+        Parent parent = { next, result, 1 };
+        level.line_get_from(parent, addr, line_state_req, result.latency, pdata);
+        return result;
+    }
+    // a request of the level before, depth levels down
+    inline void line_get_intercache(const Addr addr, const uint8_t line_state_req, size_t &latency,
+                                    const unsigned child_index, Line *&parent_line, AccessResult &result, size_t depth)
+    {
+        Parent parent = { next, result, depth + 1 };
+        level.line_get_intercache_from(parent, addr, line_state_req, latency, child_index, parent_line);
+    }
+    // The level that would serve an access that missed in the first level, found without
+    // changing anything: the first level below that serves the request of the level above
+    // by itself (see Cache::line_serves). The access reaches no level below it.
+    inline size_t probe(const Addr addr, const uint8_t line_state_req)
+    {
+        return next.probe(level, addr, line_state_req, 1);
+    }
+    // probe() == 1, looking at the first two levels only (the levels below can be changed
+    // meanwhile by other hierarchies that share them)
+    inline bool next_serves(const Addr addr, const uint8_t line_state_req)
+    {
+        return next.serves(level, addr, line_state_req);
+    }
+    // the request of child (the level before) for an access it could not serve
+    static inline uint8_t child_request(Cache &child, const uint8_t line_state_req)
+    {
+        // a write-back child asks for the line exclusively
+        return (line_state_req == LINE_SHR || !child._is_writeback_cache) ? line_state_req : LINE_EXC;
+    }
+    inline bool serves(Cache &child, const Addr addr, const uint8_t line_state_req)
+    {
+        return level.line_serves(addr, child_request(child, line_state_req), child._index_in_parent);
+    }
+    // the same as probe() for a request that child could not serve, depth levels down
+    inline size_t probe(Cache &child, const Addr addr, const uint8_t line_state_req, size_t depth)
+    {
+        if (this->serves(child, addr, line_state_req)) {
+            return depth;
+        }
+        return next.probe(level, addr, child_request(child, line_state_req), depth + 1);
+    }
+    // Cache::access_batch through the walker
+    inline void access_batch(const Access *refs, const size_t n, BatchResult &out)
+    {
+        uint8_t *pdata;
+        for (size_t i=0; i<MIN2(n, ACCESS_BATCH_LOOKAHEAD); i++) {
+            level.prefetch_sets(refs[i].addr);
+        }
+        for (size_t i=0; i<n; i++) {
+            if (i + ACCESS_BATCH_LOOKAHEAD < n) {
+                level.prefetch_sets(refs[i + ACCESS_BATCH_LOOKAHEAD].addr);
+            }
+            const AccessResult result = this->access(refs[i].addr, (uint8_t)refs[i].line_state, pdata);
+            out.latency += result.latency;
+            out.hits += (result.hit_level == 0);
+        }
+        out.accesses += n;
+    }
+};
+
+// the main memory at the end of a StaticHierarchy
+template <class Level>
+struct StaticHierarchy<Level, HierarchyEnd>
+{
+    Level &level;
+
+    StaticHierarchy(Level &level, const HierarchyEnd & =HierarchyEnd()) : level(level) {}
+
+    inline void line_get_intercache(const Addr addr, const uint8_t line_state_req, size_t &latency,
+                                    const unsigned child_index, Line *&parent_line, AccessResult &result, size_t depth)
+    {
+        level.Level::line_get_intercache(addr, line_state_req, latency, child_index, parent_line);
+    }
+    inline bool serves(Cache &child, const Addr addr, const uint8_t line_state_req)
+    {
+        return true;
+    }
+    inline size_t probe(Cache &child, const Addr addr, const uint8_t line_state_req, size_t depth)
+    {
+        return depth;
+    }
+};
+
 #endif //__CACHE_H__
 
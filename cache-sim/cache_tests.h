@@ -1,5 +1,16 @@
+#include <math.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
 #include "cache.h"
+#include "sharded.h"
+#include "ring.h"
+#include "trace.h"
+#include "replay.h"
+#include "stackdist.h"
+#include "sampling.h"
+#include "mlp.h"
+#include "pcm.h"
 #include "quicktest.h"
 
 #define globalmem_size 4*1024*1024
@@ -859,6 +870,1301 @@ QT_TEST(line_writer_to_sharer)
   num_ticks = 0;
 }
 
+QT_TEST(replacement_policies)
+{
+  MainMemory main_mem;
+  const size_t direct_entries = 1;
+  const size_t associativity = 4;
+  const size_t line_size_bytes = 64;
+  size_t num_ticks = 0;
+  for (int policy=0; policy<REPL_NUM_POLICIES; policy++) {
+    Cache cache("L1", &main_mem, direct_entries, associativity, line_size_bytes, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE, (ReplPolicy)policy);
+    QT_CHECK_EQUAL(cache.get_repl_policy(), (ReplPolicy)policy);
+    const Addr A_addr = (Addr)&globalmem[0];
+    // fill the set, then hit the first line
+    for (size_t i=0; i<associativity; i++) {
+      cache.line_get(A_addr + i*line_size_bytes, LINE_SHR, num_ticks, data);
+    }
+    cache.line_get(A_addr, LINE_SHR, num_ticks, data);
+    QT_CHECK_EQUAL(cache.get_num_valid_entries(), associativity);
+    // one more line has to replace exactly one of the others
+    cache.line_get(A_addr + associativity*line_size_bytes, LINE_SHR, num_ticks, data);
+    QT_CHECK_EQUAL(cache.get_num_valid_entries(), associativity);
+    QT_CHECK_EQUAL(cache.is_line_present(A_addr + associativity*line_size_bytes), true);
+    if (policy != REPL_RANDOM && policy != REPL_BRRIP) {
+      // the recently hit line survives
+      QT_CHECK_EQUAL(cache.is_line_present(A_addr), true);
+    }
+    if (policy == REPL_LRU || policy == REPL_SRRIP || policy == REPL_DIP) {
+      // and the oldest of the others is replaced (set 0 is an LRU leader for DIP)
+      QT_CHECK_EQUAL(cache.is_line_present(A_addr + line_size_bytes), false);
+    }
+    // evictions free a way, which gets used before anything is replaced
+    cache.line_evict(A_addr + 2*line_size_bytes);
+    cache.line_get(A_addr + 8*line_size_bytes, LINE_SHR, num_ticks, data);
+    QT_CHECK_EQUAL(cache.is_line_present(A_addr + 3*line_size_bytes), true);
+    QT_CHECK_EQUAL(cache.get_num_valid_entries(), associativity);
+    // long streams keep the set consistent
+    for (size_t i=0; i<1000; i++) {
+      cache.line_get(A_addr + (rand()%64)*line_size_bytes, (rand()%2) ? LINE_SHR : LINE_MOD, num_ticks, data);
+      QT_CHECK_EQUAL(cache._entries[0].size() <= associativity, true);
+    }
+  }
+}
+
+QT_TEST(tag_only_mode)
+{
+  MainMemory main_mem;
+  MainMemory main_mem_tags;
+  Cache L2("L2", &main_mem, 16, 4, 128, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  Cache L1("L1", &L2, 4, 2, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  Cache L2_tags("L2", &main_mem_tags, 16, 4, 128, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  Cache L1_tags("L1", &L2_tags, 4, 2, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  L2_tags.set_tag_only(true);
+  QT_CHECK_EQUAL(L1_tags.is_tag_only(), true);
+  QT_CHECK_EQUAL(L1.is_tag_only(), false);
+  size_t num_ticks = 0;
+  size_t num_ticks_tags = 0;
+  uint8_t *tag_data;
+  for (size_t i=0; i<10000; i++) {
+    const Addr addr = (Addr)&globalmem[0] + (rand()%1024)*32;
+    const uint8_t line_state = (rand()%3) ? LINE_SHR : LINE_MOD;
+    L1.line_get(addr, line_state, num_ticks, data);
+    L1_tags.line_get(addr, line_state, num_ticks_tags, tag_data);
+    QT_CHECK_EQUAL(data != NULL, true);
+    QT_CHECK_EQUAL(tag_data == NULL, true);
+  }
+  // exactly the same hits, misses and writebacks, without any line data
+  QT_CHECK_EQUAL(num_ticks_tags, num_ticks);
+  QT_CHECK_EQUAL(L1_tags.stats.hits, L1.stats.hits);
+  QT_CHECK_EQUAL(L1_tags.stats.misses, L1.stats.misses);
+  QT_CHECK_EQUAL(L2_tags.stats.hits, L2.stats.hits);
+  QT_CHECK_EQUAL(L2_tags.stats.writebacks, L2.stats.writebacks);
+  QT_CHECK_EQUAL(main_mem_tags.stats.hits_rd, main_mem.stats.hits_rd);
+  QT_CHECK_EQUAL(main_mem_tags.stats.hits_wr, main_mem.stats.hits_wr);
+}
+
+QT_TEST(static_cache_geometry)
+{
+  MainMemory main_mem;
+  MainMemory main_mem_static;
+  Cache L2("L2", &main_mem, 16, 4, 128, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  Cache L1("L1", &L2, 8, 2, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE, REPL_PLRU);
+  StaticCache<16, 4, 128> L2_static("L2", &main_mem_static, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  StaticCache<8, 2, 64> L1_static("L1", &L2_static, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE, REPL_PLRU);
+  QT_CHECK_EQUAL(L1_static.get_line_size(), 64);
+  size_t num_ticks = 0;
+  size_t num_ticks_static = 0;
+  uint8_t *static_data;
+  for (size_t i=0; i<10000; i++) {
+    const Addr addr = (Addr)&globalmem[0] + (rand()%1024)*16;
+    const uint8_t line_state = (rand()%3) ? LINE_SHR : ((rand()%2) ? LINE_MOD : LINE_EXC);
+    QT_CHECK_EQUAL(L1_static.addr2directentry(addr), L1.addr2directentry(addr));
+    L1.line_get(addr, line_state, num_ticks, data);
+    L1_static.line_get(addr, line_state, num_ticks_static, static_data);
+    QT_CHECK_EQUAL(L1_static.is_writer(addr), L1.is_writer(addr));
+  }
+  QT_CHECK_EQUAL(num_ticks_static, num_ticks);
+  QT_CHECK_EQUAL(L1_static.stats.hits, L1.stats.hits);
+  QT_CHECK_EQUAL(L1_static.stats.misses, L1.stats.misses);
+  QT_CHECK_EQUAL(L2_static.stats.hits, L2.stats.hits);
+  QT_CHECK_EQUAL(L2_static.stats.misses, L2.stats.misses);
+  QT_CHECK_EQUAL(main_mem_static.stats.hits_wr, main_mem.stats.hits_wr);
+}
+
+QT_TEST(static_cache_line_hit)
+{
+  const Addr A = (Addr)&globalmem[0];
+  uint8_t *static_data;
+  {
+    // a write to an exclusive line without the sector is no hit, and leaves the line clean
+    MainMemory main_mem;
+    StaticCache<8, 2, 128> L1("L1", &main_mem, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+    L1.set_sector_size(64);
+    size_t num_ticks = 0;
+    L1.line_get(A, LINE_EXC, num_ticks, static_data);
+    QT_CHECK_EQUAL(L1.line_hit(A + 64, LINE_MOD, num_ticks, static_data), false);
+    L1.line_evict(A);
+    QT_CHECK_EQUAL(main_mem.stats.writebacks, 0);
+  }
+  {
+    // a line that a victim fill linked to the exclusive parent again is handed over on a hit
+    MainMemory main_mem;
+    Cache L2("L2", &main_mem, 4, 4, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+    L2.set_inclusion(INCLUSION_EXCLUSIVE);
+    StaticCache<1, 2, 64> L1a("L1a", &L2, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+    StaticCache<1, 2, 64> L1b("L1b", &L2, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+    size_t num_ticks = 0;
+    L1a.line_get(A, LINE_SHR, num_ticks, static_data);
+    L1b.line_get(A, LINE_SHR, num_ticks, static_data);
+    // L1a replaces A, which L1b still shares
+    L1a.line_get(A + 64, LINE_SHR, num_ticks, static_data);
+    L1a.line_get(A + 128, LINE_SHR, num_ticks, static_data);
+    QT_CHECK_EQUAL(L1a.is_line_present(A), false);
+    QT_CHECK_EQUAL(L2.is_line_present(A), true);
+    QT_CHECK_EQUAL(L1b.line_hit(A, LINE_SHR, num_ticks, static_data), false);
+    L1b.line_get(A, LINE_SHR, num_ticks, static_data);
+    QT_CHECK_EQUAL(L1b.is_line_present(A), true);
+    QT_CHECK_EQUAL(L2.is_line_present(A), false);
+  }
+}
+
+QT_TEST(static_hierarchy_walk)
+{
+  typedef StaticCache<16, 4, 128> L2_t;
+  typedef StaticCache<8, 2, 64> L1_t;
+  typedef StaticHierarchy<L2_t, StaticHierarchy<MainMemory> > Below_t;
+  MainMemory main_mem;
+  MainMemory main_mem_static;
+  Cache L2("L2", &main_mem, 16, 4, 128, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  Cache L1("L1", &L2, 8, 2, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  L2_t L2_static("L2", &main_mem_static, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  L1_t L1_static("L1", &L2_static, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  StaticHierarchy<L1_t, Below_t> hierarchy(L1_static, Below_t(L2_static, StaticHierarchy<MainMemory>(main_mem_static)));
+  // one level: every modified line it replaces is a writeback to main memory
+  MainMemory main_mem_single;
+  L1_t L1_single("L1", &main_mem_single, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  StaticHierarchy<L1_t, StaticHierarchy<MainMemory> > single(L1_single, StaticHierarchy<MainMemory>(main_mem_single));
+  size_t num_ticks = 0;
+  size_t num_ticks_walk = 0;
+  size_t writebacks_walk = 0;
+  size_t writebacks_single = 0;
+  size_t levels[3] = {0, 0, 0};
+  uint8_t *walk_data;
+  for (size_t i=0; i<10000; i++) {
+    const Addr addr = (Addr)&globalmem[0] + (rand()%1024)*16;
+    const uint8_t line_state = (rand()%3) ? LINE_SHR : LINE_MOD;
+    L1.line_get(addr, line_state, num_ticks, data);
+    const AccessResult walk = hierarchy.access(addr, line_state, walk_data);
+    QT_CHECK(walk.hit_level < 3);
+    levels[walk.hit_level]++;
+    num_ticks_walk += walk.latency;
+    writebacks_walk += walk.writebacks;
+    writebacks_single += single.access(addr, line_state, walk_data).writebacks;
+  }
+  QT_CHECK_EQUAL(num_ticks_walk, num_ticks);
+  QT_CHECK_EQUAL(L1_static.stats.hits, L1.stats.hits);
+  QT_CHECK_EQUAL(L2_static.stats.misses, L2.stats.misses);
+  QT_CHECK_EQUAL(levels[0], 10000 - L1.stats.misses);
+  QT_CHECK_EQUAL(levels[2], L2.stats.misses);
+  QT_CHECK_EQUAL(writebacks_single, main_mem_single.stats.writebacks);
+  // the lines of L1 written back to L2, and those of L2 written back to main memory
+  QT_CHECK(writebacks_walk > main_mem_static.stats.writebacks);
+}
+
+QT_TEST(static_hierarchy_shared_level)
+{
+  // two cores with a private L1 each walk a shared L2; every walk finds its own hit level,
+  // whatever the other core did to the shared level in between
+  typedef StaticCache<16, 4, 128> L2_t;
+  typedef StaticCache<8, 2, 64> L1_t;
+  typedef StaticHierarchy<L2_t, StaticHierarchy<MainMemory> > Below_t;
+  MainMemory main_mem;
+  L2_t L2("L2", &main_mem, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  L1_t L1_0("L1 core 0", &L2, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  L1_t L1_1("L1 core 1", &L2, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  const Below_t below(L2, StaticHierarchy<MainMemory>(main_mem));
+  StaticHierarchy<L1_t, Below_t> core_0(L1_0, below);
+  StaticHierarchy<L1_t, Below_t> core_1(L1_1, below);
+  StaticHierarchy<L1_t, Below_t> *walkers[2] = { &core_0, &core_1 };
+  L1_t *L1s[2] = { &L1_0, &L1_1 };
+  size_t levels[2][3] = { {0, 0, 0}, {0, 0, 0} };
+  size_t private_misses = 0;
+  uint8_t *walk_data;
+  for (size_t i=0; i<20000; i++) {
+    const size_t core = rand()%2;
+    const Addr addr = (Addr)&globalmem[0] + (rand()%512)*16;
+    const uint8_t line_state = (rand()%3) ? LINE_SHR : LINE_MOD;
+    // an L1 miss that the probe finds in L2 does not get to main memory
+    const size_t probed = walkers[core]->probe(addr, line_state);
+    const size_t main_mem_hits = main_mem.stats.hits;
+    const size_t main_mem_writebacks = main_mem.stats.writebacks;
+    const AccessResult walk = walkers[core]->access(addr, line_state, walk_data);
+    QT_CHECK(walk.hit_level < 3);
+    levels[core][walk.hit_level]++;
+    if (walk.hit_level > 0) {
+      QT_CHECK(probed >= walk.hit_level);
+    }
+    if (walk.hit_level > 0 && probed == 1) {
+      QT_CHECK_EQUAL(main_mem.stats.hits, main_mem_hits);
+      QT_CHECK_EQUAL(main_mem.stats.writebacks, main_mem_writebacks);
+      private_misses++;
+    }
+  }
+  QT_CHECK(private_misses > 0);
+  // the lines of L2 that an access to the set of an address can take from the L1s
+  std::vector<bool> sharers;
+  L2.set_sharers((Addr)&globalmem[0], sharers);
+  QT_CHECK_EQUAL(sharers.size(), 2);
+  for (size_t core=0; core<2; core++) {
+    QT_CHECK_EQUAL(levels[core][0], L1s[core]->stats.hits);
+    QT_CHECK_EQUAL(levels[core][1] + levels[core][2], L1s[core]->stats.misses);
+  }
+  QT_CHECK_EQUAL(levels[0][2] + levels[1][2], L2.stats.misses);
+  QT_CHECK(levels[0][1] > 0 && levels[1][1] > 0);
+}
+
+QT_TEST(access_batch_prefetch)
+{
+  typedef StaticCache<16, 4, 128> L2_t;
+  typedef StaticCache<8, 2, 64> L1_t;
+  typedef StaticHierarchy<L2_t, StaticHierarchy<MainMemory> > Below_t;
+  MainMemory main_mem;
+  MainMemory main_mem_batch;
+  MainMemory main_mem_walk;
+  Cache L2("L2", &main_mem, 16, 4, 128, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  Cache L1("L1", &L2, 8, 2, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  Cache L2_batch("L2", &main_mem_batch, 16, 4, 128, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  Cache L1_batch("L1", &L2_batch, 8, 2, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  L2_t L2_walk("L2", &main_mem_walk, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  L1_t L1_walk("L1", &L2_walk, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  StaticHierarchy<L1_t, Below_t> hierarchy(L1_walk, Below_t(L2_walk, StaticHierarchy<MainMemory>(main_mem_walk)));
+  Access refs[1000];
+  size_t num_ticks = 0;
+  BatchResult batch;
+  BatchResult walk;
+  for (size_t round=0; round<10; round++) {
+    // batches of different sizes, including ones shorter than the lookahead
+    const size_t n = (round%3 == 0) ? round+1 : 1000;
+    for (size_t i=0; i<n; i++) {
+      refs[i].addr = (Addr)&globalmem[0] + (rand()%1024)*16;
+      refs[i].line_state = (rand()%3) ? LINE_SHR : LINE_MOD;
+      L1.line_get(refs[i].addr, (uint8_t)refs[i].line_state, num_ticks, data);
+    }
+    L1_batch.access_batch(refs, n, batch);
+    hierarchy.access_batch(refs, n, walk);
+  }
+  QT_CHECK_EQUAL(batch.latency, num_ticks);
+  QT_CHECK_EQUAL(walk.latency, num_ticks);
+  QT_CHECK_EQUAL(batch.accesses, walk.accesses);
+  QT_CHECK_EQUAL(batch.hits, batch.accesses - L1.stats.misses);
+  QT_CHECK_EQUAL(walk.hits, batch.hits);
+  QT_CHECK_EQUAL(main_mem_batch.stats.writebacks, main_mem.stats.writebacks);
+}
+
+QT_TEST(sharded_simulation)
+{
+  MainMemory main_mem;
+  MainMemory main_mem_orig;
+  Cache L2("L2", &main_mem, 16, 4, 128, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE, REPL_SRRIP);
+  Cache L1("L1", &L2, 8, 2, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE, REPL_PLRU);
+  Cache L2_orig("L2", &main_mem_orig, 16, 4, 128, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE, REPL_SRRIP);
+  Cache L1_orig("L1", &L2_orig, 8, 2, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE, REPL_PLRU);
+  L2.set_sector_size(64);
+  L2_orig.set_sector_size(64);
+  ShardedHierarchy sharded(&L1_orig, 4);
+  QT_CHECK_EQUAL(sharded.num_shards(), 4);
+  QT_CHECK_EQUAL(sharded.shard_of(0x180), 3);
+  Access refs[1000];
+  size_t num_ticks = 0;
+  BatchResult totals;
+  for (size_t round=0; round<10; round++) {
+    for (size_t i=0; i<1000; i++) {
+      refs[i].addr = (Addr)&globalmem[0] + (rand()%2048)*16;
+      refs[i].line_state = (rand()%3) ? LINE_SHR : LINE_MOD;
+      L1.line_get(refs[i].addr, (uint8_t)refs[i].line_state, num_ticks, data);
+    }
+    sharded.partition(refs, 1000);
+    // the order in which the shards run does not matter
+    for (size_t shard=sharded.num_shards(); shard-- > 0; ) {
+      sharded.simulate(shard);
+    }
+    sharded.collect(totals);
+  }
+  sharded.merge_stats();
+  QT_CHECK_EQUAL(totals.accesses, 10000);
+  QT_CHECK_EQUAL(totals.latency, num_ticks);
+  QT_CHECK_EQUAL(L1_orig.stats.hits, L1.stats.hits);
+  QT_CHECK_EQUAL(L1_orig.stats.misses, L1.stats.misses);
+  QT_CHECK_EQUAL(L1_orig.stats.writebacks, L1.stats.writebacks);
+  QT_CHECK_EQUAL(L2_orig.stats.misses, L2.stats.misses);
+  QT_CHECK_EQUAL(L2_orig.stats.sector_misses, L2.stats.sector_misses);
+  QT_CHECK_EQUAL(main_mem_orig.stats.writebacks, main_mem.stats.writebacks);
+  QT_CHECK_EQUAL(main_mem_orig.stats.ticks, main_mem.stats.ticks);
+}
+
+QT_TEST(bounded_ring)
+{
+  BoundedRing<size_t> ring;
+  ring.init(8);
+  size_t value = 0;
+  QT_CHECK(ring.empty());
+  QT_CHECK(!ring.pop(value));
+  // wraps around several times; full after capacity elements
+  for (size_t round=0; round<5; round++) {
+    for (size_t i=0; i<8; i++) {
+      QT_CHECK(ring.push(round*8 + i));
+    }
+    QT_CHECK(!ring.push(1000));
+    QT_CHECK(!ring.empty());
+    for (size_t i=0; i<8; i++) {
+      QT_CHECK(ring.pop(value));
+      QT_CHECK_EQUAL(value, round*8 + i);
+    }
+    QT_CHECK(ring.empty());
+  }
+}
+
+// the producers push their own ranges of values, the consumers count what they pop
+const size_t RING_THREADS = 4;
+const size_t RING_VALUES = 100000;      // per producer
+struct RingStress
+{
+  BoundedRing<size_t> ring;
+  volatile size_t next_producer;
+  volatile size_t popped;
+  volatile size_t received[RING_THREADS * RING_VALUES];
+};
+
+void *ring_stress_producer(void *arg)
+{
+  RingStress *stress = static_cast<RingStress *>(arg);
+  const size_t first = __sync_fetch_and_add(&stress->next_producer, 1) * RING_VALUES;
+  for (size_t i=first; i<first + RING_VALUES; i++) {
+    while (!stress->ring.push(i)) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+void *ring_stress_consumer(void *arg)
+{
+  RingStress *stress = static_cast<RingStress *>(arg);
+  size_t value;
+  while (stress->popped < RING_THREADS * RING_VALUES) {
+    if (stress->ring.pop(value)) {
+      __sync_fetch_and_add(&stress->received[value], 1);
+      __sync_fetch_and_add(&stress->popped, 1);
+    } else {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+QT_TEST(bounded_ring_threads)
+{
+  // 4 producers and 4 consumers on a small ring: every value arrives exactly once
+  RingStress *stress = new RingStress();
+  stress->ring.init(64);
+  pthread_t threads[2 * RING_THREADS];
+  for (size_t i=0; i<RING_THREADS; i++) {
+    QT_CHECK_EQUAL(pthread_create(&threads[i], NULL, ring_stress_consumer, stress), 0);
+    QT_CHECK_EQUAL(pthread_create(&threads[RING_THREADS + i], NULL, ring_stress_producer, stress), 0);
+  }
+  for (size_t i=0; i<2 * RING_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  QT_CHECK_EQUAL(stress->popped, RING_THREADS * RING_VALUES);
+  size_t once = 0;
+  for (size_t i=0; i<RING_THREADS * RING_VALUES; i++) {
+    once += (stress->received[i] == 1);
+  }
+  QT_CHECK_EQUAL(once, RING_THREADS * RING_VALUES);
+  QT_CHECK(stress->ring.empty());
+  delete stress;
+}
+
+// Two cores with a private L1 and L2 each over a shared level, locked as in nvramsim: a miss
+// that the core's own L2 serves runs under the core lock only, anything else under the lock
+// of the shared level and then the locks of the core and of the sharers of the shared set
+typedef StaticCache<64, 8, 64> WalkShared_t;
+typedef StaticCache<16, 4, 64> WalkL2_t;
+typedef StaticCache<4, 2, 64> WalkL1_t;
+typedef StaticHierarchy<WalkShared_t, StaticHierarchy<MainMemory> > WalkSharedHierarchy_t;
+typedef StaticHierarchy<WalkL1_t, StaticHierarchy<WalkL2_t, WalkSharedHierarchy_t> > WalkCore_t;
+const size_t WALK_REFS = 200000;
+struct WalkStress;
+struct WalkStressCore
+{
+  WalkStress *stress;
+  WalkCore_t *walk;
+  pthread_mutex_t lock;
+  size_t lines;                 // of the working set
+  size_t private_walks;
+  size_t shared_walks;
+  size_t wrong_levels;          // private walks that went past the L2
+};
+struct WalkStress
+{
+  WalkShared_t *shared;
+  pthread_mutex_t shared_lock;
+  std::vector<bool> sharers;    // under shared_lock
+  WalkStressCore cores[2];
+};
+
+void *walk_stress_core(void *arg)
+{
+  WalkStressCore *core = static_cast<WalkStressCore *>(arg);
+  WalkStress *stress = core->stress;
+  unsigned seed = (unsigned)core->lines;
+  uint8_t *walk_data;
+  size_t latency = 0;
+  for (size_t i=0; i<WALK_REFS; i++) {
+    const Addr addr = 0x10000000ULL + (rand_r(&seed) % core->lines) * 64;
+    const uint8_t line_state = (rand_r(&seed) % 3) ? LINE_SHR : LINE_MOD;
+    pthread_mutex_lock(&core->lock);
+    if (core->walk->level.line_hit(addr, line_state, latency, walk_data)) {
+      pthread_mutex_unlock(&core->lock);
+      continue;
+    }
+    if (core->walk->next_serves(addr, line_state)) {
+      core->wrong_levels += (core->walk->access(addr, line_state, walk_data).hit_level != 1);
+      core->private_walks++;
+      pthread_mutex_unlock(&core->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&core->lock);
+    pthread_mutex_lock(&stress->shared_lock);
+    stress->shared->set_sharers(addr, stress->sharers);
+    for (size_t c=0; c<2; c++) {
+      if (&stress->cores[c] == core || stress->sharers[c]) pthread_mutex_lock(&stress->cores[c].lock);
+    }
+    core->walk->access(addr, line_state, walk_data);
+    core->shared_walks++;
+    for (size_t c=0; c<2; c++) {
+      if (&stress->cores[c] == core || stress->sharers[c]) pthread_mutex_unlock(&stress->cores[c].lock);
+    }
+    pthread_mutex_unlock(&stress->shared_lock);
+  }
+  return NULL;
+}
+
+QT_TEST(static_hierarchy_threads)
+{
+  // core 0 mostly misses in L1 and hits in L2 (or misses in L2 with a third of its working
+  // set), while core 1 misses in L2 all the time
+  MainMemory main_mem;
+  WalkShared_t shared("shared", &main_mem, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  WalkL2_t L2_0("L2 core 0", &shared, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  WalkL2_t L2_1("L2 core 1", &shared, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  WalkL1_t L1_0("L1 core 0", &L2_0, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  WalkL1_t L1_1("L1 core 1", &L2_1, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  shared.set_tag_only(true);
+  const WalkSharedHierarchy_t below(shared, StaticHierarchy<MainMemory>(main_mem));
+  WalkCore_t walk_0(L1_0, StaticHierarchy<WalkL2_t, WalkSharedHierarchy_t>(L2_0, below));
+  WalkCore_t walk_1(L1_1, StaticHierarchy<WalkL2_t, WalkSharedHierarchy_t>(L2_1, below));
+  WalkStress *stress = new WalkStress();
+  stress->shared = &shared;
+  pthread_mutex_init(&stress->shared_lock, NULL);
+  WalkCore_t *walks[2] = { &walk_0, &walk_1 };
+  const size_t lines[2] = { 96, 4096 };
+  for (size_t c=0; c<2; c++) {
+    WalkStressCore &core = stress->cores[c];
+    core.stress = stress;
+    core.walk = walks[c];
+    pthread_mutex_init(&core.lock, NULL);
+    core.lines = lines[c];
+  }
+  pthread_t threads[2];
+  for (size_t c=0; c<2; c++) {
+    QT_CHECK_EQUAL(pthread_create(&threads[c], NULL, walk_stress_core, &stress->cores[c]), 0);
+  }
+  for (size_t c=0; c<2; c++) {
+    pthread_join(threads[c], NULL);
+  }
+  QT_CHECK(stress->cores[0].private_walks > 0);
+  QT_CHECK(stress->cores[1].shared_walks > 0);
+  QT_CHECK_EQUAL(stress->cores[0].wrong_levels + stress->cores[1].wrong_levels, 0);
+  QT_CHECK_EQUAL(L1_0.stats.hits + L1_0.stats.misses, WALK_REFS);
+  QT_CHECK_EQUAL(L1_1.stats.hits + L1_1.stats.misses, WALK_REFS);
+  QT_CHECK_EQUAL(shared.stats.misses, main_mem.stats.hits);
+  delete stress;
+}
+
+QT_TEST(trace_encoding)
+{
+  // loads and stores of a loop over an array, with odd sizes and large jumps mixed in
+  std::vector<TraceRef> refs(5000);
+  for (size_t i=0; i<refs.size(); i++) {
+    refs[i].addr = 0x7fff0000ULL + (i % 100) * 8;
+    refs[i].line_state = (i % 3) ? LINE_SHR : LINE_MOD;
+    refs[i].size = 8;
+    refs[i].pc = 0x400000 + (i % 4) * 4;
+    if (i % 97 == 0) {
+      refs[i].addr = 0xffffffff00000000ULL - i;
+      refs[i].size = 12;
+      refs[i].pc = refs[i-(i>0)].pc;
+    }
+  }
+  std::vector<uint8_t> encoded(refs.size() * TRACE_MAX_ENCODED_REF);
+  const size_t bytes = trace_encode(&refs[0], refs.size(), &encoded[0]);
+  QT_CHECK(bytes < refs.size() * 4);
+
+  std::vector<uint8_t> compressed(bytes);
+  const size_t compressed_bytes = block_compress(&encoded[0], bytes, &compressed[0], compressed.size());
+  QT_CHECK(compressed_bytes > 0 && compressed_bytes < bytes / 4);
+  std::vector<uint8_t> decompressed(bytes);
+  QT_CHECK(block_decompress(&compressed[0], compressed_bytes, &decompressed[0], bytes));
+  QT_CHECK(memcmp(&decompressed[0], &encoded[0], bytes) == 0);
+  // truncated input is detected
+  QT_CHECK(!block_decompress(&compressed[0], compressed_bytes - 1, &decompressed[0], bytes));
+
+  std::vector<TraceRef> decoded(refs.size());
+  QT_CHECK(trace_decode(&decompressed[0], bytes, decoded.size(), &decoded[0]));
+  for (size_t i=0; i<refs.size(); i++) {
+    QT_CHECK_EQUAL(decoded[i].addr, refs[i].addr);
+    QT_CHECK_EQUAL(decoded[i].line_state, refs[i].line_state);
+    QT_CHECK_EQUAL(decoded[i].size, refs[i].size);
+    QT_CHECK_EQUAL(decoded[i].pc, refs[i].pc);
+  }
+  QT_CHECK(!trace_decode(&encoded[0], bytes - 1, decoded.size(), &decoded[0]));
+
+  // incompressible data is not compressed
+  std::vector<uint8_t> noise(1000);
+  for (size_t i=0; i<noise.size(); i++) {
+    noise[i] = (uint8_t)(rand() >> 7);
+  }
+  QT_CHECK_EQUAL(block_compress(&noise[0], noise.size(), &compressed[0], noise.size() - 1), 0);
+
+  TraceChunkBuilder chunk;
+  chunk.build(3, 12345, 99, &refs[0], refs.size());
+  TraceChunkHeader header;
+  memcpy(&header, chunk.data(), sizeof(header));
+  QT_CHECK_EQUAL(header.magic, TRACE_CHUNK_MAGIC);
+  QT_CHECK_EQUAL(header.tid, 3);
+  QT_CHECK_EQUAL(header.num_refs, refs.size());
+  QT_CHECK_EQUAL(header.raw_bytes, bytes);
+  QT_CHECK_EQUAL(chunk.size(), sizeof(header) + header.stored_bytes);
+  QT_CHECK(header.stored_bytes < header.raw_bytes);
+}
+
+QT_TEST(trace_reader)
+{
+  // three chunks of two threads; the second one compresses well
+  const char *path = "cache_tests_trace.bin";
+  std::vector<TraceRef> refs(3000);
+  for (size_t i=0; i<refs.size(); i++) {
+    refs[i].addr = (i < 1000 || i >= 2000) ? 0x10000000ULL + rand() * 64ULL : 0x20000000ULL + (i % 10) * 64;
+    refs[i].line_state = (i % 2) ? LINE_SHR : LINE_MOD;
+    refs[i].size = 4;
+    refs[i].pc = 0x400000 + (i % 7);
+  }
+  FILE *f = fopen(path, "wb");
+  QT_CHECK(f != NULL && trace_write_header(f));
+  TraceChunkBuilder chunk;
+  for (size_t i=0; i<3; i++) {
+    chunk.build((uint32_t)(i % 2), 100 + i, 1000 * (i+1), &refs[i*1000], 1000);
+    QT_CHECK(chunk.write(f));
+  }
+  // a truncated chunk, as left by a tracer that was killed
+  fwrite(chunk.data(), 1, 10, f);
+  fclose(f);
+
+  TraceReader reader;
+  QT_CHECK(reader.open(path));
+  QT_CHECK_EQUAL(reader.num_chunks(), 3);
+  QT_CHECK_EQUAL(reader.num_refs(), 3000);
+  QT_CHECK_EQUAL(reader.max_chunk_refs(), 1000);
+  QT_CHECK_EQUAL(reader.chunk(1).tid, 1);
+  QT_CHECK_EQUAL(reader.chunk(2).instructions, 3000);
+  QT_CHECK(reader.chunk(1).compressed());
+
+  // random access
+  std::vector<TraceRef> decoded(1000);
+  std::vector<uint8_t> scratch;
+  QT_CHECK(reader.decode(1, &decoded[0], scratch));
+  QT_CHECK_EQUAL(decoded[999].addr, refs[1999].addr);
+  QT_CHECK_EQUAL(decoded[999].pc, refs[1999].pc);
+
+  // in order, decoded ahead by threads or in place
+  for (size_t threads=0; threads<3; threads++) {
+    TraceDecoder decoder(reader, threads, 2);
+    size_t chunk_i, n, total = 0;
+    for (const Access *accesses; (accesses = decoder.next(chunk_i, n)) != NULL; ) {
+      QT_CHECK_EQUAL(n, 1000);
+      for (size_t i=0; i<n; i++) {
+        QT_CHECK_EQUAL(accesses[i].addr, refs[chunk_i*1000 + i].addr);
+        QT_CHECK_EQUAL(accesses[i].line_state, refs[chunk_i*1000 + i].line_state);
+      }
+      QT_CHECK_EQUAL(chunk_i, total / 1000);
+      total += n;
+    }
+    QT_CHECK(!decoder.failed());
+    QT_CHECK_EQUAL(total, 3000);
+  }
+  reader.close();
+
+  // a chunk header with more references than its bytes can encode ends the trace
+  f = fopen(path, "wb");
+  QT_CHECK(f != NULL && trace_write_header(f));
+  chunk.build(0, 100, 1000, &refs[0], 1000);
+  QT_CHECK(chunk.write(f));
+  TraceChunkHeader corrupt;
+  memcpy(&corrupt, chunk.data(), sizeof(corrupt));
+  corrupt.num_refs = (uint64_t)1 << 40;
+  fwrite(&corrupt, sizeof(corrupt), 1, f);
+  fwrite(chunk.data() + sizeof(corrupt), 1, corrupt.stored_bytes, f);
+  fclose(f);
+  QT_CHECK(reader.open(path));
+  QT_CHECK_EQUAL(reader.num_chunks(), 1);
+  QT_CHECK_EQUAL(reader.max_chunk_refs(), 1000);
+  reader.close();
+  remove(path);
+}
+
+QT_TEST(broadcast_ring)
+{
+  BroadcastRing<size_t> ring;
+  ring.init(4, 2);
+  QT_CHECK(ring.peek(0) == NULL && !ring.done(0));
+  for (size_t i=0; i<4; i++) {
+    size_t *cell = ring.claim();
+    QT_CHECK(cell != NULL);
+    *cell = i;
+    ring.publish();
+  }
+  // full until both consumers release the first element
+  QT_CHECK(ring.claim() == NULL);
+  QT_CHECK_EQUAL(*ring.peek(0), 0);
+  ring.release(0);
+  QT_CHECK(ring.claim() == NULL);
+  QT_CHECK_EQUAL(*ring.peek(1), 0);
+  ring.release(1);
+  size_t *cell = ring.claim();
+  QT_CHECK(cell != NULL);
+  *cell = 4;
+  ring.publish();
+  ring.close();
+  // every consumer reads every element, in order
+  for (size_t consumer=0; consumer<2; consumer++) {
+    for (size_t i=1; i<5; i++) {
+      QT_CHECK(!ring.done(consumer));
+      QT_CHECK_EQUAL(*ring.peek(consumer), i);
+      ring.release(consumer);
+    }
+    QT_CHECK(ring.peek(consumer) == NULL);
+    QT_CHECK(ring.done(consumer));
+  }
+}
+
+QT_TEST(broadcast_replay)
+{
+  const char *path = "cache_tests_replay.bin";
+  std::vector<TraceRef> refs(20000);
+  for (size_t i=0; i<refs.size(); i++) {
+    refs[i].addr = 0x10000000ULL + (rand() % (1 << 20)) * 64ULL;
+    refs[i].line_state = (i % 3) ? LINE_SHR : LINE_MOD;
+    refs[i].size = 8;
+    refs[i].pc = 0x400000;
+  }
+  FILE *f = fopen(path, "wb");
+  QT_CHECK(f != NULL && trace_write_header(f));
+  TraceChunkBuilder chunk;
+  for (size_t i=0; i<20; i++) {
+    chunk.build((uint32_t)(i % 3), 0, 100 * i, &refs[i*1000], 1000);
+    QT_CHECK(chunk.write(f));
+  }
+  fclose(f);
+  TraceReader reader;
+  QT_CHECK(reader.open(path));
+
+  // three DDR sizes in one pass, with a ring shorter than the trace
+  const char *specs[] = { "ddr_mb=1 cores=2", "ddr_mb=2 ddr_repl=srrip", "name=big ddr_mb=4 ddr_incl=exclusive" };
+  std::vector<ReplayHierarchy *> hierarchies;
+  for (size_t i=0; i<3; i++) {
+    ReplayConfig config;
+    QT_CHECK(config.parse(specs[i]) && config.valid());
+    hierarchies.push_back(new ReplayHierarchy(config));
+  }
+  QT_CHECK_EQUAL(hierarchies[2]->config.name, "big");
+  QT_CHECK(replay_broadcast(reader, hierarchies, 2, 4));
+
+  // each the same as on its own
+  for (size_t i=0; i<3; i++) {
+    ReplayHierarchy alone(hierarchies[i]->config);
+    TraceDecoder decoder(reader, 0, 1);
+    size_t chunk_i, n;
+    for (const Access *accesses; (accesses = decoder.next(chunk_i, n)) != NULL; ) {
+      alone.simulate(reader.chunk(chunk_i).tid, reader.chunk(chunk_i).instructions, accesses, n);
+    }
+    QT_CHECK_EQUAL(hierarchies[i]->batch.accesses, 20000);
+    QT_CHECK_EQUAL(hierarchies[i]->batch.latency, alone.batch.latency);
+    QT_CHECK_EQUAL(hierarchies[i]->num_instr(), 1700 + 1800 + 1900);
+    for (size_t level=0; level<4; level++) {
+      QT_CHECK_EQUAL(hierarchies[i]->level_stats(level).misses, alone.level_stats(level).misses);
+      QT_CHECK_EQUAL(hierarchies[i]->level_stats(level).writebacks, alone.level_stats(level).writebacks);
+    }
+  }
+  // a larger DDR cache misses less
+  QT_CHECK(hierarchies[0]->level_stats(2).misses > hierarchies[1]->level_stats(2).misses);
+  ReplayConfig bad;
+  QT_CHECK(!bad.parse("ddr_mb=3") || !bad.valid());
+  QT_CHECK(!bad.parse("l2_repl=none"));
+  for (size_t i=0; i<3; i++) {
+    delete hierarchies[i];
+  }
+  reader.close();
+  remove(path);
+}
+
+QT_TEST(stack_distance)
+{
+  // fully associative LRU caches of several sizes, the smallest one profiled
+  const size_t sizes[] = { 4, 16, 64, 128 };
+  MainMemory *mems[4];
+  Cache *caches[4];
+  StackDistance profile(64);
+  for (size_t i=0; i<4; i++) {
+    mems[i] = new MainMemory();
+    caches[i] = new Cache("FA", mems[i], 1, sizes[i], 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+    caches[i]->set_tag_only(true);
+  }
+  caches[0]->set_profiler(&profile);
+  // an L1 over a fully associative L2, the L2 profiled: its dirty lines come from writebacks
+  MainMemory main_mem;
+  Cache L2("L2", &main_mem, 1, 64, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  Cache L1("L1", &L2, 4, 2, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  L2.set_tag_only(true);
+  StackDistance l2_profile(64);
+  L2.set_profiler(&l2_profile);
+  size_t num_ticks = 0;
+  for (size_t i=0; i<50000; i++) {
+    // mostly a small working set, sometimes a larger one
+    const Addr addr = 0x40000000ULL + ((rand() % 4) ? rand() % 48 : rand() % 1024) * 64ULL + rand() % 64;
+    const uint8_t line_state = (rand() % 3) ? LINE_SHR : LINE_MOD;
+    for (size_t c=0; c<4; c++) {
+      caches[c]->line_get(addr, line_state, num_ticks, data);
+    }
+    L1.line_get(addr, line_state, num_ticks, data);
+  }
+  QT_CHECK_EQUAL(profile.accesses(), 50000);
+  std::vector<StackDistance::Point> points;
+  profile.curve(0, points);
+  for (size_t c=0; c<4; c++) {
+    size_t p = 0;
+    while (p < points.size() && points[p].lines != sizes[c])
+      p++;
+    QT_CHECK(p < points.size());
+    QT_CHECK_EQUAL((size_t)points[p].misses, caches[c]->stats.misses);
+    QT_CHECK_EQUAL((size_t)points[p].dirty_evictions, mems[c]->stats.writebacks);
+  }
+  // misses only fall with the capacity, down to the cold misses
+  for (size_t p=1; p<points.size(); p++) {
+    QT_CHECK(points[p].misses <= points[p-1].misses);
+  }
+  QT_CHECK_EQUAL(points.back().misses, profile.cold_misses());
+  l2_profile.curve(0, points);
+  size_t p = 0;
+  while (p < points.size() && points[p].lines != 64)
+    p++;
+  QT_CHECK(p < points.size());
+  QT_CHECK_EQUAL((size_t)points[p].misses, L2.stats.misses);
+  QT_CHECK_EQUAL((size_t)points[p].dirty_evictions, main_mem.stats.writebacks);
+  QT_CHECK(main_mem.stats.writebacks > 0);
+
+  // the set-associative estimate of 16 sets x 4 ways, near the simulated cache
+  MainMemory sa_mem;
+  Cache sa("SA", &sa_mem, 16, 4, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  sa.set_tag_only(true);
+  StackDistance sa_profile(64);
+  sa.set_profiler(&sa_profile);
+  // the model assumes that the lines spread over the sets at random
+  std::vector<Addr> lines(1024);
+  for (size_t i=0; i<lines.size(); i++) {
+    lines[i] = 0x40000000ULL + (rand() % (1 << 20)) * 64ULL;
+  }
+  for (size_t i=0; i<50000; i++) {
+    const Addr addr = lines[(rand() % 4) ? rand() % 48 : rand() % 1024];
+    sa.line_get(addr, (rand() % 3) ? LINE_SHR : LINE_MOD, num_ticks, data);
+  }
+  sa_profile.curve(4, points);
+  QT_CHECK(points.size() > 4 && points[4].lines == 64);
+  QT_CHECK(fabs(points[4].misses - sa.stats.misses) < 0.1 * sa.stats.misses);
+  QT_CHECK(fabs(points[4].dirty_evictions - sa_mem.stats.writebacks) < 0.1 * sa_mem.stats.writebacks);
+
+  // a quarter of the lines sampled, near the full profile (working sets of all sizes)
+  StackDistance full(64);
+  StackDistance sampled(64, 0.25);
+  for (size_t i=0; i<200000; i++) {
+    const Addr addr = 0x40000000ULL + (rand() % (1 << (4 + rand() % 12))) * 64ULL;
+    const bool is_write = (rand() % 3) == 0;
+    full.access(addr, is_write);
+    sampled.access(addr, is_write);
+  }
+  QT_CHECK(fabs(sampled.accesses() - 200000) < 20000);
+  full.curve(0, points);
+  std::vector<StackDistance::Point> sampled_points;
+  sampled.curve(0, sampled_points);
+  for (size_t p=0, s=0; p<points.size(); p++) {
+    while (s < sampled_points.size() && sampled_points[s].lines < points[p].lines)
+      s++;
+    if (s < sampled_points.size() && sampled_points[s].lines == points[p].lines && (points[p].lines & 0xff) == 0) {
+      QT_CHECK(fabs(sampled_points[s].misses - points[p].misses) < 0.1 * points[p].misses);
+    }
+  }
+  for (size_t i=0; i<4; i++) {
+    delete caches[i];
+    delete mems[i];
+  }
+}
+
+QT_TEST(ratio_estimate)
+{
+  RatioEstimate exact;
+  for (size_t i=1; i<=10; i++) {
+    exact.add(3.0 * i, i);
+  }
+  QT_CHECK_EQUAL(exact.units(), 10);
+  QT_CHECK(fabs(exact.ratio() - 3) < 1e-12);
+  QT_CHECK(exact.half_width() < 1e-6);
+  RatioEstimate none;
+  QT_CHECK_EQUAL(none.ratio(), 0);
+  QT_CHECK_EQUAL(none.half_width(), 0);
+
+  // noisy units around a ratio of 2: the 95% interval holds it most of the time
+  size_t covered = 0;
+  for (size_t run=0; run<200; run++) {
+    RatioEstimate noisy;
+    RatioEstimate halves[2];
+    for (size_t i=0; i<50; i++) {
+      const double x = 50 + rand() % 100;
+      const double y = 2 * x + (rand() % 41) - 20;
+      noisy.add(y, x);
+      halves[i % 2].add(y, x);
+    }
+    if (fabs(noisy.ratio() - 2) <= noisy.half_width())
+      covered++;
+    halves[0].merge(halves[1]);
+    QT_CHECK_EQUAL(halves[0].units(), noisy.units());
+    QT_CHECK(fabs(halves[0].half_width() - noisy.half_width()) < 1e-9);
+    // half the error takes about four times the units
+    const size_t needed = noisy.units_needed(noisy.relative_error() / 2);
+    QT_CHECK(needed >= 199 && needed <= 201);
+  }
+  QT_CHECK(covered >= 180);
+}
+
+QT_TEST(mlp_core)
+{
+  const size_t latencies[MlpCore::MAX_LEVELS] = { 4, 20, 200, 600 };
+  const size_t unlimited[MlpCore::MAX_LEVELS] = { 0, 0, 0, 0 };
+
+  // a window of one instruction is the serial model
+  MlpCore serial(0.5, 1, MlpCore::MAX_LEVELS, unlimited);
+  double expected = 0;
+  for (size_t i=0; i<1000; i++) {
+    const size_t level = rand() % MlpCore::MAX_LEVELS;
+    serial.reference(1, level, latencies[level]);
+    expected += 0.5 + latencies[level];
+  }
+  QT_CHECK(fabs(serial.finish(0) - expected) < 1e-6);
+
+  // hits that the window hides never stall
+  MlpCore hits(1, 64, MlpCore::MAX_LEVELS, unlimited);
+  for (size_t i=0; i<1000; i++) {
+    hits.reference(1, 0, latencies[0]);
+  }
+  QT_CHECK_EQUAL(hits.stall_cycles(), 0);
+  QT_CHECK(fabs(hits.finish(10) - 1010) < 1e-6);
+  // the segments of a run add up
+  for (size_t i=0; i<100; i++) {
+    hits.reference(1, 0, latencies[0]);
+  }
+  QT_CHECK(fabs(hits.finish(10) - 110) < 1e-6);
+  QT_CHECK(fabs(hits.now() - 1120) < 1e-6);
+
+  // independent misses overlap up to the window...
+  MlpCore window(1, 100, MlpCore::MAX_LEVELS, unlimited);
+  for (size_t i=0; i<1000; i++) {
+    window.reference(1, 3, 300);
+  }
+  const double windowed = window.finish(0);
+  QT_CHECK(windowed > 2900 && windowed < 3400);
+
+  // ...and the MSHRs of the level they miss in
+  const size_t mshrs[MlpCore::MAX_LEVELS - 1] = { 10, 16, 4 };
+  MlpCore bounded(1, 256, MlpCore::MAX_LEVELS, mshrs);
+  for (size_t i=0; i<1000; i++) {
+    bounded.reference(1, 3, 300);
+  }
+  const double throughput = bounded.finish(0);
+  QT_CHECK(fabs(throughput - 1000 * 300 / 4) < 0.02 * 1000 * 300 / 4);
+  QT_CHECK(bounded.stall_cycles() > 0);
+}
+
+QT_TEST(pcm_banks)
+{
+  PcmMemory pcm(DEFAULT_ADDRESS_SPACE_SIZE, 100, 300);
+  size_t latency = 0;
+  uint8_t *pdata = NULL;
+  // flat until configured
+  pcm.line_get(0, LINE_SHR, latency, pdata);
+  QT_CHECK_EQUAL(latency, 100);
+  QT_CHECK(!pcm.is_banked());
+
+  // row:rank:bank:channel:column: 16 columns of 64 B, then 8 banks
+  PcmConfig config;
+  pcm.configure(config);
+  const size_t miss = config.t_read + config.t_column + config.t_burst;
+  const size_t row_hit = config.t_column + config.t_burst;
+  latency = 0;
+  pcm.line_get(0, LINE_SHR, latency, pdata);
+  QT_CHECK_EQUAL(latency, miss);
+  latency = 0;
+  pcm.line_get(64, LINE_SHR, latency, pdata);
+  QT_CHECK_EQUAL(latency, row_hit);
+  latency = 0;
+  pcm.line_get(1 << 13, LINE_SHR, latency, pdata);   // bank 0, the next row
+  QT_CHECK_EQUAL(latency, miss);
+  QT_CHECK_EQUAL(pcm.pcm_stats.read_row_hits, 1);
+
+  // a write keeps its bank busy: a read behind it waits, one to another bank does not
+  pcm.data_writeback(0, 64);
+  latency = 0;
+  pcm.line_get(1 << 10, LINE_SHR, latency, pdata);   // bank 1
+  QT_CHECK_EQUAL(latency, miss);
+  QT_CHECK_EQUAL(pcm.pcm_stats.bank_conflicts, 0);
+  latency = 0;
+  pcm.line_get(2 << 13, LINE_SHR, latency, pdata);   // bank 0, yet another row
+  const size_t write_busy = config.t_burst + config.t_reset + config.t_set;
+  QT_CHECK_EQUAL(latency, write_busy);
+  QT_CHECK_EQUAL(pcm.pcm_stats.bank_conflicts, 1);
+  QT_CHECK_EQUAL(pcm.pcm_stats.writes, 1);
+  QT_CHECK_EQUAL(pcm.stats.writebacks, 1);
+  QT_CHECK_EQUAL(pcm.stats.hits, 6);
+
+  // closed page: no row hits; two channels interleaved by request
+  PcmConfig closed;
+  closed.open_page = false;
+  closed.channels = 2;
+  QT_CHECK(str2pcm_map("Row:column:rank:bank:channel", closed.map));
+  QT_CHECK_EQUAL(pcm_map2str(closed.map), "row:column:rank:bank:channel");
+  PcmMemory interleaved;
+  interleaved.configure(closed);
+  for (Addr addr=0; addr<8*64; addr+=64) {
+    latency = 0;
+    interleaved.line_get(addr, LINE_SHR, latency, pdata);
+    QT_CHECK_EQUAL(latency, miss);
+  }
+  QT_CHECK_EQUAL(interleaved.pcm_stats.read_row_hits, 0);
+  // two writes to the two channels go on at once
+  interleaved.data_writeback(0, 128);
+  QT_CHECK_EQUAL(interleaved.pcm_stats.bank_conflicts, 0);
+  latency = 0;
+  interleaved.line_get(1 << 14, LINE_SHR, latency, pdata);   // channel 0, bank 0, the next row
+  QT_CHECK_EQUAL(latency, write_busy + miss);
+
+  PcmField map[PCM_NUM_FIELDS];
+  QT_CHECK(!str2pcm_map("row:bank", map));
+  QT_CHECK(!str2pcm_map("row:row:bank:channel:column", map));
+  QT_CHECK(!str2pcm_map("row:rank:bank:channel:column:row", map));
+}
+
+QT_TEST(pcm_write_queue)
+{
+  PcmConfig config;
+  config.write_queue = 8;
+  config.write_high = 6;
+  config.write_low = 2;
+  const size_t miss = config.t_read + config.t_column + config.t_burst;
+  size_t latency = 0;
+  uint8_t *pdata = NULL;
+
+  // the writes wait in the queue, where the reads find them
+  PcmMemory forward;
+  forward.configure(config);
+  forward.data_writeback(0, 64);
+  forward.data_writeback(0, 64);
+  QT_CHECK_EQUAL(forward.writes_queued(), 1);
+  QT_CHECK_EQUAL(forward.pcm_stats.writes, 0);
+  forward.line_get(0, LINE_SHR, latency, pdata);
+  QT_CHECK_EQUAL(latency, config.t_burst);
+  QT_CHECK_EQUAL(forward.pcm_stats.read_forwards, 1);
+
+  // a write goes to its idle bank between the reads; a read to the bank 50 cycles later
+  // (in the RESET pulse) or 150 cycles later (in the second SET iteration) waits for it,
+  // pauses it or cancels it
+  const PcmWritePolicy policies[] = { PCM_WRITE_WAIT, PCM_WRITE_PAUSE, PCM_WRITE_CANCEL };
+  const size_t after[] = { 50, 150 };
+  const size_t expected[][2] = { { 516, 416 }, { 216, 191 }, { miss, miss } };
+  for (size_t policy=0; policy<3; policy++) {
+    for (size_t i=0; i<2; i++) {
+      PcmMemory pcm;
+      config.write_policy = policies[policy];
+      pcm.configure(config);
+      pcm.data_writeback(0, 64);
+      pcm.advance(after[i]);
+      latency = 0;
+      pcm.line_get(2 << 13, LINE_SHR, latency, pdata);    // bank 0, another row
+      QT_CHECK_EQUAL(latency, expected[policy][i]);
+      QT_CHECK_EQUAL(pcm.pcm_stats.writes, 1);
+      QT_CHECK_EQUAL(pcm.pcm_stats.read_write_cycles, expected[policy][i] - miss);
+      QT_CHECK_EQUAL(pcm.pcm_stats.writes_paused, policies[policy] == PCM_WRITE_PAUSE ? 1 : 0);
+      QT_CHECK_EQUAL(pcm.pcm_stats.writes_cancelled, policies[policy] == PCM_WRITE_CANCEL ? 1 : 0);
+      QT_CHECK_EQUAL(pcm.writes_queued(), policies[policy] == PCM_WRITE_CANCEL ? 1 : 0);
+    }
+  }
+  QT_CHECK(str2pcm_write_policy("Cancel", config.write_policy));
+  QT_CHECK_EQUAL(config.write_policy, PCM_WRITE_CANCEL);
+  QT_CHECK(!str2pcm_write_policy("abort", config.write_policy));
+
+  // at the high watermark, the queue drains to the low one at once, and the reads wait
+  PcmMemory drain;
+  config.write_policy = PCM_WRITE_PAUSE;
+  drain.configure(config);
+  for (Addr row=0; row<6; row++) {
+    drain.data_writeback(row << 13, 64);
+  }
+  QT_CHECK_EQUAL(drain.pcm_stats.write_drains, 1);
+  QT_CHECK_EQUAL(drain.pcm_stats.writes, 4);
+  QT_CHECK_EQUAL(drain.writes_queued(), 2);
+  latency = 0;
+  drain.line_get(7 << 13, LINE_SHR, latency, pdata);
+  const size_t drained = config.t_burst + 4 * (config.t_reset + config.t_set);
+  QT_CHECK_EQUAL(latency, drained + miss);
+  QT_CHECK(fabs(drain.pcm_stats.read_inflation() - double(drained) / miss) < 1e-9);
+
+  // a forwarded read still waits for the channel, here busy with the drained writes
+  PcmMemory busy;
+  busy.configure(config);
+  for (Addr row=0; row<6; row++) {
+    busy.data_writeback(row << 13, 64);
+  }
+  latency = 0;
+  busy.line_get(4 << 13, LINE_SHR, latency, pdata);
+  QT_CHECK_EQUAL(busy.pcm_stats.read_forwards, 1);
+  QT_CHECK_EQUAL(latency, 5 * config.t_burst);
+  QT_CHECK_EQUAL(busy.pcm_stats.read_queue_cycles, 4 * config.t_burst);
+
+  // a cancelled write back in the queue reaches the high watermark: the queue drains
+  PcmMemory requeue;
+  config.write_policy = PCM_WRITE_CANCEL;
+  config.write_high = 2;
+  config.write_low = 0;
+  requeue.configure(config);
+  requeue.data_writeback(0, 64);
+  requeue.advance(50);
+  requeue.data_writeback(2 << 13, 64);                    // waits for the first, in bank 0
+  requeue.advance(50);
+  latency = 0;
+  requeue.line_get(4 << 13, LINE_SHR, latency, pdata);
+  QT_CHECK_EQUAL(latency, miss);
+  QT_CHECK_EQUAL(requeue.pcm_stats.writes_cancelled, 1);
+  QT_CHECK_EQUAL(requeue.pcm_stats.write_drains, 1);
+  QT_CHECK_EQUAL(requeue.writes_queued(), 0);
+  QT_CHECK_EQUAL(requeue.pcm_stats.writes, 3);
+}
+
+QT_TEST(lazy_set_allocation)
+{
+  MainMemory main_mem;
+  const size_t direct_entries = 64*1024;
+  const size_t line_size_bytes = 64;
+  Cache cache("DDR", &main_mem, direct_entries, 8, line_size_bytes);
+  // an empty cache has only the chunk directory
+  QT_CHECK_EQUAL(cache.get_num_sets_used(), 0);
+  QT_CHECK_EQUAL(cache.get_metadata_bytes(), direct_entries/TAG_STORE_CHUNK_SETS*sizeof(void *));
+  const Addr addr = (Addr)&globalmem[0];
+  // lookups do not allocate
+  QT_CHECK_EQUAL(cache.is_line_present(addr), false);
+  QT_CHECK_EQUAL(cache.get_num_valid_entries(), 0);
+  QT_CHECK_EQUAL(cache.get_num_sets_used(), 0);
+  size_t num_ticks = 0;
+  cache.line_get(addr, LINE_MOD, num_ticks, data);
+  QT_CHECK_EQUAL(cache.get_num_sets_used(), TAG_STORE_CHUNK_SETS);
+  QT_CHECK_EQUAL(cache.get_metadata_bytes() >= LARGE_PAGE_BYTES, true);
+  // the neighbouring sets are in the same chunk
+  cache.line_get(addr + line_size_bytes, LINE_SHR, num_ticks, data);
+  cache.line_get(addr + direct_entries*line_size_bytes, LINE_SHR, num_ticks, data);
+  QT_CHECK_EQUAL(cache.get_num_valid_entries(), 3);
+  QT_CHECK_EQUAL(cache.is_line_present(addr), true);
+  cache.reset();
+  QT_CHECK_EQUAL(cache.get_num_valid_entries(), 0);
+}
+
+QT_TEST(sectored_lines)
+{
+  MainMemory main_mem;
+  const size_t sector_bytes = 64;
+  Cache DDR("DDR", &main_mem, 4, 2, 1024, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  Cache L1("L1", &DDR, 2, 2, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  DDR.set_sector_size(sector_bytes);
+  QT_CHECK_EQUAL(DDR.get_sector_size(), sector_bytes);
+  const Addr addr = 0x100000;
+  size_t num_ticks = 0;
+  // a line miss fetches only the requested sector
+  L1.line_get(addr, LINE_SHR, num_ticks, data);
+  QT_CHECK_EQUAL(DDR.stats.misses, 1);
+  QT_CHECK_EQUAL(main_mem.stats.hits, 1);
+  // another sector of the same line is a sector miss
+  L1.line_get(addr + sector_bytes, LINE_SHR, num_ticks, data);
+  QT_CHECK_EQUAL(DDR.stats.sector_misses, 1);
+  QT_CHECK_EQUAL(main_mem.stats.hits, 2);
+  L1.line_get(addr + 2*sector_bytes, LINE_MOD, num_ticks, data);
+  QT_CHECK_EQUAL(DDR.stats.sector_misses, 2);
+  QT_CHECK_EQUAL(main_mem.stats.hits, 3);
+  QT_CHECK_EQUAL(DDR.get_num_valid_entries(), 1);
+  // fetched sectors hit
+  L1.line_evict(addr);
+  L1.line_get(addr, LINE_SHR, num_ticks, data);
+  QT_CHECK_EQUAL(main_mem.stats.hits, 3);
+  // only the sector that was written goes back to the memory
+  DDR.line_evict(addr);
+  QT_CHECK_EQUAL(L1.get_num_valid_entries(), 0);
+  QT_CHECK_EQUAL(main_mem.stats.writebacks, 1);
+}
+
+QT_TEST(child_subblock_presence)
+{
+  MainMemory main_mem;
+  Cache DDR("DDR", &main_mem, 4, 2, 1024, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  Cache L1a("L1a", &DDR, 4, 4, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  Cache L1b("L1b", &DDR, 4, 4, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+  const Addr addr = 0x100000;
+  size_t num_ticks = 0;
+  L1a.line_get(addr, LINE_SHR, num_ticks, data);
+  L1b.line_get(addr + 5*64, LINE_SHR, num_ticks, data);
+  Line *line = DDR.addr2line_internal(addr);
+  QT_CHECK_EQUAL(line != NULL, true);
+  QT_CHECK_EQUAL(line->sharers, 3);
+  // one bit per 64 B line that was handed to a child
+  QT_CHECK_EQUAL(line->child_subblocks, (1ULL << 0) | (1ULL << 5));
+  // a write by one child invalidates the other one's copy
+  L1a.line_get(addr + 5*64, LINE_MOD, num_ticks, data);
+  QT_CHECK_EQUAL(L1b.is_line_present(addr + 5*64), false);
+  QT_CHECK_EQUAL(L1a.is_line_present(addr), true);
+  // evicting the DDR line evicts all its parts in the children
+  DDR.line_evict(addr);
+  QT_CHECK_EQUAL(L1a.get_num_valid_entries(), 0);
+  QT_CHECK_EQUAL(L1b.get_num_valid_entries(), 0);
+}
+
+QT_TEST(sharer_formats_128proc)
+{
+  // 128 L1 caches under one L2, with each sharer format
+  const size_t num_L1 = 128;
+  const Addr addr = 0x200000;
+  for (int format=0; format<SHARERS_NUM_FORMATS; format++) {
+    MainMemory main_mem;
+    Cache L2("L2", &main_mem, 16, 8, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+    L2.set_sharer_format((SharerFormat)format);
+    std::vector<Cache *> L1;
+    for (size_t i=0; i<num_L1; i++) {
+      L1.push_back(new Cache("L1", &L2, 4, 4, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE));
+    }
+    QT_CHECK_EQUAL(L2.get_sharer_format(), (SharerFormat)format);
+    size_t num_ticks = 0;
+    for (size_t i=0; i<num_L1; i++) {
+      L1[i]->line_get(addr, LINE_SHR, num_ticks, data);
+    }
+    for (size_t i=0; i<num_L1; i++) {
+      QT_CHECK_EQUAL(L1[i]->is_line_present(addr), true);
+    }
+    // a writer invalidates all the other copies, beyond the first 64 children too
+    L1[100]->line_get(addr, LINE_MOD, num_ticks, data);
+    for (size_t i=0; i<num_L1; i++) {
+      QT_CHECK_EQUAL(L1[i]->is_line_present(addr), i==100);
+    }
+    L1[3]->line_get(addr, LINE_SHR, num_ticks, data);
+    L1[127]->line_get(addr, LINE_SHR, num_ticks, data);
+    QT_CHECK_EQUAL(L1[100]->is_writer(addr), false);
+    L1[70]->line_get(addr, LINE_MOD, num_ticks, data);
+    for (size_t i=0; i<num_L1; i++) {
+      QT_CHECK_EQUAL(L1[i]->is_line_present(addr), i==70);
+    }
+    L2.line_evict(addr);
+    QT_CHECK_EQUAL(L1[70]->is_line_present(addr), false);
+    for (size_t i=0; i<num_L1; i++) {
+      delete L1[i];
+    }
+  }
+}
+
+QT_TEST(inclusion_policies)
+{
+  const Addr A = 0x300000;
+  size_t num_ticks = 0;
+  {
+    // NINE: an L2 eviction leaves the L1 copy alone
+    MainMemory main_mem;
+    Cache L2("L2", &main_mem, 4, 2, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+    L2.set_inclusion(INCLUSION_NINE);
+    Cache L1("L1", &L2, 4, 4, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+    L1.line_get(A, LINE_MOD, num_ticks, data);
+    L1.line_get(A + 256, LINE_SHR, num_ticks, data);
+    L1.line_get(A + 512, LINE_SHR, num_ticks, data);
+    QT_CHECK_EQUAL(L2.is_line_present(A), false);
+    QT_CHECK_EQUAL(L1.is_line_present(A), true);
+    QT_CHECK_EQUAL(L1.is_writer(A), true);
+    // the modified line goes past the L2, which does not have it any more
+    const size_t writebacks = main_mem.stats.writebacks;
+    L1.line_evict(A);
+    QT_CHECK_EQUAL(main_mem.stats.writebacks, writebacks + 1);
+  }
+  {
+    // exclusive: the L2 is a victim cache of the L1
+    MainMemory main_mem;
+    Cache L2("L2", &main_mem, 4, 4, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+    L2.set_inclusion(INCLUSION_EXCLUSIVE);
+    Cache L1("L1", &L2, 1, 2, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+    L1.line_get(A, LINE_SHR, num_ticks, data);
+    QT_CHECK_EQUAL(L2.is_line_present(A), false);
+    L1.line_get(A + 64, LINE_MOD, num_ticks, data);
+    L1.line_get(A + 128, LINE_SHR, num_ticks, data);
+    L1.line_get(A + 192, LINE_SHR, num_ticks, data);
+    QT_CHECK_EQUAL(L1.is_line_present(A), false);
+    QT_CHECK_EQUAL(L2.is_line_present(A), true);
+    QT_CHECK_EQUAL(L2.is_writer(A + 64), true);
+    QT_CHECK_EQUAL(L2.stats.victim_fills, 2);
+    // a hit moves the line back up, with its modified state
+    const size_t hits = L2.stats.hits;
+    L1.line_get(A + 64, LINE_SHR, num_ticks, data);
+    QT_CHECK_EQUAL(L2.stats.hits, hits + 1);
+    QT_CHECK_EQUAL(L2.is_line_present(A + 64), false);
+    QT_CHECK_EQUAL(L1.is_writer(A + 64), true);
+  }
+  {
+    // exclusive: the L2 does not have the line, but a write still invalidates the other L1
+    MainMemory main_mem;
+    Cache L2("L2", &main_mem, 4, 4, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+    L2.set_inclusion(INCLUSION_EXCLUSIVE);
+    Cache L1a("L1a", &L2, 4, 4, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+    Cache L1b("L1b", &L2, 4, 4, 64, DEFAULT_CACHE_ACCESS_TICKS, IS_WRITEBACK_CACHE);
+    L1a.line_get(A, LINE_SHR, num_ticks, data);
+    L1b.line_get(A, LINE_SHR, num_ticks, data);
+    QT_CHECK_EQUAL(L1a.is_line_present(A), true);
+    L1b.line_get(A, LINE_MOD, num_ticks, data);
+    QT_CHECK_EQUAL(L1a.is_line_present(A), false);
+    QT_CHECK_EQUAL(L1b.is_writer(A), true);
+    QT_CHECK_EQUAL(L2.is_line_present(A), false);
+  }
+}
+
+QT_TEST(tag_match_kernels)
+{
+  // every SIMD kernel has to find the same way as the scalar loop, and so has the inline
+  // lookup of the small sets
+  const char *impls[] = {"scalar", "sse2", "avx2", "avx512"};
+  const std::string default_impl = tag_match_impl_name();
+  Addr tags[64] __attribute__((aligned(64)));
+  for (size_t i=0; i<sizeof(impls)/sizeof(impls[0]); i++) {
+    if (!tag_match_select(impls[i])) continue; // not supported by this CPU
+    for (size_t num_tags=TAG_MATCH_STEP; num_tags<=64; num_tags+=TAG_MATCH_STEP) {
+      for (size_t way=0; way<num_tags; way++) {
+        tags[way] = (way+1)*64;
+      }
+      tags[num_tags-1] = LINE_ADDR_PAD;
+      for (size_t way=0; way<num_tags-1; way++) {
+        QT_CHECK_EQUAL(tag_match_wide(tags, num_tags, (way+1)*64), (int)way);
+        QT_CHECK_EQUAL(tag_match(tags, num_tags, (way+1)*64), (int)way);
+      }
+      QT_CHECK_EQUAL(tag_match_wide(tags, num_tags, 0), -1);
+      QT_CHECK_EQUAL(tag_match(tags, num_tags, 0), -1);
+      // only the lower or the upper half of a tag matches
+      QT_CHECK_EQUAL(tag_match_wide(tags, num_tags, ((Addr)1<<32) | 64), -1);
+      QT_CHECK_EQUAL(tag_match(tags, num_tags, ((Addr)1<<32) | 64), -1);
+      QT_CHECK_EQUAL(tag_match_wide(tags, num_tags, LINE_ADDR_NONE), -1);
+      QT_CHECK_EQUAL(tag_match(tags, num_tags, LINE_ADDR_NONE), -1);
+      tags[num_tags/2] = LINE_ADDR_NONE;
+      QT_CHECK_EQUAL(tag_match_wide(tags, num_tags, LINE_ADDR_NONE), (int)num_tags/2);
+      QT_CHECK_EQUAL(tag_match(tags, num_tags, LINE_ADDR_NONE), (int)num_tags/2);
+    }
+  }
+  tag_match_select(default_impl.c_str());
+}
+
 void cache_tests_runall()
 {
 	QT_RUN_TESTS;
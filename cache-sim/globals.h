@@ -101,6 +101,11 @@ template <int n> struct lg { static const int value = 1 + lg<n/2>::value; };
 template <> struct lg<1> { static const int value = 0; };
 #define log2compiletime(v) (lg<(v)>::value)
 
+// compile-time assertion: compile_time_assert<false> is an incomplete type
+template <bool> struct compile_time_assert;
+template <> struct compile_time_assert<true> { enum { value = 1 }; };
+#define COMPILE_TIME_ASSERT(cond) ((void)sizeof(compile_time_assert<(bool)(cond)>))
+
 template <int n> struct lg10 { static const int value = 1 + lg10<n/10>::value; };
 template <> struct lg10<1> { static const int value = 0; };
 template <> struct lg10<0> { static const int value = 0; };
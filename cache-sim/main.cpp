@@ -2,6 +2,7 @@
 #include "cache_tests.h"
 #include "cache.h"
 #include "processor.h"
+#include "replay.h"
 #include <ctime>
 #include <cstdlib>
 
@@ -260,9 +261,12 @@ segfaultHandler(int sigtype)
 
 bool do_nvlog=true;
 
-int main()
+// with arguments: replay a trace (see replay.h); without: run the tests
+int main(int argc, char *argv[])
 {
   signal(SIGSEGV, segfaultHandler);
+  if (argc > 1)
+    return replay_main(argc, argv);
   
   int *globalmem_orig = (int*)malloc((globalmem_size+128)*sizeof(int));
   globalmem = globalmem_orig+128; // avoid accessing unallocated memory
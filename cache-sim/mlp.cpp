@@ -0,0 +1,83 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+#include <assert.h>
+#include "mlp.h"
+
+MlpCore :: MlpCore(const double instr_cycles, const size_t rob_size, const size_t levels, const size_t *mshrs) :
+    _instr_cycles(instr_cycles),
+    _rob_size(rob_size),
+    _levels(levels),
+    _instr(0),
+    _now(0),
+    _stall(0),
+    _finished(0),
+    _mshrs(levels > 0 ? levels - 1 : 0)
+{
+    assert(rob_size > 0);
+    assert(levels > 0 && levels <= MAX_LEVELS);
+    for (size_t i=0; i+1<levels; i++) {
+        _mshrs[i].assign(mshrs[i], 0);
+    }
+}
+
+void
+MlpCore :: reference(const double instructions, const size_t level, const size_t latency)
+{
+    assert(level < _levels);
+    const double first = _instr + 1;    // of the instructions up to the reference
+    _instr += instructions;
+    // the start of the instruction of the reference, in order after the one before...
+    double start = _now + (instructions - 1) * _instr_cycles;
+    const double unstalled = start;
+    // ...and after the retirement of the instructions up to rob_size before it; the first
+    // instruction that waits for a reference is rob_size after it, the others follow
+    while (!_pending.empty() && _pending.front().instr <= _instr - _rob_size) {
+        const double waiting = MAX2(_pending.front().instr + _rob_size, first);
+        start = MAX2(start, _pending.front().completion + (_instr - waiting) * _instr_cycles);
+        _pending.pop_front();
+    }
+    // the reference goes out at the end of its instruction, with an MSHR in every level it
+    // misses in
+    size_t slots[MAX_LEVELS];
+    for (size_t i=0; i<level; i++) {
+        const std::vector<double> &busy = _mshrs[i];
+        if (busy.empty())
+            continue;
+        size_t slot = 0;
+        for (size_t j=1; j<busy.size(); j++) {
+            if (busy[j] < busy[slot])
+                slot = j;
+        }
+        start = MAX2(start, busy[slot] - _instr_cycles);
+        slots[i] = slot;
+    }
+    _stall += start - unstalled;
+    _now = start + _instr_cycles;
+    const double completion = _now + latency;
+    for (size_t i=0; i<level; i++) {
+        if (!_mshrs[i].empty())
+            _mshrs[i][slots[i]] = completion;
+    }
+    Pending pending;
+    pending.instr = _instr;
+    pending.completion = completion;
+    _pending.push_back(pending);
+}
+
+double
+MlpCore :: finish(const double instructions)
+{
+    _instr += instructions;
+    _now += instructions * _instr_cycles;
+    // everything retires
+    double end = _now;
+    for (size_t i=0; i<_pending.size(); i++) {
+        end = MAX2(end, _pending[i].completion);
+    }
+    _pending.clear();
+    _now = end;
+    const double cycles = _now - _finished;
+    _finished = _now;
+    return cycles;
+}
@@ -0,0 +1,59 @@
+#ifndef __MLP_H__
+#define __MLP_H__
+
+#include <stddef.h>
+#include <deque>
+#include <vector>
+#include "globals.h"
+
+// Timing of the instruction stream of a core with memory level parallelism: instructions
+// issue in order, one per instr_cycles, and a memory reference goes out at the end of its
+// instruction and completes its latency later, while the instructions after it go on. Two things stall the issue:
+//  - the reorder window: an instruction only issues when the one rob_size instructions
+//    before it has retired (all references up to that one have completed);
+//  - the miss status holding registers: a reference that misses in a level needs a free
+//    MSHR there, which it holds until it completes.
+// So independent misses overlap up to the MSHRs and the window, and a miss stalls the core
+// only for what the window cannot hide. The references are assumed independent (the trace
+// has no data dependencies), which makes pointer chasing look faster than it is.
+// With a window of 1 instruction and one reference per instruction, the time is that of
+// the serial model: instr_cycles per instruction plus every latency.
+class MlpCore
+{
+public:
+    // the levels that serve a reference: 0 for a hit in the first one, up to MAX_LEVELS-1
+    static const size_t MAX_LEVELS = 4;
+
+    // mshrs[i]: the outstanding misses of level i (0: unlimited), for i < levels-1
+    MlpCore(const double instr_cycles, const size_t rob_size, const size_t levels, const size_t *mshrs);
+
+    // the next reference, instructions after the one before (a fraction if an instruction
+    // has several), served by level with latency
+    void reference(const double instructions, const size_t level, const size_t latency);
+    // the instructions after the last reference; everything retires. The cycles since the
+    // last finish() (or the start), so that the segments of a run add up
+    double finish(const double instructions);
+
+    inline double instructions() const { return _instr; }
+    // the earliest issue time of the next instruction
+    inline double now() const { return _now; }
+    inline double stall_cycles() const { return _stall; }
+
+private:
+    struct Pending
+    {
+        double instr;       // position in the instruction stream
+        double completion;
+    };
+    double _instr_cycles;
+    double _rob_size;
+    size_t _levels;
+    double _instr;
+    double _now;
+    double _stall;          // issue cycles lost to the window and the MSHRs
+    double _finished;       // _now at the last finish()
+    std::deque<Pending> _pending;
+    std::vector<std::vector<double> > _mshrs;   // per level, the end of every busy MSHR
+};
+
+#endif //__MLP_H__
@@ -0,0 +1,409 @@
+#include <string.h>
+#include "pcm.h"
+
+static const char *pcm_field_names[PCM_NUM_FIELDS] = { "row", "rank", "bank", "channel", "column" };
+static const char *pcm_write_policy_names[PCM_WRITE_NUM_POLICIES] = { "wait", "pause", "cancel" };
+
+PcmConfig :: PcmConfig() :
+    channels(1),
+    ranks(1),
+    banks(8),
+    row_bytes(1024),
+    access_bytes(64),
+    open_page(true),
+    t_column(30),
+    t_read(120),
+    t_reset(100),
+    t_set(300),
+    set_iterations(4),
+    t_burst(8),
+    write_queue(0),
+    write_high(0),
+    write_low(0),
+    write_policy(PCM_WRITE_WAIT)
+{
+    map[0] = PCM_ROW;
+    map[1] = PCM_RANK;
+    map[2] = PCM_BANK;
+    map[3] = PCM_CHANNEL;
+    map[4] = PCM_COLUMN;
+}
+
+bool
+str2pcm_map(const char *name, PcmField map[PCM_NUM_FIELDS])
+{
+    bool seen[PCM_NUM_FIELDS] = { false };
+    size_t num_fields = 0;
+    const char *p = name;
+    while (*p) {
+        const char *end = strchr(p, ':');
+        const size_t len = end ? (size_t)(end - p) : strlen(p);
+        int field = 0;
+        while (field < PCM_NUM_FIELDS && (strlen(pcm_field_names[field]) != len || strncasecmp(p, pcm_field_names[field], len) != 0))
+            field++;
+        if (field == PCM_NUM_FIELDS || seen[field] || num_fields == PCM_NUM_FIELDS)
+            return false;
+        seen[field] = true;
+        map[num_fields++] = (PcmField)field;
+        p += len;
+        if (*p)
+            p++;
+    }
+    return num_fields == PCM_NUM_FIELDS;
+}
+
+std::string
+pcm_map2str(const PcmField map[PCM_NUM_FIELDS])
+{
+    std::string str;
+    for (size_t i=0; i<PCM_NUM_FIELDS; i++) {
+        if (i)
+            str += ":";
+        str += pcm_field_names[map[i]];
+    }
+    return str;
+}
+
+const char *
+pcm_write_policy2str(const PcmWritePolicy policy)
+{
+    assert(policy < PCM_WRITE_NUM_POLICIES);
+    return pcm_write_policy_names[policy];
+}
+
+bool
+str2pcm_write_policy(const char *name, PcmWritePolicy &policy)
+{
+    for (int i=0; i<PCM_WRITE_NUM_POLICIES; i++) {
+        if (strcasecmp(name, pcm_write_policy_names[i]) == 0) {
+            policy = (PcmWritePolicy)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::ostream &
+PcmStats :: dump(std::ostream &os, const char *prefix, size_t indentation) const
+{
+    os << nspaces(indentation).c_str() << prefix << ":\n";
+    os << nspaces(indentation+4).c_str() << "Reads: " << this->reads << std::endl;
+    os << nspaces(indentation+4).c_str() << "Read Row Hits: " << this->read_row_hits << std::endl;
+    os << nspaces(indentation+4).c_str() << "Writes: " << this->writes << std::endl;
+    os << nspaces(indentation+4).c_str() << "Bank Conflicts: " << this->bank_conflicts << std::endl;
+    os << nspaces(indentation+4).c_str() << "Read Cycles: " << this->read_cycles << std::endl;
+    os << nspaces(indentation+4).c_str() << "Read Queue Cycles: " << this->read_queue_cycles << std::endl;
+    os << nspaces(indentation+4).c_str() << "Write Queue Cycles: " << this->write_queue_cycles << std::endl;
+    os << nspaces(indentation+4).c_str() << "Read Cycles Behind Writes: " << this->read_write_cycles << std::endl;
+    os << nspaces(indentation+4).c_str() << "Reads Behind Writes: " << this->reads_behind_writes << std::endl;
+    os << nspaces(indentation+4).c_str() << "Read Forwards: " << this->read_forwards << std::endl;
+    os << nspaces(indentation+4).c_str() << "Write Drains: " << this->write_drains << std::endl;
+    os << nspaces(indentation+4).c_str() << "Writes Paused: " << this->writes_paused << std::endl;
+    os << nspaces(indentation+4).c_str() << "Writes Cancelled: " << this->writes_cancelled << std::endl;
+    os << nspaces(indentation+4).c_str() << "Cancelled Cycles: " << this->cancelled_cycles << std::endl;
+    return os;
+}
+
+PcmMemory :: PcmMemory(Addr address_space_size, size_t hit_latency_read, size_t hit_latency_write) :
+    MainMemory(address_space_size, hit_latency_read, hit_latency_write),
+    _now(0),
+    _offset_bits(0)
+{
+    memset(_field_bits, 0, sizeof(_field_bits));
+}
+
+void
+PcmMemory :: configure(const PcmConfig &config)
+{
+    assert(is_power_of_2(config.channels) && config.channels > 0);
+    assert(is_power_of_2(config.ranks) && config.ranks > 0);
+    assert(is_power_of_2(config.banks) && config.banks > 0);
+    assert(is_power_of_2(config.access_bytes) && config.access_bytes > 0);
+    assert(is_power_of_2(config.row_bytes) && config.row_bytes >= config.access_bytes);
+    assert(config.set_iterations > 0);
+    assert(config.write_queue == 0 || (config.write_low < config.write_high && config.write_high <= config.write_queue));
+    _config = config;
+    _offset_bits = log2power2(config.access_bytes);
+    _field_bits[PCM_CHANNEL] = log2power2(config.channels);
+    _field_bits[PCM_RANK] = log2power2(config.ranks);
+    _field_bits[PCM_BANK] = log2power2(config.banks);
+    _field_bits[PCM_COLUMN] = log2power2(config.row_bytes / config.access_bytes);
+    const size_t used_bits = _offset_bits + _field_bits[PCM_CHANNEL] + _field_bits[PCM_RANK] +
+                             _field_bits[PCM_BANK] + _field_bits[PCM_COLUMN];
+    const size_t address_bits = log2power2(_address_space_size);
+    assert(used_bits <= address_bits);
+    _field_bits[PCM_ROW] = address_bits - used_bits;
+    Bank closed;
+    memset(&closed, 0, sizeof(closed));
+    closed.open_row = LINE_ADDR_NONE;
+    closed.write_queued = false;
+    _banks.assign(config.channels * config.ranks * config.banks, closed);
+    _channel_busy_until.assign(config.channels, 0);
+    _write_queue.clear();
+    _now = 0;
+}
+
+inline void
+PcmMemory :: decode(const Addr addr, size_t &bank, size_t &channel, Addr &row) const
+{
+    Addr fields[PCM_NUM_FIELDS];
+    Addr rest = addr >> _offset_bits;
+    // the last field of the map is in the least significant bits
+    for (int i=PCM_NUM_FIELDS-1; i>=0; i--) {
+        const size_t bits = _field_bits[_config.map[i]];
+        fields[_config.map[i]] = rest & (((Addr)1 << bits) - 1);
+        rest >>= bits;
+    }
+    // addresses beyond the address space only make more rows
+    fields[PCM_ROW] |= rest << _field_bits[PCM_ROW];
+    channel = fields[PCM_CHANNEL];
+    bank = (channel * _config.ranks + fields[PCM_RANK]) * _config.banks + fields[PCM_BANK];
+    row = fields[PCM_ROW];
+}
+
+inline size_t
+PcmMemory :: pause_point(const size_t done) const
+{
+    if (done == 0)
+        return 0;
+    if (done <= _config.t_reset)
+        return _config.t_reset;
+    const size_t iteration = MAX2(_config.t_set / _config.set_iterations, (size_t)1);
+    const size_t iterations_done = (done - _config.t_reset + iteration - 1) / iteration;
+    return MIN2(_config.t_reset + iterations_done * iteration, this->write_cycles());
+}
+
+size_t
+PcmMemory :: read(const Addr addr)
+{
+    if (!_write_queue.empty()) {
+        this->writes_issue_idle(_now);
+        for (size_t i=0; i<_write_queue.size(); i++) {
+            if ((_write_queue[i].addr >> _offset_bits) == (addr >> _offset_bits)) {
+                // the controller still sends the data over the channel
+                size_t bank_index, channel;
+                Addr row;
+                decode(addr, bank_index, channel, row);
+                const size_t transfer = MAX2(_now, _channel_busy_until[channel]);
+                const size_t completion = transfer + _config.t_burst;
+                _channel_busy_until[channel] = completion;
+                const size_t latency = completion - _now;
+                pcm_stats.read_forwards++;
+                pcm_stats.reads++;
+                pcm_stats.read_queue_cycles += transfer - _now;
+                pcm_stats.read_cycles += latency;
+                _now = completion;
+                return latency;
+            }
+        }
+    }
+    size_t bank_index, channel;
+    Addr row;
+    decode(addr, bank_index, channel, row);
+    Bank &bank = _banks[bank_index];
+    // when the read would start without the writes
+    const size_t ready = MAX2(_now, bank.reads_until);
+    bool requeued = false;
+    size_t start = MAX2(_now, bank.busy_until);
+    size_t service = _config.t_column;
+    if (bank.open_row == row)
+        pcm_stats.read_row_hits++;
+    else
+        service += _config.t_read;
+    if (bank.write_queued && bank.busy_until > ready && _config.write_policy != PCM_WRITE_WAIT) {
+        // the write from the queue in the bank goes on after the read, or not at all
+        start = ready;
+        if (ready >= bank.write_resume) {
+            const size_t done = bank.write_progress + (ready - bank.write_resume);
+            if (_config.write_policy == PCM_WRITE_CANCEL) {
+                pcm_stats.writes_cancelled++;
+                pcm_stats.cancelled_cycles += done;
+                _write_queue.push_front(bank.write);
+                bank.write_queued = false;
+                requeued = true;
+            } else {
+                const size_t pause = this->pause_point(done);
+                start += pause - done;
+                bank.write_progress = pause;
+                if (pause < this->write_cycles())
+                    pcm_stats.writes_paused++;
+                else
+                    bank.write_queued = false;
+            }
+        }
+        if (bank.write_queued) {
+            bank.write_resume = start + service;
+            bank.busy_until = bank.write_resume + this->write_cycles() - bank.write_progress;
+        } else {
+            bank.busy_until = start + service;
+        }
+    } else {
+        bank.write_queued = false;
+        bank.busy_until = start + service;
+    }
+    const size_t data = start + service;
+    bank.reads_until = data;
+    bank.open_row = _config.open_page ? row : LINE_ADDR_NONE;
+    const size_t transfer = MAX2(data, _channel_busy_until[channel]);
+    const size_t completion = transfer + _config.t_burst;
+    _channel_busy_until[channel] = completion;
+    if (start > _now)
+        pcm_stats.bank_conflicts++;
+    if (start > ready) {
+        pcm_stats.reads_behind_writes++;
+        pcm_stats.read_write_cycles += start - ready;
+    }
+    pcm_stats.reads++;
+    pcm_stats.read_queue_cycles += (start - _now) + (transfer - data);
+    const size_t latency = completion - _now;
+    pcm_stats.read_cycles += latency;
+    // the requester waits for the data
+    _now = completion;
+    // the cancelled write may fill the queue up
+    if (requeued)
+        this->writes_drain();
+    return latency;
+}
+
+void
+PcmMemory :: write_issue(const QueuedWrite &write, const size_t at, const bool queued)
+{
+    size_t bank_index, channel;
+    Addr row;
+    decode(write.addr, bank_index, channel, row);
+    Bank &bank = _banks[bank_index];
+    // the data goes over the channel first, then into the array
+    const size_t transfer = MAX2(at, _channel_busy_until[channel]);
+    _channel_busy_until[channel] = transfer + _config.t_burst;
+    const size_t arrival = transfer + _config.t_burst;
+    const size_t start = MAX2(arrival, bank.busy_until);
+    if (start > arrival)
+        pcm_stats.bank_conflicts++;
+    bank.busy_until = start + this->write_cycles();
+    bank.open_row = _config.open_page ? row : LINE_ADDR_NONE;
+    bank.write_queued = queued;
+    bank.write = write;
+    bank.write_resume = start;
+    bank.write_progress = 0;
+    pcm_stats.writes++;
+    pcm_stats.write_queue_cycles += start - at - _config.t_burst;
+}
+
+void
+PcmMemory :: writes_issue_idle(const size_t until)
+{
+    // in order, so the writes to one bank stay in order
+    for (std::deque<QueuedWrite>::iterator write=_write_queue.begin(); write!=_write_queue.end(); ) {
+        size_t bank_index, channel;
+        Addr row;
+        decode(write->addr, bank_index, channel, row);
+        const size_t at = MAX2(write->time, _banks[bank_index].busy_until);
+        if (at < until) {
+            const QueuedWrite issued = *write;
+            write = _write_queue.erase(write);
+            this->write_issue(issued, at, true);
+        } else {
+            write++;
+        }
+    }
+}
+
+void
+PcmMemory :: writes_drain()
+{
+    if (_write_queue.size() < _config.write_high)
+        return;
+    // the reads wait for these
+    pcm_stats.write_drains++;
+    while (_write_queue.size() > _config.write_low) {
+        this->write_issue(_write_queue.front(), _now, false);
+        _write_queue.pop_front();
+    }
+}
+
+void
+PcmMemory :: write(const Addr addr)
+{
+    QueuedWrite write;
+    write.addr = addr;
+    write.time = _now;
+    if (_config.write_queue == 0) {
+        this->write_issue(write, _now, false);
+        return;
+    }
+    this->writes_issue_idle(_now);
+    for (size_t i=0; i<_write_queue.size(); i++) {
+        // the new data replaces the queued
+        if ((_write_queue[i].addr >> _offset_bits) == (addr >> _offset_bits))
+            return;
+    }
+    _write_queue.push_back(write);
+    this->writes_drain();
+}
+
+void
+PcmMemory :: line_get(const Addr addr, const uint8_t line_state_req, size_t &latency, uint8_t *&pdata)
+{
+    if (!is_banked()) {
+        MainMemory::line_get(addr, line_state_req, latency, pdata);
+        return;
+    }
+    // a fetch for reading or for writing reads the array alike
+    const size_t read_latency = this->read(addr);
+    latency += read_latency;
+    stats.ticks_inc(read_latency);
+    if (line_state_req == LINE_SHR)
+        stats.hits_rd_inc();
+    else
+        stats.hits_wr_inc();
+    stats.hits_inc();
+}
+
+void
+PcmMemory :: line_get_intercache(const Addr addr, const uint8_t line_state_req, size_t &latency,
+                                 const unsigned child_index, Line *&parent_line)
+{
+    uint8_t *pdata = NULL;
+    this->line_get(addr, line_state_req, latency, pdata);
+}
+
+void
+PcmMemory :: line_data_writeback(Line *line)
+{
+    if (!is_banked()) {
+        MainMemory::line_data_writeback(line);
+        return;
+    }
+    this->write(line->addr);
+    stats.writebacks_inc();
+    stats.ticks_inc(this->write_cycles());
+}
+
+void
+PcmMemory :: data_writeback(const Addr addr, const size_t bytes)
+{
+    if (!is_banked()) {
+        MainMemory::data_writeback(addr, bytes);
+        return;
+    }
+    // a writeback is one device write, as one line_data_writeback() is
+    for (Addr offset=0; offset<bytes; offset+=_config.access_bytes) {
+        this->write(addr + offset);
+        stats.writebacks_inc();
+        stats.ticks_inc(this->write_cycles());
+    }
+}
+
+void
+PcmMemory :: reset_stats()
+{
+    MainMemory::reset_stats();
+    pcm_stats = PcmStats();
+}
+
+void
+PcmMemory :: dump_device_stats(std::ofstream &stats_file, size_t indentation)
+{
+    if (is_banked())
+        this->pcm_stats.dump(stats_file, "- PCM banks", indentation);
+}
@@ -0,0 +1,173 @@
+#ifndef __PCM_H__
+#define __PCM_H__
+
+#include <deque>
+#include <vector>
+#include "cache.h"
+
+// The fields of a PCM address, for the interleaving map
+enum PcmField {
+    PCM_ROW = 0,
+    PCM_RANK,
+    PCM_BANK,
+    PCM_CHANNEL,
+    PCM_COLUMN,
+    PCM_NUM_FIELDS
+};
+
+// What a read does to a queued write in progress in its bank
+enum PcmWritePolicy {
+    PCM_WRITE_WAIT = 0,         // wait for the end of the write
+    PCM_WRITE_PAUSE,            // pause the write at its next pulse or SET iteration, resume it after the read
+    PCM_WRITE_CANCEL,           // abort the write, which goes back to the head of the queue
+    PCM_WRITE_NUM_POLICIES
+};
+
+const char *pcm_write_policy2str(const PcmWritePolicy policy);
+bool str2pcm_write_policy(const char *name, PcmWritePolicy &policy);
+
+// Geometry and timing (in core cycles) of a banked PCM device, and its write queue
+struct PcmConfig
+{
+    size_t channels;
+    size_t ranks;               // per channel
+    size_t banks;               // per rank
+    size_t row_bytes;           // of the row buffer of a bank
+    size_t access_bytes;        // of a request: a DDR cache sector, or a line of the last cache
+    PcmField map[PCM_NUM_FIELDS]; // the fields of an address, from the most significant bits
+    bool open_page;             // keep the row of an access open for the next (closed: close it)
+    size_t t_column;            // a read out of the open row
+    size_t t_read;              // array read of a row into the row buffer
+    size_t t_reset;             // array write of a request: the RESET pulse (to amorphous) and
+    size_t t_set;               // then the much longer SET pulse (to crystalline), in
+    size_t set_iterations;      // this many iterations (the points where a write can pause)
+    size_t t_burst;             // data transfer of a request on the channel
+    size_t write_queue;         // entries of the write queue (0: writes go to the banks at once)
+    size_t write_high;          // entries that start a drain of the write queue...
+    size_t write_low;           // ...down to this many
+    PcmWritePolicy write_policy;
+
+    // 1 channel, 1 rank of 8 banks, 1 KB rows, 64 B requests, row:rank:bank:channel:column,
+    // open page; 15 ns column read, 60 ns array read, 50 ns RESET, 150 ns SET in 4 iterations,
+    // 4 ns burst; no write queue
+    PcmConfig();
+};
+
+// the map of the names of all fields in some order, separated by ':' ("row:bank:column:...")
+bool str2pcm_map(const char *name, PcmField map[PCM_NUM_FIELDS]);
+std::string pcm_map2str(const PcmField map[PCM_NUM_FIELDS]);
+
+struct PcmStats
+{
+    size_t reads;
+    size_t writes;              // issued to the banks (a cancelled write again)
+    size_t read_row_hits;
+    size_t bank_conflicts;      // requests that found their bank busy
+    size_t read_queue_cycles;   // waiting for a busy bank or channel
+    size_t read_cycles;         // from the request to the data, including the queueing
+    size_t write_queue_cycles;  // of the writes in the banks (not in the write queue)
+    size_t read_write_cycles;   // of read_queue_cycles, waiting for writes: the read latency inflation
+    size_t reads_behind_writes;
+    size_t read_forwards;       // reads served from the write queue
+    size_t write_drains;        // of the write queue, at the high watermark
+    size_t writes_paused;
+    size_t writes_cancelled;
+    size_t cancelled_cycles;    // of the writes, lost
+
+    PcmStats() :
+        reads(0), writes(0), read_row_hits(0), bank_conflicts(0),
+        read_queue_cycles(0), read_cycles(0), write_queue_cycles(0),
+        read_write_cycles(0), reads_behind_writes(0), read_forwards(0), write_drains(0),
+        writes_paused(0), writes_cancelled(0), cancelled_cycles(0)
+    {};
+    // the read latency with the writes over that without them, minus 1
+    inline double read_inflation() const {
+        return (read_cycles > read_write_cycles) ? double(read_write_cycles) / (read_cycles - read_write_cycles) : 0;
+    }
+    std::ostream & dump(std::ostream &os, const char *prefix, size_t indentation) const;
+};
+
+// Main memory as a banked PCM device: requests are interleaved over the banks of the ranks
+// of the channels, each bank with a row buffer. A read from the open row only takes the
+// column read; any other reads the row out of the array first. A write goes through the row
+// buffer to the array (RESET then SET), so it keeps its bank busy for much longer than a read
+// (the written row is then the open one). With the closed page policy, every access closes
+// its row.
+// A request waits for its bank to finish the ones before, and for its channel to transfer.
+// Reads stall the requester for their latency; writes (writebacks) are posted, but the reads
+// behind them wait. There is no notion of time between the requests in the hierarchy, so the
+// device keeps its own clock: it advances by the latency of every read (the requester waits
+// for it) and by advance() for the time the requester spends elsewhere.
+// With a write queue, the memory controller holds the writes and issues them to idle banks
+// between the reads, so the reads go first. A read of a queued write is served from the
+// queue (the data still takes the channel). When the queue fills up to the high watermark,
+// it drains down to the low one at once, and the reads wait behind the drained writes.
+// A read that finds a write issued from the queue in progress in its bank waits for it,
+// pauses it or cancels it (write_policy); a paused write resumes after the read, a
+// cancelled one goes back to the queue (which may then drain) and is issued again.
+// Until configure(), it is the flat MainMemory with its fixed read and write latencies.
+struct PcmMemory : MainMemory
+{
+    PcmConfig _config;
+    PcmStats pcm_stats;
+
+    PcmMemory(Addr address_space_size=DEFAULT_ADDRESS_SPACE_SIZE,
+              size_t hit_latency_read=DEFAULT_MAIN_MEMORY_ACCESS_TICKS,
+              size_t hit_latency_write=DEFAULT_MAIN_MEMORY_ACCESS_TICKS);
+
+    void configure(const PcmConfig &config);
+    inline bool is_banked() const { return !_banks.empty(); }
+    // the requester spent cycles between its requests
+    inline void advance(const size_t cycles) { _now += cycles; }
+    inline size_t now() const { return _now; }
+    inline size_t writes_queued() const { return _write_queue.size(); }
+
+    virtual void line_get(const Addr addr, const uint8_t line_state_req, size_t &latency, uint8_t *&pdata);
+    virtual void line_get_intercache(const Addr addr, const uint8_t line_state_req, size_t &latency,
+                                     const unsigned child_index, Line *&parent_line);
+    virtual void line_data_writeback(Line *line);
+    virtual void data_writeback(const Addr addr, const size_t bytes);
+    virtual void reset_stats();
+    virtual void dump_device_stats(std::ofstream &stats_file, size_t indentation);
+
+private:
+    struct QueuedWrite
+    {
+        Addr addr;
+        size_t time;            // of the writeback
+    };
+    struct Bank
+    {
+        size_t busy_until;
+        size_t reads_until;     // the end of the last read
+        Addr open_row;          // LINE_ADDR_NONE: closed
+        // the last write, if it was issued from the queue (it may pause or be cancelled)
+        bool write_queued;
+        QueuedWrite write;
+        size_t write_resume;    // when it (re)started
+        size_t write_progress;  // its cycles done before
+    };
+
+    // the bank and row of addr
+    inline void decode(const Addr addr, size_t &bank, size_t &channel, Addr &row) const;
+    inline size_t write_cycles() const { return _config.t_reset + _config.t_set; }
+    // the first point at or after done cycles of a write where it can pause
+    inline size_t pause_point(const size_t done) const;
+    size_t read(const Addr addr);
+    void write(const Addr addr);
+    // to the bank at time at (not before the device clock) if not queued
+    void write_issue(const QueuedWrite &write, const size_t at, const bool queued);
+    // the queued writes that can start on an idle bank before time until
+    void writes_issue_idle(const size_t until);
+    // at the high watermark, the queue down to the low one at once
+    void writes_drain();
+
+    std::vector<Bank> _banks;
+    std::deque<QueuedWrite> _write_queue;
+    std::vector<size_t> _channel_busy_until;
+    size_t _now;
+    size_t _offset_bits;
+    size_t _field_bits[PCM_NUM_FIELDS];
+};
+
+#endif //__PCM_H__
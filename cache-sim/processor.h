@@ -21,11 +21,6 @@ struct Processor : Cache
       GenericMemoryPtr parent_memory
     ) : Cache(name, parent_memory, 64, 2, 8, 1, true)
     {
-      // allocate all direct entries
-      _entries.resize(_num_direct_entries);
-      for (size_t i=0; i<_num_direct_entries; i++) {
-        _entries[i].set_capacity(_associativity);
-      }
       // connect to a parent memory
       _parent->add_child(this);
     }
@@ -0,0 +1,184 @@
+#ifndef __REPLACEMENT_H__
+#define __REPLACEMENT_H__
+
+#include <stddef.h>
+#include "globals.h"
+
+// Cache replacement policies.
+// Every policy is a class with static, inlined operations on one set:
+//   touch(set, way)  - the line in this way was hit
+//   insert(set, way) - a new line was filled into this way (after a miss)
+//   erase(set, way)  - the line in this way was removed (eviction or invalidation)
+//   victim(set)      - which way to replace in a full set
+// my_cam instantiates its lookup for each policy; the cache only selects
+// the instantiation (per level) with its ReplPolicy.
+
+enum ReplPolicy {
+    REPL_LRU = 0,   // exact LRU
+    REPL_PLRU,      // tree pseudo-LRU
+    REPL_SRRIP,     // static re-reference interval prediction
+    REPL_BRRIP,     // bimodal RRIP
+    REPL_DIP,       // set dueling between LRU and bimodal insertion (BIP)
+    REPL_RANDOM,
+    REPL_NUM_POLICIES
+};
+
+const char *repl_policy2str(const ReplPolicy policy);
+bool str2repl_policy(const char *name, ReplPolicy &policy);
+
+// metadata byte of a way that holds no line
+const uint8_t REPL_NONE = 0xff;
+
+const uint8_t RRPV_MAX = 3;          // 2-bit re-reference prediction values
+const uint32_t BIMODAL_THROTTLE = 32; // BRRIP/BIP insert "near" once every this many fills
+const uint32_t DIP_PSEL_MAX = 1023;   // 10-bit policy selector
+const size_t DIP_LEADER_PERIOD = 32;  // one LRU and one BIP leader set in every 32 sets
+
+// Replacement state shared by all sets of a cache
+struct ReplState
+{
+    ReplPolicy policy;
+    uint32_t rng;
+    uint32_t psel;
+    ReplState() : policy(REPL_LRU), rng(0x9e3779b9), psel(DIP_PSEL_MAX/2) {}
+    // xorshift; a fixed seed keeps simulations reproducible
+    inline uint32_t random() {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        return rng;
+    }
+};
+
+// Replacement metadata of one set: a byte per way and a 64-bit word per set
+struct ReplSet
+{
+    uint8_t *meta;
+    uint64_t *bits;
+    size_t ways;
+    size_t set;
+    ReplState *state;
+};
+
+// Exact LRU: meta is the recency rank of a way, 0 being the most recently used
+struct ReplLRU
+{
+    static inline void touch(ReplSet &rs, size_t way) {
+        const uint8_t rank = rs.meta[way];
+        for (size_t i=0; i<rs.ways; i++) {
+            if (rs.meta[i]<rank) rs.meta[i]++;
+        }
+        rs.meta[way] = 0;
+    }
+    static inline void insert(ReplSet &rs, size_t way) {
+        // an empty way has rank REPL_NONE, so all valid lines age by one
+        touch(rs, way);
+    }
+    // insert as the least recently used line (BIP)
+    static inline void insert_lru(ReplSet &rs, size_t way) {
+        if (rs.meta[way] != REPL_NONE) return; // a replaced victim already has the lowest rank
+        uint8_t rank = 0;
+        for (size_t i=0; i<rs.ways; i++) {
+            if (rs.meta[i]!=REPL_NONE) rank++;
+        }
+        rs.meta[way] = rank;
+    }
+    static inline void erase(ReplSet &rs, size_t way) {
+        const uint8_t rank = rs.meta[way];
+        for (size_t i=0; i<rs.ways; i++) {
+            if (rs.meta[i]>rank && rs.meta[i]!=REPL_NONE) rs.meta[i]--;
+        }
+        rs.meta[way] = REPL_NONE;
+    }
+    static inline size_t victim(ReplSet &rs) {
+        const uint8_t rank = rs.ways-1;
+        for (size_t way=0; way<rs.ways; way++) {
+            if (rs.meta[way]==rank) return way;
+        }
+        assert(false && "LRU ranks are corrupted");
+        return 0;
+    }
+};
+
+// Tree pseudo-LRU over a power-of-2 number of ways (up to 64).
+// Node n (the root is 1) has children 2n and 2n+1; its bit points to the colder subtree.
+struct ReplPLRU
+{
+    static inline void touch(ReplSet &rs, size_t way) {
+        size_t node = 1;
+        for (size_t level=log2power2(rs.ways); level>0; level--) {
+            const size_t right = (way >> (level-1)) & 1;
+            if (right) *rs.bits &= ~(1ULL << node);
+            else *rs.bits |= (1ULL << node);
+            node = 2*node + right;
+        }
+    }
+    static inline void insert(ReplSet &rs, size_t way) { touch(rs, way); }
+    static inline void erase(ReplSet &rs, size_t way) {}
+    static inline size_t victim(ReplSet &rs) {
+        size_t node = 1;
+        for (size_t level=log2power2(rs.ways); level>0; level--) {
+            node = 2*node + ((*rs.bits >> node) & 1);
+        }
+        return node - rs.ways;
+    }
+};
+
+// SRRIP with hit priority: meta is the re-reference prediction value (RRPV)
+struct ReplSRRIP
+{
+    static inline void touch(ReplSet &rs, size_t way) { rs.meta[way] = 0; }
+    static inline void insert(ReplSet &rs, size_t way) { rs.meta[way] = RRPV_MAX-1; }
+    static inline void erase(ReplSet &rs, size_t way) { rs.meta[way] = REPL_NONE; }
+    static inline size_t victim(ReplSet &rs) {
+        for (;;) {
+            for (size_t way=0; way<rs.ways; way++) {
+                if (rs.meta[way]==RRPV_MAX) return way;
+            }
+            for (size_t way=0; way<rs.ways; way++) {
+                rs.meta[way]++;
+            }
+        }
+    }
+};
+
+// BRRIP: like SRRIP, but most lines are inserted with a distant re-reference prediction
+struct ReplBRRIP : ReplSRRIP
+{
+    static inline void insert(ReplSet &rs, size_t way) {
+        rs.meta[way] = (rs.state->random() % BIMODAL_THROTTLE == 0) ? RRPV_MAX-1 : RRPV_MAX;
+    }
+};
+
+// DIP: LRU and BIP leader sets vote (through PSEL) on the insertion policy of the other sets
+struct ReplDIP : ReplLRU
+{
+    static inline void insert(ReplSet &rs, size_t way) {
+        const size_t leader = rs.set % DIP_LEADER_PERIOD;
+        bool use_bip;
+        if (leader == 0) { // LRU leader missed
+            if (rs.state->psel < DIP_PSEL_MAX) rs.state->psel++;
+            use_bip = false;
+        } else if (leader == DIP_LEADER_PERIOD-1) { // BIP leader missed
+            if (rs.state->psel > 0) rs.state->psel--;
+            use_bip = true;
+        } else {
+            use_bip = rs.state->psel > DIP_PSEL_MAX/2;
+        }
+        if (use_bip && rs.state->random() % BIMODAL_THROTTLE != 0) {
+            ReplLRU::insert_lru(rs, way);
+        } else {
+            ReplLRU::insert(rs, way);
+        }
+    }
+};
+
+struct ReplRandom
+{
+    static inline void touch(ReplSet &rs, size_t way) {}
+    static inline void insert(ReplSet &rs, size_t way) {}
+    static inline void erase(ReplSet &rs, size_t way) {}
+    static inline size_t victim(ReplSet &rs) { return rs.state->random() % rs.ways; }
+};
+
+#endif //__REPLACEMENT_H__
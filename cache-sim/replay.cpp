@@ -0,0 +1,524 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sched.h>
+#include <fstream>
+#include <sstream>
+#include "globals.h"
+#include "replay.h"
+
+static void *
+decode_thread(void *arg)
+{
+    static_cast<TraceDecoder *>(arg)->decode_loop();
+    return NULL;
+}
+
+TraceDecoder :: TraceDecoder(const TraceReader &reader, const size_t num_threads, const size_t window) :
+    _reader(reader),
+    _slots(MAX2(window, (size_t)1)),
+    _next_decode(0),
+    _consumed(0),
+    _started(false),
+    _failed(false),
+    _stop(false)
+{
+    for (size_t slot=0; slot<_slots.size(); slot++) {
+        _slots[slot].refs.resize(MAX2(reader.max_chunk_refs(), (size_t)1));
+        _slots[slot].chunk = (size_t)-1;
+        _slots[slot].failed = false;
+    }
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_decoded, NULL);
+    pthread_cond_init(&_released, NULL);
+    _threads.resize(num_threads);
+    for (size_t i=0; i<num_threads; i++) {
+        if (pthread_create(&_threads[i], NULL, decode_thread, this) != 0) {
+            fprintf(stderr, "CACHE WARNING: cannot start decode thread %lu\n", i);
+            _threads.resize(i);
+            break;
+        }
+    }
+}
+
+TraceDecoder :: ~TraceDecoder()
+{
+    pthread_mutex_lock(&_lock);
+    _stop = true;
+    pthread_cond_broadcast(&_released);
+    pthread_mutex_unlock(&_lock);
+    for (size_t i=0; i<_threads.size(); i++) {
+        pthread_join(_threads[i], NULL);
+    }
+    pthread_cond_destroy(&_released);
+    pthread_cond_destroy(&_decoded);
+    pthread_mutex_destroy(&_lock);
+}
+
+void
+TraceDecoder :: decode_loop()
+{
+    pthread_mutex_lock(&_lock);
+    while (!_stop && _next_decode < _reader.num_chunks()) {
+        const size_t chunk = _next_decode;
+        // the slot still holds chunk - window until the consumer is done with it
+        if (chunk >= _consumed + _slots.size()) {
+            pthread_cond_wait(&_released, &_lock);
+            continue;
+        }
+        _next_decode++;
+        pthread_mutex_unlock(&_lock);
+        Slot &slot = _slots[chunk % _slots.size()];
+        slot.failed = !_reader.decode(chunk, &slot.refs[0], slot.scratch);
+        pthread_mutex_lock(&_lock);
+        slot.chunk = chunk;
+        pthread_cond_broadcast(&_decoded);
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+TraceDecoder::Slot *
+TraceDecoder :: next_slot(size_t &chunk, size_t &n)
+{
+    if (_failed) {
+        return NULL;
+    }
+    pthread_mutex_lock(&_lock);
+    if (_started) {
+        _consumed++;
+        pthread_cond_broadcast(&_released);
+    }
+    _started = true;
+    chunk = _consumed;
+    if (chunk >= _reader.num_chunks()) {
+        pthread_mutex_unlock(&_lock);
+        return NULL;
+    }
+    Slot &slot = _slots[chunk % _slots.size()];
+    if (_threads.empty()) {
+        pthread_mutex_unlock(&_lock);
+        slot.failed = !_reader.decode(chunk, &slot.refs[0], slot.scratch);
+        slot.chunk = chunk;
+    } else {
+        while (slot.chunk != chunk) {
+            pthread_cond_wait(&_decoded, &_lock);
+        }
+        pthread_mutex_unlock(&_lock);
+    }
+    if (slot.failed) {
+        fprintf(stderr, "CACHE WARNING: %s: chunk %lu is corrupt\n", _reader._path.c_str(), chunk);
+        _failed = true;
+        return NULL;
+    }
+    n = _reader.chunk(chunk).num_refs;
+    return &slot;
+}
+
+const Access *
+TraceDecoder :: next(size_t &chunk, size_t &n)
+{
+    Slot *slot = this->next_slot(chunk, n);
+    return slot ? &slot->refs[0] : NULL;
+}
+
+bool
+TraceDecoder :: take(size_t &chunk, size_t &n, std::vector<Access> &refs)
+{
+    Slot *slot = this->next_slot(chunk, n);
+    if (slot == NULL) {
+        return false;
+    }
+    // the slot is ours until the next call, so its buffer can be exchanged
+    slot->refs.swap(refs);
+    if (slot->refs.size() < _reader.max_chunk_refs()) {
+        slot->refs.resize(_reader.max_chunk_refs());
+    }
+    return true;
+}
+
+ReplayConfig :: ReplayConfig() :
+    cores(16),
+    ddr_mb(128),
+    ddr_ways(8),
+    ddr_line_bytes(1024),
+    ddr_sector_bytes(64),
+    l2_incl(INCLUSION_INCLUSIVE),
+    ddr_incl(INCLUSION_INCLUSIVE)
+{
+    for (size_t level=0; level<3; level++) {
+        repl[level] = REPL_LRU;
+    }
+}
+
+bool
+ReplayConfig :: set(const std::string &key, const std::string &value)
+{
+    const size_t number = strtoul(value.c_str(), NULL, 0);
+    if (key == "name") {
+        name = value;
+    } else if (key == "cores") {
+        cores = number;
+        return cores >= 1 && cores <= REPLAY_MAX_CORES;
+    } else if (key == "ddr_mb") {
+        ddr_mb = number;
+    } else if (key == "ddr_ways") {
+        ddr_ways = number;
+    } else if (key == "ddr_line") {
+        ddr_line_bytes = number;
+    } else if (key == "ddr_sector") {
+        ddr_sector_bytes = number;
+    } else if (key == "l1_repl") {
+        return str2repl_policy(value.c_str(), repl[0]);
+    } else if (key == "l2_repl") {
+        return str2repl_policy(value.c_str(), repl[1]);
+    } else if (key == "ddr_repl") {
+        return str2repl_policy(value.c_str(), repl[2]);
+    } else if (key == "l2_incl") {
+        return str2inclusion(value.c_str(), l2_incl);
+    } else if (key == "ddr_incl") {
+        return str2inclusion(value.c_str(), ddr_incl);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool
+ReplayConfig :: parse(const std::string &spec)
+{
+    std::istringstream words(spec);
+    std::string word;
+    while (words >> word) {
+        const size_t eq = word.find('=');
+        if (eq == std::string::npos || !this->set(word.substr(0, eq), word.substr(eq + 1))) {
+            fprintf(stderr, "CACHE WARNING: invalid configuration setting '%s'\n", word.c_str());
+            return false;
+        }
+    }
+    if (name.empty()) {
+        name = spec;
+    }
+    return true;
+}
+
+bool
+ReplayConfig :: valid() const
+{
+    const size_t ddr_lines = (ddr_mb * MB) / ddr_line_bytes;
+    if (!is_power_of_2(ddr_mb) || !is_power_of_2(ddr_ways) || !is_power_of_2(ddr_line_bytes) ||
+        !is_power_of_2(ddr_sector_bytes) || ddr_sector_bytes > ddr_line_bytes || ddr_lines < ddr_ways)
+    {
+        fprintf(stderr, "CACHE WARNING: %s: the DDR cache geometry has to be powers of 2\n", name.c_str());
+        return false;
+    }
+    return true;
+}
+
+ReplayHierarchy :: ReplayHierarchy(const ReplayConfig &config) :
+    config(config),
+    L1(config.cores),
+    L2(config.cores)
+{
+    PCM = new MainMemory(addr_space, REPLAY_PCM_LATENCY);
+    DDR = new Cache("DDR", PCM, (config.ddr_mb*MB)/(config.ddr_line_bytes*config.ddr_ways), config.ddr_ways,
+            config.ddr_line_bytes, REPLAY_DDR_LATENCY, IS_WRITEBACK_CACHE, config.repl[2]);
+    for (size_t core=0; core<config.cores; core++) {
+        char name[64];
+        snprintf(name, sizeof(name), "L2 core %lu", core);
+        L2[core] = new Cache(name, DDR, 16*1024, 8, 64, REPLAY_L2_LATENCY, IS_WRITEBACK_CACHE, config.repl[1]);
+        snprintf(name, sizeof(name), "L1 core %lu", core);
+        L1[core] = new Cache(name, L2[core], 512, 4, 64, REPLAY_L1_LATENCY, IS_WRITEBACK_CACHE, config.repl[0]);
+    }
+    // only hits, misses and writebacks are simulated, the replay never reads line data
+    DDR->set_sector_size(config.ddr_sector_bytes);
+    DDR->set_tag_only(true);
+    for (size_t core=0; core<config.cores; core++) {
+        L2[core]->set_inclusion(config.l2_incl);
+    }
+    DDR->set_inclusion(config.ddr_incl);
+}
+
+ReplayHierarchy :: ~ReplayHierarchy()
+{
+    // children first: a cache flushes its lines to the parent
+    for (size_t core=0; core<L1.size(); core++) {
+        delete L1[core];
+        delete L2[core];
+    }
+    delete DDR;
+    delete PCM;
+}
+
+void
+ReplayHierarchy :: simulate(const uint32_t tid, const uint64_t instructions_so_far, const Access *refs, const size_t n)
+{
+    // a thread runs on core tid % cores, as in nvramsim
+    L1[tid % L1.size()]->access_batch(refs, n, batch);
+    uint64_t &count = instructions[tid];
+    count = MAX2(count, instructions_so_far);
+}
+
+uint64_t
+ReplayHierarchy :: num_instr() const
+{
+    uint64_t total = 0;
+    for (std::map<uint32_t, uint64_t>::const_iterator it=instructions.begin(); it!=instructions.end(); it++) {
+        total += it->second;
+    }
+    return total;
+}
+
+CacheStats
+ReplayHierarchy :: level_stats(const size_t level) const
+{
+    CacheStats stats;
+    for (size_t core=0; level<2 && core<L1.size(); core++) {
+        stats.merge((level == 0) ? L1[core]->stats : L2[core]->stats);
+    }
+    if (level == 2)
+        stats = DDR->stats;
+    if (level == 3)
+        stats = PCM->stats;
+    return stats;
+}
+
+// one decoded chunk, read in place by every configuration
+struct ReplayChunk
+{
+    uint32_t tid;
+    uint64_t instructions;
+    size_t n;
+    std::vector<Access> refs;
+};
+
+struct ReplayWorker
+{
+    BroadcastRing<ReplayChunk> *ring;
+    size_t consumer;
+    ReplayHierarchy *hierarchy;
+    pthread_t thread;
+};
+
+// waiting on the ring: yield at first, then sleep, so that idle threads do not take the
+// processors of the busy ones for long
+static inline void
+replay_wait(size_t &spins)
+{
+    if (spins++ < 100)
+        sched_yield();
+    else
+        usleep(100);
+}
+
+static void *
+replay_thread(void *arg)
+{
+    ReplayWorker *worker = static_cast<ReplayWorker *>(arg);
+    size_t spins = 0;
+    for (;;) {
+        const ReplayChunk *chunk = worker->ring->peek(worker->consumer);
+        if (chunk == NULL) {
+            if (worker->ring->done(worker->consumer))
+                break;
+            replay_wait(spins);
+            continue;
+        }
+        spins = 0;
+        worker->hierarchy->simulate(chunk->tid, chunk->instructions, &chunk->refs[0], chunk->n);
+        worker->ring->release(worker->consumer);
+    }
+    return NULL;
+}
+
+bool
+replay_broadcast(const TraceReader &reader, const std::vector<ReplayHierarchy *> &hierarchies,
+                 const size_t num_decode_threads, const size_t window)
+{
+    BroadcastRing<ReplayChunk> ring;
+    const size_t capacity = is_power_of_2(window) ? window : 2UL << log2floor(MAX2(window, (size_t)1));
+    ring.init(capacity, hierarchies.size());
+    for (size_t i=0; i<ring.capacity(); i++) {
+        ring.cell(i).refs.resize(MAX2(reader.max_chunk_refs(), (size_t)1));
+    }
+    std::vector<ReplayWorker> workers(hierarchies.size());
+    size_t num_started = 0;
+    for (; num_started<workers.size(); num_started++) {
+        ReplayWorker &worker = workers[num_started];
+        worker.ring = &ring;
+        worker.consumer = num_started;
+        worker.hierarchy = hierarchies[num_started];
+        if (pthread_create(&worker.thread, NULL, replay_thread, &worker) != 0) {
+            fprintf(stderr, "CACHE WARNING: cannot start the thread of configuration %s\n", worker.hierarchy->config.name.c_str());
+            break;
+        }
+    }
+
+    bool ok = num_started == workers.size();
+    {
+        TraceDecoder decoder(reader, num_decode_threads, window);
+        size_t spins = 0;
+        while (ok) {
+            ReplayChunk *cell = ring.claim();
+            if (cell == NULL) {
+                replay_wait(spins);
+                continue;
+            }
+            spins = 0;
+            size_t chunk;
+            if (!decoder.take(chunk, cell->n, cell->refs)) {
+                ok = !decoder.failed();
+                break;
+            }
+            cell->tid = reader.chunk(chunk).tid;
+            cell->instructions = reader.chunk(chunk).instructions;
+            ring.publish();
+        }
+    }
+    // the threads finish what was published
+    ring.close();
+    for (size_t i=0; i<num_started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    return ok;
+}
+
+static double
+seconds_now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int
+replay_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s <trace file> [-decode_threads N] [-window N] [-<setting> <value>]...\n"
+            "       [-config '<setting>=<value> ...']... [-configs <file>]\n"
+            "Simulates a trace of nvramsim -trace (see trace.h) on the nvramsim hierarchy.\n"
+            "Settings: name, cores, ddr_mb, ddr_ways, ddr_line, ddr_sector, l1_repl, l2_repl, ddr_repl,\n"
+            "          l2_incl, ddr_incl. -<setting> changes the default configuration; every -config\n"
+            "          and every line of a -configs file is a configuration that changes the default,\n"
+            "          and all configurations are simulated in one pass over the trace.\n", name);
+    return 1;
+}
+
+static void
+replay_report(const std::vector<ReplayHierarchy *> &hierarchies, const TraceReader &reader, const double elapsed)
+{
+    const char *level_names[] = { "L1", "L2", "DDR" };
+    printf("%-24s %14s %14s %10s", "Configuration", "Instructions", "References", "Cycles/ref");
+    for (size_t level=0; level<3; level++) {
+        printf(" %12s-hits %12s-misses", level_names[level], level_names[level]);
+    }
+    printf(" %14s %14s %14s %10s\n", "DDR-sect-miss", "PCM-read-KB", "PCM-write-KB", "Exec-s");
+    for (size_t i=0; i<hierarchies.size(); i++) {
+        const ReplayHierarchy &hierarchy = *hierarchies[i];
+        const uint64_t num_instr = hierarchy.num_instr();
+        const BatchResult &batch = hierarchy.batch;
+        // the same estimate as nvramsim
+        const double exec_time = double(0.42*num_instr + batch.latency) / (2*1024*1024*1024LLU);
+        const CacheStats pcm = hierarchy.level_stats(3);
+        printf("%-24s %14lu %14lu %10.2lf", hierarchy.config.name.c_str(), num_instr, batch.accesses,
+               double(batch.latency)/MAX2(batch.accesses, (size_t)1));
+        for (size_t level=0; level<3; level++) {
+            const CacheStats stats = hierarchy.level_stats(level);
+            printf(" %17lu %19lu", stats.hits, stats.misses);
+        }
+        // every PCM request fetches one DDR sector, and every PCM writeback writes one modified sector
+        printf(" %14lu %14lu %14lu %10.2lf\n", hierarchy.DDR->stats.sector_misses,
+               pcm.hits*hierarchy.config.ddr_sector_bytes/1024, pcm.writebacks*hierarchy.config.ddr_sector_bytes/1024,
+               exec_time);
+        hierarchy.PCM->dump_stats(hierarchy.config.name.c_str());
+    }
+    printf("Replayed %lu configurations in %.2lf s: %.2lf M references/s, %.1lf MB/s of trace\n",
+           hierarchies.size(), elapsed, reader.num_refs() / MAX2(elapsed, 1e-9) / 1e6,
+           reader._size / MAX2(elapsed, 1e-9) / (1024*1024));
+}
+
+int
+replay_main(int argc, char *argv[])
+{
+    const char *path = NULL;
+    const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t num_decode_threads = (num_cpus > 2) ? num_cpus - 1 : 1;
+    size_t window = 0;
+    ReplayConfig base;
+    std::vector<std::string> specs;
+    for (int i=1; i<argc; i++) {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i+1] : NULL;
+        if (arg[0] != '-') {
+            if (path != NULL)
+                return replay_usage(argv[0]);
+            path = arg;
+            continue;
+        }
+        if (value == NULL)
+            return replay_usage(argv[0]);
+        i++;
+        bool ok = true;
+        if (strcmp(arg, "-decode_threads") == 0) {
+            num_decode_threads = atol(value);
+        } else if (strcmp(arg, "-window") == 0) {
+            window = atol(value);
+            ok = window >= 1;
+        } else if (strcmp(arg, "-config") == 0) {
+            specs.push_back(value);
+        } else if (strcmp(arg, "-configs") == 0) {
+            std::ifstream file(value);
+            ok = file.good();
+            for (std::string line; std::getline(file, line); ) {
+                if (line.find_first_not_of(" \t") != std::string::npos && line[line.find_first_not_of(" \t")] != '#')
+                    specs.push_back(line);
+            }
+        } else {
+            ok = base.set(arg + 1, value);
+        }
+        if (!ok) {
+            fprintf(stderr, "Invalid option %s %s\n", arg, value);
+            return replay_usage(argv[0]);
+        }
+    }
+    if (path == NULL)
+        return replay_usage(argv[0]);
+    if (window == 0)
+        window = 4 * MAX2(num_decode_threads, (size_t)1);
+    if (specs.empty())
+        specs.push_back("name=default");
+
+    std::vector<ReplayConfig> configs(specs.size(), base);
+    for (size_t i=0; i<specs.size(); i++) {
+        if (!configs[i].parse(specs[i]) || !configs[i].valid())
+            return replay_usage(argv[0]);
+    }
+
+    TraceReader reader;
+    if (!reader.open(path))
+        return 1;
+    printf("Replaying %s: %lu references in %lu chunks, %lu configurations\n", path,
+           reader.num_refs(), reader.num_chunks(), configs.size());
+    std::vector<ReplayHierarchy *> hierarchies;
+    for (size_t i=0; i<configs.size(); i++) {
+        hierarchies.push_back(new ReplayHierarchy(configs[i]));
+    }
+
+    // the chunks are in the order in which the tracer wrote them, which interleaves the
+    // threads roughly as they ran
+    const double start = seconds_now();
+    const bool ok = replay_broadcast(reader, hierarchies, num_decode_threads, window);
+    const double elapsed = seconds_now() - start;
+    if (ok)
+        replay_report(hierarchies, reader, elapsed);
+
+    for (size_t i=0; i<hierarchies.size(); i++) {
+        delete hierarchies[i];
+    }
+    return ok ? 0 : 1;
+}
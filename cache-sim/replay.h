@@ -0,0 +1,122 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "cache.h"
+#include "ring.h"
+#include "trace.h"
+
+// Decodes the chunks of a trace in file order on decode threads, up to a window of chunks
+// ahead of the consumer. Every chunk is decoded straight into a slot of the window (chunk i
+// into slot i % window) and handed out from there, so the references are never copied.
+// With no decode threads, next() decodes the chunk itself.
+class TraceDecoder
+{
+public:
+    struct Slot
+    {
+        std::vector<Access> refs;
+        std::vector<uint8_t> scratch;
+        volatile size_t chunk;      // decoded into the slot; (size_t)-1 for none
+        bool failed;
+    };
+
+    TraceDecoder(const TraceReader &reader, const size_t num_threads, const size_t window);
+    ~TraceDecoder();
+
+    // The references of the next chunk and its index; valid until the next call.
+    // NULL after the last chunk, or if a chunk is corrupt (see failed()).
+    const Access *next(size_t &chunk, size_t &n);
+    // Like next(), but the references are handed over by exchanging buffers with refs, so
+    // that they stay valid after the next call. false instead of NULL.
+    bool take(size_t &chunk, size_t &n, std::vector<Access> &refs);
+    inline bool failed() const { return _failed; }
+
+    void decode_loop();     // of a decode thread
+
+    const TraceReader &_reader;
+    std::vector<Slot> _slots;
+    std::vector<pthread_t> _threads;
+    pthread_mutex_t _lock;
+    pthread_cond_t _decoded;    // a slot was filled
+    pthread_cond_t _released;   // the consumer is done with a slot
+    size_t _next_decode;        // the next chunk a decode thread takes
+    size_t _consumed;           // chunks the consumer is done with
+    bool _started;              // the consumer has a chunk
+    bool _failed;
+    bool _stop;
+private:
+    Slot *next_slot(size_t &chunk, size_t &n);
+    TraceDecoder(const TraceDecoder &);
+    TraceDecoder &operator=(const TraceDecoder &);
+};
+
+const size_t REPLAY_L1_LATENCY = 2;
+const size_t REPLAY_L2_LATENCY = 16;
+const size_t REPLAY_DDR_LATENCY = 80;
+const size_t REPLAY_PCM_LATENCY = 4000;
+const size_t REPLAY_MAX_CORES = 64;
+
+// A configuration of the nvramsim hierarchy (per core L1 and L2, shared DDR cache over PCM)
+// for replay; the defaults are those of nvramsim. Settings are given as key=value (see set()).
+struct ReplayConfig
+{
+    std::string name;
+    size_t cores;
+    size_t ddr_mb;
+    size_t ddr_ways;
+    size_t ddr_line_bytes;
+    size_t ddr_sector_bytes;
+    ReplPolicy repl[3];     // L1, L2, DDR
+    InclusionPolicy l2_incl;
+    InclusionPolicy ddr_incl;
+
+    ReplayConfig();
+    // one setting: name, cores, ddr_mb, ddr_ways, ddr_line, ddr_sector, l1_repl, l2_repl,
+    // ddr_repl, l2_incl, ddr_incl; false for an unknown key or an invalid value
+    bool set(const std::string &key, const std::string &value);
+    // settings separated by spaces; the name defaults to the whole spec
+    bool parse(const std::string &spec);
+    bool valid() const;
+};
+
+// The caches of one configuration
+struct ReplayHierarchy
+{
+    ReplayConfig config;
+    MainMemory *PCM;
+    Cache *DDR;
+    std::vector<Cache *> L1;
+    std::vector<Cache *> L2;
+    BatchResult batch;
+    std::map<uint32_t, uint64_t> instructions;  // of every thread
+
+    ReplayHierarchy(const ReplayConfig &config);
+    ~ReplayHierarchy();
+    // the references of a chunk of thread tid
+    void simulate(const uint32_t tid, const uint64_t instructions_so_far, const Access *refs, const size_t n);
+    uint64_t num_instr() const;
+    // 0: L1, 1: L2 (summed over the cores), 2: DDR, 3: PCM
+    CacheStats level_stats(const size_t level) const;
+private:
+    ReplayHierarchy(const ReplayHierarchy &);
+    ReplayHierarchy &operator=(const ReplayHierarchy &);
+};
+
+// Simulates the trace on all hierarchies in one pass: the chunks are decoded once, into a
+// BroadcastRing, and every hierarchy simulates them on its own thread, in place. The ring
+// holds window chunks (rounded up to a power of 2); the decoder stays as far ahead of the
+// slowest hierarchy. false if a chunk is corrupt (the chunks before it are simulated).
+bool replay_broadcast(const TraceReader &reader, const std::vector<ReplayHierarchy *> &hierarchies,
+                      const size_t num_decode_threads, const size_t window);
+
+// The offline replay driver: simulates a trace of nvramsim -trace on any number of
+// configurations of the nvramsim hierarchy at once, and reports them side by side.
+// Usage: cache <trace file> [-decode_threads N] [-window N] [-<setting> <value>]...
+//        [-config '<setting>=<value> ...']... [-configs <file with one configuration per line>]
+int replay_main(int argc, char *argv[]);
+
+#endif //__REPLAY_H__
@@ -0,0 +1,183 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "globals.h"
+
+// Bounded lock-free queue for any number of producers and consumers (D. Vyukov's design).
+// Every cell has a sequence number that tells whether it is free for the producer of a
+// position or full for its consumer; producers and consumers only contend on their own
+// position counter, with a compare-and-swap. push and pop never block: they return false
+// when the ring is full or empty, and the caller decides how to wait.
+// T has to be copyable; the ring is meant for small records (pointers, job descriptors).
+template <class T>
+struct BoundedRing
+{
+    struct Cell
+    {
+        volatile size_t seq;
+        T value;
+    };
+
+    Cell *_cells;
+    size_t _mask;
+    uint8_t _pad0[64];
+    volatile size_t _enqueue_pos;
+    uint8_t _pad1[64];
+    volatile size_t _dequeue_pos;
+    uint8_t _pad2[64];
+
+    BoundedRing() : _cells(NULL), _mask(0), _enqueue_pos(0), _dequeue_pos(0) {}
+    ~BoundedRing() { delete [] _cells; }
+    // capacity has to be a power of 2; only before the first push
+    void init(size_t capacity) {
+        assert(is_power_of_2(capacity) && capacity >= 2);
+        delete [] _cells;
+        _cells = new Cell[capacity];
+        _mask = capacity - 1;
+        for (size_t i=0; i<capacity; i++) {
+            _cells[i].seq = i;
+        }
+        _enqueue_pos = 0;
+        _dequeue_pos = 0;
+    }
+    inline size_t capacity() const { return _mask + 1; }
+
+    inline bool push(const T &value) {
+        Cell *cell;
+        size_t pos = _enqueue_pos;
+        for (;;) {
+            cell = &_cells[pos & _mask];
+            const size_t seq = cell->seq;
+            const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (__sync_bool_compare_and_swap(&_enqueue_pos, pos, pos + 1))
+                    break;
+                pos = _enqueue_pos;
+            } else if (diff < 0) {
+                return false;   // full
+            } else {
+                pos = _enqueue_pos;
+            }
+        }
+        cell->value = value;
+        __sync_synchronize();
+        cell->seq = pos + 1;
+        return true;
+    }
+    inline bool pop(T &value) {
+        Cell *cell;
+        size_t pos = _dequeue_pos;
+        for (;;) {
+            cell = &_cells[pos & _mask];
+            const size_t seq = cell->seq;
+            const intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (__sync_bool_compare_and_swap(&_dequeue_pos, pos, pos + 1))
+                    break;
+                pos = _dequeue_pos;
+            } else if (diff < 0) {
+                return false;   // empty
+            } else {
+                pos = _dequeue_pos;
+            }
+        }
+        value = cell->value;
+        __sync_synchronize();
+        cell->seq = pos + _mask + 1;
+        return true;
+    }
+    // a snapshot; other threads may change it right away
+    inline bool empty() const { return _cells[_dequeue_pos & _mask].seq != _dequeue_pos + 1; }
+private:
+    BoundedRing(const BoundedRing &);
+    BoundedRing &operator=(const BoundedRing &);
+};
+
+// Bounded ring that hands every element to each of a fixed number of consumers: one
+// producer, N consumers that each read every element at their own pace. Elements are used
+// in place: the producer fills the cell returned by claim() and publishes it, a consumer
+// reads the cell returned by peek() until it releases it. A cell is reused once the slowest
+// consumer has released it. Like BoundedRing, nothing blocks: claim() and peek() return NULL
+// when the ring is full or empty, and the caller decides how to wait.
+template <class T>
+struct BroadcastRing
+{
+    struct Position
+    {
+        volatile size_t pos;
+        uint8_t pad[64 - sizeof(size_t)];
+    };
+
+    T *_cells;
+    size_t _mask;
+    Position *_read;            // of every consumer
+    size_t _num_consumers;
+    uint8_t _pad0[64];
+    volatile size_t _write_pos;
+    volatile size_t _closed;
+    uint8_t _pad1[64];
+
+    BroadcastRing() : _cells(NULL), _mask(0), _read(NULL), _num_consumers(0), _write_pos(0), _closed(0) {}
+    ~BroadcastRing() { delete [] _cells; delete [] _read; }
+    // capacity has to be a power of 2; only before the first claim
+    void init(size_t capacity, size_t num_consumers) {
+        assert(is_power_of_2(capacity) && num_consumers >= 1);
+        delete [] _cells;
+        delete [] _read;
+        _cells = new T[capacity];
+        _mask = capacity - 1;
+        _read = new Position[num_consumers];
+        _num_consumers = num_consumers;
+        for (size_t i=0; i<num_consumers; i++) {
+            _read[i].pos = 0;
+        }
+        _write_pos = 0;
+        _closed = 0;
+    }
+    inline size_t capacity() const { return _mask + 1; }
+    inline size_t num_consumers() const { return _num_consumers; }
+    // every cell, e.g. to size the buffers of the elements before the first claim
+    inline T &cell(const size_t i) { return _cells[i]; }
+
+    // the positions change once per element, so every read and write of them is an atomic
+    // operation (a full barrier); that costs little and needs no finer grained fences
+    static inline size_t load(volatile size_t &x) { return __sync_fetch_and_add(&x, 0); }
+
+    // producer: the next cell to fill, or NULL while the slowest consumer is a ring behind
+    inline T *claim() {
+        const size_t pos = load(_write_pos);
+        size_t slowest = pos;
+        for (size_t i=0; i<_num_consumers; i++) {
+            slowest = MIN2(slowest, load(_read[i].pos));
+        }
+        if (pos - slowest > _mask)
+            return NULL;
+        return &_cells[pos & _mask];
+    }
+    // producer: the claimed cell is filled
+    inline void publish() { __sync_fetch_and_add(&_write_pos, 1); }
+    // producer: no more elements (after the last publish)
+    inline void close() { __sync_fetch_and_add(&_closed, 1); }
+
+    // consumer: its next element, or NULL if there is none yet (or none left, see done())
+    inline const T *peek(const size_t consumer) {
+        const size_t pos = load(_read[consumer].pos);
+        if (pos == load(_write_pos))
+            return NULL;
+        return &_cells[pos & _mask];
+    }
+    // consumer: done with the element from peek()
+    inline void release(const size_t consumer) { __sync_fetch_and_add(&_read[consumer].pos, 1); }
+    // consumer: every element was read (peek() returned NULL and the producer closed the ring)
+    inline bool done(const size_t consumer) {
+        return load(_closed) != 0 && load(_read[consumer].pos) == load(_write_pos);
+    }
+private:
+    BroadcastRing(const BroadcastRing &);
+    BroadcastRing &operator=(const BroadcastRing &);
+};
+
+#endif //__RING_H__
@@ -0,0 +1,57 @@
+#include <math.h>
+#include "sampling.h"
+
+RatioEstimate :: RatioEstimate() :
+    _n(0), _sx(0), _sy(0), _sxx(0), _syy(0), _sxy(0)
+{
+}
+
+void
+RatioEstimate :: add(const double y, const double x)
+{
+    _n++;
+    _sx += x;
+    _sy += y;
+    _sxx += x * x;
+    _syy += y * y;
+    _sxy += x * y;
+}
+
+void
+RatioEstimate :: merge(const RatioEstimate &other)
+{
+    _n += other._n;
+    _sx += other._sx;
+    _sy += other._sy;
+    _sxx += other._sxx;
+    _syy += other._syy;
+    _sxy += other._sxy;
+}
+
+double
+RatioEstimate :: half_width(const double z) const
+{
+    if (_n < 2 || _sx == 0)
+        return 0;
+    const double r = this->ratio();
+    // sum of the squared residuals; rounding may make it slightly negative
+    const double residuals = _syy - 2 * r * _sxy + r * r * _sxx;
+    const double variance = (residuals > 0 ? residuals : 0) / (_n - 1);
+    const double mean_x = _sx / _n;
+    return z * sqrt(variance / _n) / mean_x;
+}
+
+double
+RatioEstimate :: relative_error(const double z) const
+{
+    const double r = this->ratio();
+    return r ? this->half_width(z) / fabs(r) : 0;
+}
+
+size_t
+RatioEstimate :: units_needed(const double relative_error, const double z) const
+{
+    // the half width falls with the square root of the units
+    const double now = this->relative_error(z);
+    return (size_t)ceil(_n * (now / relative_error) * (now / relative_error));
+}
@@ -0,0 +1,38 @@
+#ifndef __SAMPLING_H__
+#define __SAMPLING_H__
+
+#include <stddef.h>
+
+// Estimate of a ratio R = sum(y) / sum(x) (cycles per instruction, hits per access, ...)
+// from sampled units of a run, like the detailed windows of SMARTS-style sampling.
+// The confidence interval is that of the ratio estimator: with the residuals
+// r = y - R x of the units, var(R) ~ var(r) / (n mean(x)^2).
+class RatioEstimate
+{
+public:
+    RatioEstimate();
+
+    // one unit, with y of x (for instance the cycles of x instructions)
+    void add(const double y, const double x);
+    void merge(const RatioEstimate &other);
+
+    inline size_t units() const { return _n; }
+    inline double sum_x() const { return _sx; }
+    inline double sum_y() const { return _sy; }
+    inline double ratio() const { return _sx ? _sy / _sx : 0; }
+    // of the confidence interval at z standard errors (1.96: 95%); 0 for less than 2 units
+    double half_width(const double z=1.96) const;
+    // half width / ratio
+    double relative_error(const double z=1.96) const;
+    // the units (at the same x per unit) for the relative error at z
+    size_t units_needed(const double relative_error, const double z=1.96) const;
+
+    size_t _n;
+    double _sx;
+    double _sy;
+    double _sxx;
+    double _syy;
+    double _sxy;
+};
+
+#endif //__SAMPLING_H__
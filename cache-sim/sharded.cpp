@@ -0,0 +1,125 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+#include <assert.h>
+#include <stdio.h>
+#include "globals.h"
+#include "sharded.h"
+
+ShardedHierarchy :: ShardedHierarchy(Cache *top, size_t num_shards)
+{
+    assert(is_power_of_2(num_shards));
+    for (Cache *cache=top; cache!=NULL; cache=cache->_parent_cache) {
+        assert(cache->_children.size() <= 1 && "only a chain of caches can be sharded");
+        _levels.push_back(cache);
+    }
+    _memory = dynamic_cast<MainMemory *>(_levels.back()->_parent);
+    assert(_memory != NULL && "the chain has to end in main memory");
+
+    // the shard bits start above the largest line, and have to be set index bits everywhere
+    _shard_bits = log2power2(num_shards);
+    _shard_low_bit = 0;
+    for (size_t level=0; level<_levels.size(); level++) {
+        _shard_low_bit = MAX2(_shard_low_bit, _levels[level]->_line_bits);
+    }
+    for (size_t level=0; level<_levels.size(); level++) {
+        const Cache *cache = _levels[level];
+        if (_shard_low_bit + _shard_bits > cache->_line_bits + log2power2(cache->_num_direct_entries)) {
+            fprintf(stderr, "CACHE WARNING: %s has too few sets for %lu shards\n", cache->_name.c_str(), num_shards);
+            assert(false && "too many shards");
+        }
+    }
+
+    for (size_t shard_i=0; shard_i<num_shards; shard_i++) {
+        Shard *shard = new Shard;
+        shard->memory = new MainMemory(_memory->_address_space_size, _memory->_hit_latency_read, _memory->_hit_latency_write);
+        shard->caches.resize(_levels.size());
+        // parents first
+        GenericMemoryPtr parent = shard->memory;
+        for (size_t level=_levels.size(); level-- > 0; ) {
+            const Cache *orig = _levels[level];
+            Cache *cache = new Cache(orig->_name, parent, orig->_num_direct_entries >> _shard_bits,
+                    orig->_associativity, orig->_line_size_bytes, orig->_hit_latency,
+#ifdef HAS_HTM
+                    orig->_is_writeback_cache, NULL,
+#else
+                    orig->_is_writeback_cache,
+#endif
+                    orig->get_repl_policy());
+            cache->set_shard_bits(_shard_low_bit, _shard_bits);
+            shard->caches[level] = cache;
+            parent = cache;
+        }
+        // the children are connected now
+        for (size_t level=0; level<_levels.size(); level++) {
+            const Cache *orig = _levels[level];
+            Cache *cache = shard->caches[level];
+            cache->set_sector_size(orig->get_sector_size());
+            cache->set_tag_only(orig->is_tag_only());
+            cache->set_sharer_format(orig->get_sharer_format());
+        }
+        for (size_t level=0; level<_levels.size(); level++) {
+            shard->caches[level]->set_inclusion(_levels[level]->get_inclusion());
+        }
+        _shards.push_back(shard);
+    }
+}
+
+ShardedHierarchy :: ~ShardedHierarchy()
+{
+    for (size_t shard_i=0; shard_i<_shards.size(); shard_i++) {
+        Shard *shard = _shards[shard_i];
+        // children first: a cache flushes its lines to the parent
+        for (size_t level=0; level<shard->caches.size(); level++) {
+            delete shard->caches[level];
+        }
+        delete shard->memory;
+        delete shard;
+    }
+}
+
+void
+ShardedHierarchy :: partition(const Access *refs, const size_t n)
+{
+    for (size_t shard_i=0; shard_i<_shards.size(); shard_i++) {
+        _shards[shard_i]->refs.clear();
+    }
+    for (size_t i=0; i<n; i++) {
+        _shards[this->shard_of(refs[i].addr)]->refs.push_back(refs[i]);
+    }
+}
+
+void
+ShardedHierarchy :: simulate(const size_t shard_i)
+{
+    Shard *shard = _shards[shard_i];
+    if (!shard->refs.empty()) {
+        shard->caches[0]->access_batch(&shard->refs[0], shard->refs.size(), shard->result);
+    }
+}
+
+void
+ShardedHierarchy :: collect(BatchResult &out)
+{
+    for (size_t shard_i=0; shard_i<_shards.size(); shard_i++) {
+        BatchResult &result = _shards[shard_i]->result;
+        out.accesses += result.accesses;
+        out.latency += result.latency;
+        out.hits += result.hits;
+        result = BatchResult();
+    }
+}
+
+void
+ShardedHierarchy :: merge_stats()
+{
+    for (size_t shard_i=0; shard_i<_shards.size(); shard_i++) {
+        Shard *shard = _shards[shard_i];
+        for (size_t level=0; level<_levels.size(); level++) {
+            _levels[level]->stats.merge(shard->caches[level]->stats);
+            shard->caches[level]->stats = CacheStats();
+        }
+        _memory->stats.merge(shard->memory->stats);
+        shard->memory->stats = CacheStats();
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef __SHARDED_H__
+#define __SHARDED_H__
+
+#include <vector>
+#include "cache.h"
+
+// Set-sharded simulation of a chain of caches (one child per level) over main memory.
+// Addresses are interleaved over num_shards shards by the address bits just above the
+// largest line of the chain. These bits are set index bits of every level, so a set of
+// any level, a line and everything a line contains (sectors, lines of the children) belong
+// to one shard. Each shard simulates its references in their original order on its own
+// replica of the chain, holding only the sets of the shard; no state is shared between
+// shards, so the shards can be simulated concurrently (one thread per shard).
+// For LRU, PLRU and SRRIP the result is the same as that of the unsharded chain.
+// BRRIP, DIP and random replacement keep their state (random numbers, set dueling) per
+// shard: the result differs from the unsharded one, but does not depend on the scheduling.
+struct ShardedHierarchy
+{
+    // simulation state of one shard; padded so that shards do not share host cache lines
+    struct Shard
+    {
+        std::vector<Cache *> caches;    // the replica chain, first level first
+        MainMemory *memory;
+        std::vector<Access> refs;       // queued by partition()
+        BatchResult result;
+        uint8_t pad[64];
+    };
+
+    // the chain from top to main memory; the configuration of its caches (replacement,
+    // sectors, tag-only, sharer format, inclusion) is copied to the shards
+    ShardedHierarchy(Cache *top, size_t num_shards);
+    ~ShardedHierarchy();
+
+    inline size_t num_shards() const { return _shards.size(); }
+    inline size_t shard_of(const Addr addr) const {
+        return (size_t)(addr >> _shard_low_bit) & (_shards.size() - 1);
+    }
+    // queue references to their shards (replaces what was queued before)
+    void partition(const Access *refs, const size_t n);
+    // simulate the queued references of one shard; different shards may run concurrently
+    void simulate(const size_t shard);
+    // add the results of all shards to out and reset them (after simulate() is done)
+    void collect(BatchResult &out);
+    // move the statistics of the shards to the original caches and main memory,
+    // in shard order (after simulate() is done)
+    void merge_stats();
+
+    std::vector<Cache *> _levels;   // the original chain
+    MainMemory *_memory;
+    size_t _shard_low_bit;
+    size_t _shard_bits;
+    std::vector<Shard *> _shards;
+private:
+    ShardedHierarchy(const ShardedHierarchy &);
+    ShardedHierarchy &operator=(const ShardedHierarchy &);
+};
+
+#endif //__SHARDED_H__
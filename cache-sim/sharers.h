@@ -0,0 +1,180 @@
+#ifndef __SHARERS_H__
+#define __SHARERS_H__
+
+#include <stddef.h>
+#include "globals.h"
+
+// Sharer tracking: which child caches may hold a line of a cache.
+// Every line has one inline 64-bit sharer word (Line::sharers); how it is used depends on
+// the format of the cache level:
+//   SHARERS_BITMAP      - exact bitmap, a bit per child. A cache with more than 64 children
+//                         keeps the extra words right after each Line in the tag store.
+//   SHARERS_COARSE      - coarse vector, a bit per group of children (64 groups at most);
+//                         all children of a marked group are treated as sharers.
+//   SHARERS_LIMITED_PTR - up to SHARER_POINTERS exact child indices; once they are used up
+//                         the line is marked as shared by all children (broadcast).
+// Coarse formats keep a line at 64 bits of sharer state for any number of children, at the
+// cost of probing (and charging) children that do not hold the line.
+
+enum SharerFormat {
+    SHARERS_BITMAP = 0,
+    SHARERS_COARSE,
+    SHARERS_LIMITED_PTR,
+    SHARERS_NUM_FORMATS
+};
+
+const char *sharer_format2str(const SharerFormat format);
+bool str2sharer_format(const char *name, SharerFormat &format);
+
+// limited pointer word: pointers in bits 0..47, their count in bits 48..55, broadcast in bit 63
+const size_t SHARER_POINTERS = 3;
+const size_t SHARER_POINTER_BITS = 16;
+const size_t SHARER_COUNT_SHIFT = 48;
+const uint64_t SHARER_BROADCAST = 1ULL << 63;
+
+// Walks the (possible) sharers of one line, skipping one child (or none: skip = (size_t)-1)
+struct SharerIter
+{
+    SharerFormat format;
+    const uint64_t *ext;  // BITMAP: extra words after the line
+    size_t word;          // BITMAP: index of the word in bits
+    size_t num_words;
+    uint64_t bits;        // remaining bits (or pointers) of the current word
+    size_t group_bits;    // COARSE: log2 of children per bit
+    size_t run_next;      // a range of children that are all sharers (group, broadcast)
+    size_t run_end;
+    size_t num_children;
+    size_t skip;
+
+    inline bool next(size_t &child) {
+        for (;;) {
+            if (run_next < run_end) {
+                child = run_next++;
+                if (child == skip) continue;
+                return true;
+            }
+            switch (format) {
+                case SHARERS_BITMAP:
+                    while (bits == 0) {
+                        if (++word >= num_words) return false;
+                        bits = ext[word-1];
+                    }
+                    child = word*64 + __builtin_ctzll(bits);
+                    bits &= bits-1;
+                    if (child == skip) continue;
+                    return true;
+                case SHARERS_COARSE:
+                    if (bits == 0) return false;
+                    run_next = (size_t)__builtin_ctzll(bits) << group_bits;
+                    run_end = MIN2(run_next + (1UL << group_bits), num_children);
+                    bits &= bits-1;
+                    continue;
+                case SHARERS_LIMITED_PTR:
+                    if (bits == 0) return false;
+                    child = (bits & ((1ULL << SHARER_POINTER_BITS)-1)) - 1;
+                    bits >>= SHARER_POINTER_BITS;
+                    if (child == skip) continue;
+                    return true;
+                default:
+                    assert(false && "invalid sharer format");
+                    return false;
+            }
+        }
+    }
+};
+
+// Sharer format of one cache level and the operations on the sharers of its lines.
+// inl is the inline word (Line::sharers), ext the words after the line (BITMAP only).
+struct SharerDirectory
+{
+    SharerFormat format;
+    size_t num_children;
+    size_t num_words;   // BITMAP: words per line, including the inline one
+    size_t group_bits;  // COARSE: log2 of children per bit
+
+    SharerDirectory() : format(SHARERS_BITMAP), num_children(0), num_words(1), group_bits(0) {}
+    void configure(SharerFormat format, size_t num_children);
+    // bytes of sharer state kept after each line in the tag store
+    inline size_t ext_bytes() const {
+        return (format == SHARERS_BITMAP) ? (num_words-1)*sizeof(uint64_t) : 0;
+    }
+
+    inline void add(uint64_t &inl, uint64_t *ext, size_t child) const {
+        switch (format) {
+            case SHARERS_BITMAP:
+                if (child < 64) setbit(inl, child);
+                else setbit(ext[child/64-1], child%64);
+                break;
+            case SHARERS_COARSE:
+                setbit(inl, child >> group_bits);
+                break;
+            case SHARERS_LIMITED_PTR: {
+                if (inl & SHARER_BROADCAST) break;
+                const size_t count = (inl >> SHARER_COUNT_SHIFT) & 0xff;
+                for (size_t i=0; i<count; i++) {
+                    if (((inl >> (i*SHARER_POINTER_BITS)) & ((1ULL << SHARER_POINTER_BITS)-1)) == child+1) return;
+                }
+                if (count == SHARER_POINTERS) {
+                    inl = SHARER_BROADCAST;
+                } else {
+                    inl += ((uint64_t)(child+1) << (count*SHARER_POINTER_BITS)) + (1ULL << SHARER_COUNT_SHIFT);
+                }
+                break;
+            }
+            default:
+                assert(false && "invalid sharer format");
+        }
+    }
+    inline void clear(uint64_t &inl, uint64_t *ext) const {
+        inl = 0;
+        for (size_t word=1; word<num_words && format==SHARERS_BITMAP; word++) ext[word-1] = 0;
+    }
+    inline void set_only(uint64_t &inl, uint64_t *ext, size_t child) const {
+        this->clear(inl, ext);
+        this->add(inl, ext, child);
+    }
+    // true only if child is known to be the single sharer
+    inline bool is_only(const uint64_t &inl, const uint64_t *ext, size_t child) const {
+        switch (format) {
+            case SHARERS_BITMAP: {
+                if (num_words == 1) return inl == (1ULL << child);
+                for (size_t word=0; word<num_words; word++) {
+                    const uint64_t bits = word ? ext[word-1] : inl;
+                    if (bits != ((word == child/64) ? (1ULL << (child%64)) : 0)) return false;
+                }
+                return true;
+            }
+            case SHARERS_COARSE:
+                return group_bits == 0 && inl == (1ULL << child);
+            case SHARERS_LIMITED_PTR:
+                return inl == ((uint64_t)(child+1) | (1ULL << SHARER_COUNT_SHIFT));
+            default:
+                assert(false && "invalid sharer format");
+                return false;
+        }
+    }
+    inline SharerIter iter(const uint64_t &inl, const uint64_t *ext, size_t skip=(size_t)-1) const {
+        SharerIter it;
+        it.format = format;
+        it.ext = ext;
+        it.word = 0;
+        it.num_words = num_words;
+        it.bits = inl;
+        it.group_bits = group_bits;
+        it.run_next = 0;
+        it.run_end = 0;
+        it.num_children = num_children;
+        it.skip = skip;
+        if (format == SHARERS_LIMITED_PTR) {
+            if (inl & SHARER_BROADCAST) {
+                it.run_end = num_children;
+                it.bits = 0;
+            } else {
+                it.bits = inl & ((1ULL << SHARER_COUNT_SHIFT)-1);
+            }
+        }
+        return it;
+    }
+};
+
+#endif //__SHARERS_H__
@@ -0,0 +1,281 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include "stackdist.h"
+
+// distance buckets: exact below 16, then 16 per octave, up to 2^48 lines
+const size_t SD_SUB_BITS = 4;
+const size_t SD_SUB = 1 << SD_SUB_BITS;
+const size_t SD_MAX_BITS = 48;
+const size_t SD_NUM_BUCKETS = SD_SUB * (SD_MAX_BITS - SD_SUB_BITS + 1);
+const size_t SD_MIN_TREE = 1 << 16;
+
+static inline size_t
+sd_bucket(uint64_t d)
+{
+    if (d < SD_SUB)
+        return (size_t)d;
+    if (d >= (1ULL << SD_MAX_BITS))
+        return SD_NUM_BUCKETS - 1;
+    const size_t k = log2floor(d);
+    const size_t shift = k - SD_SUB_BITS;
+    return SD_SUB * (k - SD_SUB_BITS + 1) + (size_t)(d >> shift) - SD_SUB;
+}
+
+// the smallest distance of a bucket
+static inline uint64_t
+sd_bucket_lower(size_t b)
+{
+    if (b < SD_SUB)
+        return b;
+    const size_t k = b / SD_SUB + SD_SUB_BITS - 1;
+    return (uint64_t)(SD_SUB + b % SD_SUB) << (k - SD_SUB_BITS);
+}
+
+// a representative distance of a bucket
+static inline double
+sd_bucket_mid(size_t b)
+{
+    return (sd_bucket_lower(b) + sd_bucket_lower(b + 1) - 1) / 2.0;
+}
+
+static inline uint64_t
+sd_hash(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+StackDistance :: StackDistance(const size_t line_bytes, const double sample_rate) :
+    _line_bits(log2power2(line_bytes)),
+    _scale(1.0 / sample_rate),
+    _sample_threshold((uint32_t)(sample_rate * (1 << 24))),
+    _accesses(0),
+    _cold(0),
+    _tree(SD_MIN_TREE + 1, 0),
+    _now(0),
+    _distances(SD_NUM_BUCKETS, 0),
+    _dirty_pairs(SD_NUM_BUCKETS * SD_NUM_BUCKETS, 0)
+{
+    assert(is_power_of_2(line_bytes));
+    assert(sample_rate > 0 && sample_rate <= 1);
+}
+
+inline bool
+StackDistance :: sampled(const Addr line) const
+{
+    return _scale == 1.0 || (sd_hash(line) & ((1 << 24) - 1)) < _sample_threshold;
+}
+
+inline uint64_t
+StackDistance :: depth(const uint64_t t) const
+{
+    // the marks after t: all lines but those last referenced up to t
+    uint64_t up_to_t = 0;
+    for (size_t i=t+1; i>0; i&=i-1) {
+        up_to_t += _tree[i];
+    }
+    const uint64_t d = _lines.size() - up_to_t;
+    return (_scale == 1.0) ? d : (uint64_t)(d * _scale + 0.5);
+}
+
+// the tree is full: number the lines again from 0, in the order of their last references
+void
+StackDistance :: compact()
+{
+    std::vector<std::pair<uint64_t, LineRecord *> > order;
+    order.reserve(_lines.size());
+    for (std::tr1::unordered_map<Addr, LineRecord>::iterator it=_lines.begin(); it!=_lines.end(); it++) {
+        order.push_back(std::make_pair(it->second.last, &it->second));
+    }
+    std::sort(order.begin(), order.end());
+    size_t size = SD_MIN_TREE;
+    while (size < 2 * order.size())
+        size *= 2;
+    _tree.assign(size + 1, 0);
+    for (size_t i=0; i<order.size(); i++) {
+        order[i].second->last = i;
+        _tree[i + 1] = 1;
+    }
+    // linear construction: every node passes its sum on to its parent
+    for (size_t i=1; i<=size; i++) {
+        const size_t parent = i + (i & -i);
+        if (parent <= size)
+            _tree[parent] += _tree[i];
+    }
+    _now = order.size();
+}
+
+void
+StackDistance :: access(const Addr addr, const bool is_write)
+{
+    const Addr line = addr >> _line_bits;
+    if (!this->sampled(line))
+        return;
+    _accesses++;
+    if (_now + 1 >= _tree.size())
+        this->compact();
+    std::pair<std::tr1::unordered_map<Addr, LineRecord>::iterator, bool> found =
+        _lines.insert(std::make_pair(line, LineRecord()));
+    LineRecord &record = found.first->second;
+    if (found.second) {
+        _cold++;
+        record.dirty_depth = is_write ? 0 : NOT_DIRTY;
+    } else {
+        const uint64_t d = this->depth(record.last);
+        _distances[sd_bucket(d)]++;
+        // evicted dirty from the caches of (dirty depth, d] lines
+        if (record.dirty_depth != NOT_DIRTY && d > record.dirty_depth) {
+            _dirty_pairs[sd_bucket(record.dirty_depth) * SD_NUM_BUCKETS + sd_bucket(d)]++;
+        }
+        if (is_write)
+            record.dirty_depth = 0;
+        else if (record.dirty_depth != NOT_DIRTY)
+            record.dirty_depth = MAX2(record.dirty_depth, d);
+        for (size_t i=record.last+1; i<_tree.size(); i+=i&-i) {
+            _tree[i]--;
+        }
+    }
+    record.last = _now;
+    for (size_t i=_now+1; i<_tree.size(); i+=i&-i) {
+        _tree[i]++;
+    }
+    _now++;
+}
+
+void
+StackDistance :: writeback(const Addr addr)
+{
+    const Addr line = addr >> _line_bits;
+    if (!this->sampled(line))
+        return;
+    std::tr1::unordered_map<Addr, LineRecord>::iterator it = _lines.find(line);
+    if (it == _lines.end())
+        return;     // never requested here, so in no cache of this level
+    // dirty in the caches that still hold the line
+    it->second.dirty_depth = MIN2(it->second.dirty_depth, this->depth(it->second.last));
+}
+
+// P(at least associativity of d lines map to one of sets sets)
+static double
+sd_miss_probability(const double d, const size_t sets, const size_t associativity)
+{
+    if (d < associativity)
+        return 0;
+    if (sets == 1)
+        return 1;
+    const double p = 1.0 / sets;
+    // the binomial terms below associativity
+    double term = exp(d * log1p(-p));
+    double below = term;
+    for (size_t i=1; i<associativity; i++) {
+        term *= (d - (i - 1)) / i * p / (1 - p);
+        below += term;
+    }
+    return MAX2(0.0, MIN2(1.0, 1 - below));
+}
+
+void
+StackDistance :: curve(const size_t associativity, std::vector<Point> &points) const
+{
+    points.clear();
+    size_t last_bucket = 0;
+    for (size_t b=0; b<SD_NUM_BUCKETS; b++) {
+        if (_distances[b])
+            last_bucket = b;
+    }
+    // the lines not referenced again: evicted from the caches of (dirty depth, depth now]
+    std::vector<uint64_t> dirty_pairs(_dirty_pairs);
+    for (std::tr1::unordered_map<Addr, LineRecord>::const_iterator it=_lines.begin(); it!=_lines.end(); it++) {
+        const uint64_t d = this->depth(it->second.last);
+        if (it->second.dirty_depth != NOT_DIRTY && d > it->second.dirty_depth) {
+            dirty_pairs[sd_bucket(it->second.dirty_depth) * SD_NUM_BUCKETS + sd_bucket(d)]++;
+            last_bucket = MAX2(last_bucket, sd_bucket(d));
+        }
+    }
+    if (associativity == 0) {
+        // exact: every pair (dirty depth, distance) counts for the capacities in between
+        std::vector<double> dirty_diff(SD_NUM_BUCKETS + 1, 0);
+        for (size_t bdd=0; bdd<SD_NUM_BUCKETS; bdd++) {
+            for (size_t bd=bdd; bd<SD_NUM_BUCKETS; bd++) {
+                const uint64_t count = dirty_pairs[bdd * SD_NUM_BUCKETS + bd];
+                if (count) {
+                    dirty_diff[bdd + 1] += count;
+                    dirty_diff[bd + 1] -= count;
+                }
+            }
+        }
+        double misses = _accesses - _cold;
+        double dirty = 0;
+        for (size_t b=1; b<=last_bucket + 1 && b<SD_NUM_BUCKETS; b++) {
+            misses -= _distances[b - 1];
+            dirty += dirty_diff[b];
+            Point point;
+            point.lines = sd_bucket_lower(b);
+            point.misses = (misses + _cold) * _scale;
+            point.dirty_evictions = dirty * _scale;
+            points.push_back(point);
+        }
+        return;
+    }
+    assert(is_power_of_2(associativity));
+    std::vector<size_t> dirty_index;    // the non-empty pairs
+    for (size_t i=0; i<dirty_pairs.size(); i++) {
+        if (dirty_pairs[i])
+            dirty_index.push_back(i);
+    }
+    std::vector<double> p_miss(SD_NUM_BUCKETS);
+    for (size_t sets=1; sets * associativity <= 2 * sd_bucket_lower(last_bucket + 1); sets *= 2) {
+        for (size_t b=0; b<=last_bucket; b++) {
+            p_miss[b] = sd_miss_probability(sd_bucket_mid(b), sets, associativity);
+        }
+        for (size_t b=last_bucket+1; b<SD_NUM_BUCKETS; b++) {
+            p_miss[b] = 1;
+        }
+        Point point;
+        point.lines = sets * associativity;
+        point.misses = _cold;
+        for (size_t b=0; b<=last_bucket; b++) {
+            point.misses += _distances[b] * p_miss[b];
+        }
+        point.dirty_evictions = 0;
+        for (size_t i=0; i<dirty_index.size(); i++) {
+            const size_t bdd = dirty_index[i] / SD_NUM_BUCKETS;
+            const size_t bd = dirty_index[i] % SD_NUM_BUCKETS;
+            point.dirty_evictions += dirty_pairs[dirty_index[i]] * p_miss[bd] * (1 - p_miss[bdd]);
+        }
+        point.misses *= _scale;
+        point.dirty_evictions *= _scale;
+        points.push_back(point);
+    }
+}
+
+void
+StackDistance :: dump(std::ostream &os, const char *name, const size_t associativity) const
+{
+    std::vector<Point> points;
+    this->curve(associativity, points);
+    char buf[256];
+    snprintf(buf, sizeof(buf), "# %s: LRU stack distance profile, %s, %.0f accesses, %.0f cold misses, sample rate %g\n",
+             name, associativity ? "set-associative" : "fully associative", this->accesses(), this->cold_misses(), 1 / _scale);
+    os << buf;
+    if (associativity) {
+        snprintf(buf, sizeof(buf), "# %lu ways\n", associativity);
+        os << buf;
+    }
+    os << "# capacity_bytes lines miss_ratio misses dirty_evictions\n";
+    const double accesses = MAX2(this->accesses(), 1.0);
+    for (size_t i=0; i<points.size(); i++) {
+        snprintf(buf, sizeof(buf), "%lu %lu %.6f %.0f %.0f\n", points[i].lines << _line_bits, points[i].lines,
+                 points[i].misses / accesses, points[i].misses, points[i].dirty_evictions);
+        os << buf;
+    }
+}
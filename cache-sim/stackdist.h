@@ -0,0 +1,83 @@
+#ifndef __STACKDIST_H__
+#define __STACKDIST_H__
+
+#include <ostream>
+#include <vector>
+#include <tr1/unordered_map>
+#include "globals.h"
+
+// LRU stack distance (Mattson) profile of the request stream of one cache level, for the
+// miss ratio and dirty eviction curves of LRU caches of every capacity in one pass.
+// The distance of a reference is the number of distinct other lines referenced since the
+// last reference to its line: a fully associative LRU cache of c lines hits iff it is < c.
+// Distances are counted with a Fenwick tree over the reference times, in which the last
+// reference of every line is marked, so a reference costs O(log n) for n distinct lines.
+//
+// Writebacks of the children into the level make a line dirty without a reference (they do
+// not move it in LRU order here either). A line is dirty in a cache of c lines iff it was
+// written, and no reference since has evicted it there (had a distance >= c): so the dirty
+// capacities of a line are those above its "dirty depth", and the evictions of a dirty line
+// are counted per (dirty depth, distance) pair of its references.
+//
+// The curves of set-associative caches are derived from these, assuming that the lines
+// spread evenly over the sets (Smith's model): of the d distinct lines referenced since the
+// last reference to a line, Binomial(d, 1/sets) map to its set, and it is a miss if at least
+// associativity of them do.
+//
+// With a sample rate below 1, only the lines whose address hash falls below the rate are
+// profiled (SHARDS spatial sampling); their distances and all counts are scaled by 1/rate.
+// Distances are kept in buckets of 1/16 octave, so the curve is exact at the capacities of
+// the bucket bounds (every capacity up to 16 lines, 16 per octave above).
+class StackDistance
+{
+public:
+    struct Point
+    {
+        size_t lines;               // capacity
+        double misses;              // of the whole stream, scaled by 1/sample rate
+        double dirty_evictions;
+    };
+
+    StackDistance(const size_t line_bytes, const double sample_rate=1.0);
+
+    // a request for the line of addr (a write if it asks for the line as modified)
+    void access(const Addr addr, const bool is_write);
+    // a child wrote modified data of the line of addr back
+    void writeback(const Addr addr);
+
+    // misses and dirty evictions per capacity, for associativity 0 (fully associative: every
+    // bucket bound) or the given associativity (power of 2 numbers of sets)
+    void curve(const size_t associativity, std::vector<Point> &points) const;
+    // the curve as text, capacities in bytes
+    void dump(std::ostream &os, const char *name, const size_t associativity) const;
+
+    // scaled by 1/sample rate
+    inline double accesses() const { return _accesses * _scale; }
+    inline double cold_misses() const { return _cold * _scale; }
+
+    size_t _line_bits;
+    double _scale;                  // 1/sample rate
+    uint32_t _sample_threshold;     // of the 24 bit address hash
+    size_t _accesses;               // sampled ones
+    size_t _cold;
+private:
+    struct LineRecord
+    {
+        uint64_t last;              // time of the last reference
+        uint64_t dirty_depth;       // dirty in caches of more lines; NOT_DIRTY if clean
+    };
+    static const uint64_t NOT_DIRTY = ~0ULL;
+
+    inline bool sampled(const Addr line) const;
+    // distinct lines referenced after time t, scaled
+    inline uint64_t depth(const uint64_t t) const;
+    void compact();
+
+    std::tr1::unordered_map<Addr, LineRecord> _lines;
+    std::vector<uint32_t> _tree;    // Fenwick tree over the times, 1-based
+    uint64_t _now;
+    std::vector<uint64_t> _distances;       // per bucket
+    std::vector<uint64_t> _dirty_pairs;     // per (dirty depth bucket, distance bucket)
+};
+
+#endif //__STACKDIST_H__
@@ -0,0 +1,158 @@
+#include <string.h>
+#include "tagmatch.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// target("avx2")/target("avx512f") with intrinsics needs gcc 4.9 (or clang)
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define TAG_MATCH_HAS_AVX 1
+#endif
+
+int
+tag_match_scalar(const Addr *tags, size_t num_tags, const Addr addr)
+{
+    for (size_t way=0; way<num_tags; way++) {
+        if (tags[way] == addr)
+            return (int)way;
+    }
+    return -1;
+}
+
+#if defined(__SSE2__)
+static int
+tag_match_sse2_wide(const Addr *tags, size_t num_tags, const Addr addr)
+{
+    return tag_match_sse2(tags, num_tags, addr);
+}
+#endif
+
+#ifdef TAG_MATCH_HAS_AVX
+__attribute__((target("avx2"))) static int
+tag_match_avx2(const Addr *tags, size_t num_tags, const Addr addr)
+{
+    const __m256i key = _mm256_set1_epi64x((long long)addr);
+    for (size_t base=0; base<num_tags; base+=TAG_MATCH_STEP) {
+        __m256i eq0 = _mm256_cmpeq_epi64(_mm256_load_si256((const __m256i *)(tags+base)), key);
+        __m256i eq1 = _mm256_cmpeq_epi64(_mm256_load_si256((const __m256i *)(tags+base+4)), key);
+        unsigned mask = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(eq0))
+            | ((unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(eq1)) << 4);
+        if (mask) return (int)(base + __builtin_ctz(mask));
+    }
+    return -1;
+}
+
+__attribute__((target("avx512f"))) static int
+tag_match_avx512(const Addr *tags, size_t num_tags, const Addr addr)
+{
+    const __m512i key = _mm512_set1_epi64((long long)addr);
+    for (size_t base=0; base<num_tags; base+=TAG_MATCH_STEP) {
+        unsigned mask = _mm512_cmpeq_epi64_mask(_mm512_load_si512((const void *)(tags+base)), key);
+        if (mask) return (int)(base + __builtin_ctz(mask));
+    }
+    return -1;
+}
+
+// the OS has to save the wide registers on a context switch
+static uint64_t
+xgetbv0()
+{
+    uint32_t eax, edx;
+    __asm__ __volatile__ (".byte 0x0f, 0x01, 0xd0" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+}
+
+static bool
+cpu_has_avx2()
+{
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    if (!(ecx & bit_OSXSAVE)) return false;
+    if ((xgetbv0() & 0x6) != 0x6) return false; // XMM and YMM state
+    if (__get_cpuid_max(0, NULL) < 7) return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 5)) != 0;
+}
+
+static bool
+cpu_has_avx512f()
+{
+    unsigned eax, ebx, ecx, edx;
+    if (!cpu_has_avx2()) return false;
+    if ((xgetbv0() & 0xe6) != 0xe6) return false; // also opmask and ZMM state
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 16)) != 0;
+}
+#endif
+
+struct tag_match_impl {
+    const char *name;
+    tag_match_fn fn;
+    bool (*supported)();
+};
+
+static bool always_supported() { return true; }
+
+// ordered from the widest to the narrowest
+static const tag_match_impl tag_match_impls[] = {
+#ifdef TAG_MATCH_HAS_AVX
+    { "avx512", tag_match_avx512, cpu_has_avx512f },
+    { "avx2", tag_match_avx2, cpu_has_avx2 },
+#endif
+#if defined(__SSE2__)
+    { "sse2", tag_match_sse2_wide, always_supported },
+#endif
+    { "scalar", tag_match_scalar, always_supported },
+};
+static const size_t tag_match_num_impls = sizeof(tag_match_impls)/sizeof(tag_match_impls[0]);
+static const char *tag_match_selected = NULL;
+
+static void
+tag_match_detect()
+{
+    for (size_t i=0; i<tag_match_num_impls; i++) {
+        if (tag_match_impls[i].supported()) {
+            tag_match_wide = tag_match_impls[i].fn;
+            tag_match_selected = tag_match_impls[i].name;
+            return;
+        }
+    }
+}
+
+// a lookup from a static constructor of another file, before the one below, picks the kernel
+static int
+tag_match_first_call(const Addr *tags, size_t num_tags, const Addr addr)
+{
+    tag_match_detect();
+    return tag_match_wide(tags, num_tags, addr);
+}
+
+tag_match_fn tag_match_wide = tag_match_first_call;
+
+// The kernel is picked during static initialization, which runs on one thread, so the
+// simulator threads only ever read tag_match_wide (but for tag_match_select at startup).
+static struct tag_match_init {
+    tag_match_init() { if (tag_match_selected == NULL) tag_match_detect(); }
+} tag_match_init_once;
+
+const char *
+tag_match_impl_name()
+{
+    if (tag_match_selected == NULL) tag_match_detect();
+    return tag_match_selected;
+}
+
+bool
+tag_match_select(const char *impl_name)
+{
+    for (size_t i=0; i<tag_match_num_impls; i++) {
+        if (strcmp(tag_match_impls[i].name, impl_name) == 0 && tag_match_impls[i].supported()) {
+            tag_match_wide = tag_match_impls[i].fn;
+            tag_match_selected = tag_match_impls[i].name;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,73 @@
+#ifndef __TAGMATCH_H__
+#define __TAGMATCH_H__
+
+#include <stddef.h>
+#include "globals.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Number of tags compared in one step by every tag match kernel.
+// The tag array of a set is padded to a multiple of this (with LINE_ADDR_PAD).
+#define TAG_MATCH_STEP 8
+
+// Tag of a padding slot; it is not aligned to any line size, so it matches no lookup
+const Addr LINE_ADDR_PAD = (Addr)-2;
+
+// Returns the index of the first tag equal to addr, or -1.
+// num_tags must be a multiple of TAG_MATCH_STEP.
+typedef int (*tag_match_fn)(const Addr *tags, size_t num_tags, const Addr addr);
+
+// Sets of up to this many steps are compared inline with SSE2 (see tag_match)
+#define TAG_MATCH_INLINE_STEPS 4
+
+// The widest kernel supported by this CPU, selected once at startup (before any thread)
+extern tag_match_fn tag_match_wide;
+const char *tag_match_impl_name();
+// Use a specific kernel ("scalar", "sse2", "avx2", "avx512"); returns false if not supported
+bool tag_match_select(const char *impl_name);
+
+int tag_match_scalar(const Addr *tags, size_t num_tags, const Addr addr);
+
+#if defined(__SSE2__)
+// compare 8 tags at once; 64-bit equality is built from two 32-bit compares
+static inline unsigned
+tag_match_sse2_mask8(const Addr *tags, const __m128i key)
+{
+    unsigned mask = 0;
+    for (int i=0; i<TAG_MATCH_STEP/2; i++) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *)(tags+2*i)), key);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        mask |= (unsigned)_mm_movemask_pd(_mm_castsi128_pd(eq)) << (2*i);
+    }
+    return mask;
+}
+
+static inline int
+tag_match_sse2(const Addr *tags, size_t num_tags, const Addr addr)
+{
+    const __m128i key = _mm_set1_epi64x((long long)addr);
+    for (size_t base=0; base<num_tags; base+=TAG_MATCH_STEP) {
+        unsigned mask = tag_match_sse2_mask8(tags+base, key);
+        if (mask) return (int)(base + __builtin_ctz(mask));
+    }
+    return -1;
+}
+#endif
+
+// Tag lookup used by the cache sets.
+// Sets of up to 32 tags (a set has a spare slot, so up to 31 ways) are compared inline with
+// SSE2, which every x86-64 CPU has; the loop unrolls where the set size is a constant
+// (StaticCache). Wider sets go to the widest kernel this CPU supports (AVX2/AVX-512).
+static inline int
+tag_match(const Addr *tags, size_t num_tags, const Addr addr)
+{
+#if defined(__SSE2__)
+    if (num_tags <= TAG_MATCH_INLINE_STEPS*TAG_MATCH_STEP) {
+        return tag_match_sse2(tags, num_tags, addr);
+    }
+#endif
+    return tag_match_wide(tags, num_tags, addr);
+}
+
+#endif //__TAGMATCH_H__
@@ -0,0 +1,369 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+static inline uint8_t *
+varint_put(uint8_t *out, uint64_t value)
+{
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+static inline bool
+varint_get(const uint8_t *&in, const uint8_t *end, uint64_t &value)
+{
+    value = 0;
+    for (size_t shift=0; shift<64; shift+=7) {
+        if (in == end)
+            return false;
+        const uint8_t byte = *in++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static inline uint64_t zigzag(int64_t value) { return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63); }
+static inline int64_t unzigzag(uint64_t value) { return (int64_t)(value >> 1) ^ -(int64_t)(value & 1); }
+
+static inline uint8_t
+size_code(const uint32_t size)
+{
+    if (size == 0 || size > 64 || (size & (size-1)))
+        return 0;
+    return (uint8_t)(log2power2(size) + 1);
+}
+
+size_t
+trace_encode(const TraceRef *refs, const size_t n, uint8_t *out)
+{
+    uint8_t *pos = out;
+    Addr prev_addr = 0;
+    Addr prev_pc = 0;
+    for (size_t i=0; i<n; i++) {
+        const TraceRef &ref = refs[i];
+        const uint8_t code = size_code(ref.size);
+        uint8_t flags = code;
+        if (ref.line_state != LINE_SHR)
+            flags |= TRACE_WRITE;
+        if (ref.pc == prev_pc)
+            flags |= TRACE_SAME_PC;
+        *pos++ = flags;
+        pos = varint_put(pos, zigzag((int64_t)(ref.addr - prev_addr)));
+        if (!(flags & TRACE_SAME_PC))
+            pos = varint_put(pos, zigzag((int64_t)(ref.pc - prev_pc)));
+        if (code == 0)
+            pos = varint_put(pos, ref.size);
+        prev_addr = ref.addr;
+        prev_pc = ref.pc;
+    }
+    return pos - out;
+}
+
+static inline void set_size_pc(TraceRef &ref, const uint32_t size, const Addr pc) { ref.size = size; ref.pc = pc; }
+static inline void set_size_pc(Access &ref, const uint32_t size, const Addr pc) { ref.reserved = 0; }
+
+template <class Ref>
+static inline bool
+decode_refs(const uint8_t *in, const size_t bytes, const size_t n, Ref *refs)
+{
+    const uint8_t *end = in + bytes;
+    Addr prev_addr = 0;
+    Addr prev_pc = 0;
+    uint64_t value;
+    uint32_t size;
+    for (size_t i=0; i<n; i++) {
+        if (in == end)
+            return false;
+        const uint8_t flags = *in++;
+        Ref &ref = refs[i];
+        if (!varint_get(in, end, value))
+            return false;
+        ref.addr = prev_addr + (Addr)unzigzag(value);
+        if (!(flags & TRACE_SAME_PC)) {
+            if (!varint_get(in, end, value))
+                return false;
+            prev_pc += (Addr)unzigzag(value);
+        }
+        const uint8_t code = flags & TRACE_SIZE_MASK;
+        if (code == 0) {
+            if (!varint_get(in, end, value))
+                return false;
+            size = (uint32_t)value;
+        } else {
+            size = 1U << (code-1);
+        }
+        ref.line_state = (flags & TRACE_WRITE) ? LINE_MOD : LINE_SHR;
+        set_size_pc(ref, size, prev_pc);
+        prev_addr = ref.addr;
+    }
+    return in == end;
+}
+
+bool
+trace_decode(const uint8_t *in, const size_t bytes, const size_t n, TraceRef *refs)
+{
+    return decode_refs(in, bytes, n, refs);
+}
+
+bool
+trace_decode(const uint8_t *in, const size_t bytes, const size_t n, Access *refs)
+{
+    return decode_refs(in, bytes, n, refs);
+}
+
+// block compression; a sequence is
+//   token (literal length << 4 | match length-4), extra literal length bytes (if 15),
+//   literals, match offset (16 bits), extra match length bytes (if 15)
+// and the last sequence has only literals
+const size_t LZ_HASH_BITS = 12;
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_MAX_OFFSET = 65535;
+// the last bytes are always literals, so that a match never reads past the input
+const size_t LZ_LAST_LITERALS = 5;
+
+static inline uint32_t read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+
+static inline bool
+lz_put_length(uint8_t *&op, const uint8_t *oend, size_t length)
+{
+    for (; length >= 255; length -= 255) {
+        if (op == oend) return false;
+        *op++ = 255;
+    }
+    if (op == oend) return false;
+    *op++ = (uint8_t)length;
+    return true;
+}
+
+static inline bool
+lz_put_sequence(uint8_t *&op, const uint8_t *oend, const uint8_t *literals, size_t num_literals,
+                size_t offset, size_t match_length)
+{
+    if (op == oend) return false;
+    uint8_t *token = op++;
+    *token = (uint8_t)(MIN2(num_literals, (size_t)15) << 4);
+    if (num_literals >= 15 && !lz_put_length(op, oend, num_literals - 15)) return false;
+    if ((size_t)(oend - op) < num_literals) return false;
+    memcpy(op, literals, num_literals);
+    op += num_literals;
+    if (match_length == 0)
+        return true;    // the last sequence
+    if (oend - op < 2) return false;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match_length -= LZ_MIN_MATCH;
+    *token |= (uint8_t)MIN2(match_length, (size_t)15);
+    if (match_length >= 15 && !lz_put_length(op, oend, match_length - 15)) return false;
+    return true;
+}
+
+size_t
+block_compress(const uint8_t *in, const size_t n, uint8_t *out, const size_t out_capacity)
+{
+    // positions+1 of the last occurrence of a 4-byte hash; 0 for none
+    std::vector<uint32_t> table(1UL << LZ_HASH_BITS, 0);
+    uint8_t *op = out;
+    const uint8_t *oend = out + out_capacity;
+    size_t anchor = 0;
+    size_t ip = 0;
+    const size_t match_limit = (n > LZ_LAST_LITERALS + LZ_MIN_MATCH) ? n - LZ_LAST_LITERALS : 0;
+    while (ip + LZ_MIN_MATCH <= match_limit) {
+        const uint32_t seq = read32(in + ip);
+        const uint32_t hash = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+        const size_t ref = table[hash];
+        table[hash] = (uint32_t)(ip + 1);
+        if (ref == 0 || ip - (ref-1) > LZ_MAX_OFFSET || read32(in + ref-1) != seq) {
+            ip++;
+            continue;
+        }
+        size_t length = LZ_MIN_MATCH;
+        while (ip + length < match_limit && in[ref-1 + length] == in[ip + length])
+            length++;
+        if (!lz_put_sequence(op, oend, in + anchor, ip - anchor, ip - (ref-1), length))
+            return 0;
+        ip += length;
+        anchor = ip;
+    }
+    if (!lz_put_sequence(op, oend, in + anchor, n - anchor, 0, 0))
+        return 0;
+    return op - out;
+}
+
+static inline bool
+lz_get_length(const uint8_t *&ip, const uint8_t *iend, size_t &length)
+{
+    uint8_t byte;
+    do {
+        if (ip == iend) return false;
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool
+block_decompress(const uint8_t *in, const size_t n, uint8_t *out, const size_t out_size)
+{
+    const uint8_t *ip = in;
+    const uint8_t *iend = in + n;
+    uint8_t *op = out;
+    uint8_t *oend = out + out_size;
+    while (ip < iend) {
+        const uint8_t token = *ip++;
+        size_t num_literals = token >> 4;
+        if (num_literals == 15 && !lz_get_length(ip, iend, num_literals))
+            return false;
+        if ((size_t)(iend - ip) < num_literals || (size_t)(oend - op) < num_literals)
+            return false;
+        memcpy(op, ip, num_literals);
+        ip += num_literals;
+        op += num_literals;
+        if (ip == iend)
+            break;  // the last sequence
+        if (iend - ip < 2)
+            return false;
+        const size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t length = token & 15;
+        if (length == 15 && !lz_get_length(ip, iend, length))
+            return false;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out) || (size_t)(oend - op) < length)
+            return false;
+        // byte by byte: a match may overlap its own output
+        const uint8_t *match = op - offset;
+        for (size_t i=0; i<length; i++)
+            *op++ = *match++;
+    }
+    return op == oend;
+}
+
+void
+TraceChunkBuilder :: build(const uint32_t tid, const uint64_t timestamp, const uint64_t instructions,
+                           const TraceRef *refs, const size_t n)
+{
+    _encoded.resize(MAX2(n * TRACE_MAX_ENCODED_REF, (size_t)1));
+    const size_t raw_bytes = trace_encode(refs, n, &_encoded[0]);
+    _chunk.resize(sizeof(TraceChunkHeader) + MAX2(raw_bytes, (size_t)1));
+    TraceChunkHeader header;
+    header.magic = TRACE_CHUNK_MAGIC;
+    header.tid = tid;
+    header.timestamp = timestamp;
+    header.instructions = instructions;
+    header.num_refs = n;
+    header.raw_bytes = (uint32_t)raw_bytes;
+    // stored as is if compression does not save anything
+    header.stored_bytes = (uint32_t)block_compress(&_encoded[0], raw_bytes, &_chunk[sizeof(header)], raw_bytes ? raw_bytes-1 : 0);
+    if (header.stored_bytes == 0) {
+        header.stored_bytes = header.raw_bytes;
+        memcpy(&_chunk[sizeof(header)], &_encoded[0], raw_bytes);
+    }
+    memcpy(&_chunk[0], &header, sizeof(header));
+    _chunk.resize(sizeof(header) + header.stored_bytes);
+}
+
+bool
+trace_write_header(FILE *f)
+{
+    TraceFileHeader header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.reserved = 0;
+    return fwrite(&header, sizeof(header), 1, f) == 1;
+}
+
+bool
+TraceReader :: open(const char *path)
+{
+    this->close();
+    _path = path;
+    const int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "CACHE WARNING: cannot open trace %s\n", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TraceFileHeader)) {
+        fprintf(stderr, "CACHE WARNING: %s is not a trace\n", path);
+        ::close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "CACHE WARNING: cannot map trace %s\n", path);
+        return false;
+    }
+    _data = (const uint8_t *)data;
+    _size = st.st_size;
+    // the chunks are mostly read once, front to back
+    madvise(data, _size, MADV_SEQUENTIAL);
+
+    TraceFileHeader header;
+    memcpy(&header, _data, sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_VERSION) {
+        fprintf(stderr, "CACHE WARNING: %s is not a trace of version %u\n", path, TRACE_VERSION);
+        this->close();
+        return false;
+    }
+    size_t offset = sizeof(header);
+    while (offset < _size) {
+        TraceChunkHeader chunk;
+        if (_size - offset < sizeof(chunk)) {
+            break;
+        }
+        memcpy(&chunk, _data + offset, sizeof(chunk));
+        offset += sizeof(chunk);
+        // a corrupt header must not size the decode buffers (num_refs of them)
+        if (chunk.magic != TRACE_CHUNK_MAGIC || _size - offset < chunk.stored_bytes || chunk.stored_bytes > chunk.raw_bytes ||
+            chunk.num_refs > chunk.raw_bytes / TRACE_MIN_ENCODED_REF) {
+            offset -= sizeof(chunk);
+            break;
+        }
+        TraceChunkInfo info;
+        info.offset = offset;
+        info.tid = chunk.tid;
+        info.timestamp = chunk.timestamp;
+        info.instructions = chunk.instructions;
+        info.num_refs = chunk.num_refs;
+        info.raw_bytes = chunk.raw_bytes;
+        info.stored_bytes = chunk.stored_bytes;
+        _chunks.push_back(info);
+        _num_refs += info.num_refs;
+        _max_chunk_refs = MAX2(_max_chunk_refs, info.num_refs);
+        _max_chunk_raw_bytes = MAX2(_max_chunk_raw_bytes, info.raw_bytes);
+        offset += chunk.stored_bytes;
+    }
+    if (offset != _size) {
+        // a tracer that did not finish leaves a truncated chunk at the end
+        fprintf(stderr, "CACHE WARNING: %s: ignoring %lu bytes after chunk %lu\n", path, _size - offset, _chunks.size());
+    }
+    return true;
+}
+
+void
+TraceReader :: close()
+{
+    if (_data != NULL) {
+        munmap((void *)_data, _size);
+    }
+    _data = NULL;
+    _size = 0;
+    _chunks.clear();
+    _num_refs = 0;
+    _max_chunk_refs = 0;
+    _max_chunk_raw_bytes = 0;
+}
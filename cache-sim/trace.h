@@ -0,0 +1,155 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "globals.h"
+#include "cache.h"
+
+// Binary memory trace files.
+// A file is a TraceFileHeader followed by chunks. A chunk holds the references of one
+// thread (one full trace buffer of the tracer): a TraceChunkHeader and the encoded
+// references, block-compressed when that makes them smaller. Chunks are independent (the
+// delta state starts over in every chunk), so they can be decoded in any order and in
+// parallel; the chunks of one thread are in program order.
+//
+// Encoding of one reference, against the previous reference of the chunk:
+//   flags byte: TRACE_WRITE, TRACE_SAME_PC, the size code (TRACE_SIZE_MASK: 0 for an
+//               explicit size, else log2(size)+1 for sizes of 1 to 64 bytes)
+//   address delta, zigzag varint
+//   PC delta, zigzag varint (not if TRACE_SAME_PC)
+//   size, varint (only for size code 0)
+
+const char TRACE_MAGIC[8] = { 'N', 'V', 'T', 'R', 'A', 'C', 'E', '1' };
+const uint32_t TRACE_VERSION = 1;
+const uint32_t TRACE_CHUNK_MAGIC = 0x4b4e4843;    // "CHNK"
+
+const uint8_t TRACE_WRITE = 0x80;
+const uint8_t TRACE_SAME_PC = 0x40;
+const uint8_t TRACE_SIZE_MASK = 0x0f;
+// worst case: flags, two 10-byte varints and a 5-byte one
+const size_t TRACE_MAX_ENCODED_REF = 26;
+// best case: flags and a 1-byte varint
+const size_t TRACE_MIN_ENCODED_REF = 2;
+
+// One reference, as filled in by the tracer. addr and line_state are laid out as in Access.
+// Access is what the caches need of a reference (see Cache::access_batch).
+struct TraceRef
+{
+    Addr addr;
+    uint32_t line_state;    // LINE_SHR for a load, LINE_MOD for a store
+    uint32_t size;
+    Addr pc;
+};
+
+struct TraceFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct TraceChunkHeader
+{
+    uint32_t magic;
+    uint32_t tid;
+    uint64_t timestamp;     // wall clock of the tracer (ns since the epoch) when the chunk was full
+    uint64_t instructions;  // instructions of the thread up to the end of the chunk
+    uint64_t num_refs;
+    uint32_t raw_bytes;     // encoded references
+    uint32_t stored_bytes;  // in the file; equal to raw_bytes if not compressed
+};
+
+// encode n references; out needs n*TRACE_MAX_ENCODED_REF bytes. Returns the bytes written.
+size_t trace_encode(const TraceRef *refs, const size_t n, uint8_t *out);
+// decode n references of bytes encoded bytes; false if the data is corrupt
+bool trace_decode(const uint8_t *in, const size_t bytes, const size_t n, TraceRef *refs);
+// the same, but only the part of the references that the caches need
+bool trace_decode(const uint8_t *in, const size_t bytes, const size_t n, Access *refs);
+
+// LZ77 block compression (an LZ4-like format: literal runs and matches of at least 4 bytes
+// within the last 64 KB). Returns the compressed size, or 0 if the block does not fit in
+// out_capacity (is not compressible enough).
+size_t block_compress(const uint8_t *in, const size_t n, uint8_t *out, const size_t out_capacity);
+// false if the data is corrupt or does not decompress to exactly out_size bytes
+bool block_decompress(const uint8_t *in, const size_t n, uint8_t *out, const size_t out_size);
+
+// Builds the chunk of a trace buffer in memory (encoding and compression are the expensive
+// part; the caller serializes only the write of the finished chunk to the file).
+struct TraceChunkBuilder
+{
+    std::vector<uint8_t> _encoded;
+    std::vector<uint8_t> _chunk;    // header and stored bytes
+
+    void build(const uint32_t tid, const uint64_t timestamp, const uint64_t instructions,
+               const TraceRef *refs, const size_t n);
+    inline const uint8_t *data() const { return &_chunk[0]; }
+    inline size_t size() const { return _chunk.size(); }
+    inline bool write(FILE *f) const { return fwrite(&_chunk[0], 1, _chunk.size(), f) == _chunk.size(); }
+};
+
+bool trace_write_header(FILE *f);
+
+// A chunk of a trace file, as found by TraceReader
+struct TraceChunkInfo
+{
+    size_t offset;          // of the stored bytes in the file
+    uint32_t tid;
+    uint64_t timestamp;
+    uint64_t instructions;
+    size_t num_refs;
+    size_t raw_bytes;
+    size_t stored_bytes;
+    inline bool compressed() const { return stored_bytes != raw_bytes; }
+};
+
+// Read-only access to a trace file, mapped into memory. open() indexes the chunks (only their
+// headers are read), after which any chunk can be decoded on its own; decode() only reads
+// the mapped file and the buffers of the caller, so several threads can decode at once.
+class TraceReader
+{
+public:
+    TraceReader() : _data(NULL), _size(0), _num_refs(0), _max_chunk_refs(0), _max_chunk_raw_bytes(0) {}
+    ~TraceReader() { this->close(); }
+
+    // false (with a warning) if the file cannot be mapped or is not a valid trace
+    bool open(const char *path);
+    void close();
+
+    inline size_t num_chunks() const { return _chunks.size(); }
+    inline const TraceChunkInfo &chunk(const size_t i) const { return _chunks[i]; }
+    inline size_t num_refs() const { return _num_refs; }
+    // the largest chunk, to size decode buffers
+    inline size_t max_chunk_refs() const { return _max_chunk_refs; }
+    inline size_t max_chunk_raw_bytes() const { return _max_chunk_raw_bytes; }
+
+    // decode chunk i into refs (num_refs of the chunk); scratch holds the decompressed
+    // references of compressed chunks. false if the chunk is corrupt.
+    template <class Ref>
+    bool decode(const size_t i, Ref *refs, std::vector<uint8_t> &scratch) const {
+        const TraceChunkInfo &info = _chunks[i];
+        const uint8_t *encoded = _data + info.offset;
+        if (info.compressed()) {
+            scratch.resize(MAX2(info.raw_bytes, (size_t)1));
+            if (!block_decompress(encoded, info.stored_bytes, &scratch[0], info.raw_bytes))
+                return false;
+            encoded = &scratch[0];
+        }
+        return trace_decode(encoded, info.raw_bytes, info.num_refs, refs);
+    }
+
+    std::string _path;
+    const uint8_t *_data;
+    size_t _size;
+    std::vector<TraceChunkInfo> _chunks;
+    size_t _num_refs;
+    size_t _max_chunk_refs;
+    size_t _max_chunk_raw_bytes;
+private:
+    TraceReader(const TraceReader &);
+    TraceReader &operator=(const TraceReader &);
+};
+
+#endif //__TRACE_H__
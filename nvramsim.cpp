@@ -28,15 +28,28 @@
 //#include <set>
 
 #include "cache-sim/cache.h"
+#include "cache-sim/sharded.h"
+#include "cache-sim/ring.h"
+#include "cache-sim/trace.h"
+#include "cache-sim/stackdist.h"
+#include "cache-sim/sampling.h"
+#include "cache-sim/mlp.h"
+#include "cache-sim/pcm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <sys/time.h>
+#include <signal.h>
 
 #include "pin.H"
 #include "portability.H"
 using namespace std;
 
+// cycles of an instruction besides its memory references
+const double InstrCycles = 0.42;
+// "2GHz"
+const double ClockHz = 2*1024*1024*1024LLU;
 // Latencies in number of cycles
 const size_t L1Latency = 2;
 const size_t L2Latency = 16;
@@ -56,8 +69,10 @@ const size_t PCMLatency = 4000; // 2 us at 2GHz
 // 16348x16 = 256 MB
 const size_t DDR_size_MB = 128;  // please change this parameter!
 const size_t DDR_line_bytes = 1024;
+// DDR lines are sectored: a line is allocated as a whole, but PCM is read and written per sector
+const size_t DDR_sector_bytes = 64;
 const size_t DDR_associativity = 8; // number of ways; probably should be fixed
-const size_t DDR_sets = (DDR_size_MB*1024*1024)/DDR_line_bytes * (128/DDR_associativity);
+const size_t DDR_sets = (DDR_size_MB*1024*1024)/(DDR_line_bytes*DDR_associativity);
 
 // 1024x8 = 512 KB
 // 2048x8 =  1 MB
@@ -90,52 +105,288 @@ const size_t L1_sets = 512;
 const size_t L1_ways = 4; // the associativity in each set
 const size_t L1_line_bytes = 64;
 
-MainMemory PCM(addr_space, PCMLatency);
-Cache DDR( "DDR",             // string with cache instance name
+// the flat PCMLatency, unless -pcm_banks configures the banked device model
+PcmMemory PCM(addr_space, PCMLatency);
+// the hierarchy is fixed at compile time, so the caches use constant set indexing
+typedef StaticCache<DDR_sets, DDR_associativity, DDR_line_bytes> DDR_t;
+DDR_t DDR( "DDR",   // string with cache instance name
 	  &PCM,               // parent memory
-	  DDR_sets,
-	  DDR_associativity,
-	  L2_line_bytes,
 	  DDRLatency,
 	  IS_WRITEBACK_CACHE
 	  );
-Cache L2( "L2",             // string with cache instance name
-	  &DDR,             // parent memory
-	  L2_sets,
-	  L2_ways,
-	  L2_line_bytes,
-	  L2Latency,
-	  IS_WRITEBACK_CACHE
-	  );
-Cache L1( "L1",             // string with cache instance name
-	  &L2,              // parent layer in the memory hierarchy
-	  L1_sets,
-	  L1_ways,
-	  L1_line_bytes,
-	  L1Latency,
-	  IS_WRITEBACK_CACHE
-	  );
+typedef StaticCache<L2_sets, L2_ways, L2_line_bytes> L2_t;
+typedef StaticCache<L1_sets, L1_ways, L1_line_bytes> L1_t;
+
+// the levels of a core, walked from its L1 down to PCM (see StaticHierarchy)
+typedef StaticHierarchy<DDR_t, StaticHierarchy<PcmMemory> > DDR_walk_t;
+typedef StaticHierarchy<L2_t, DDR_walk_t> L2_walk_t;
+typedef StaticHierarchy<L1_t, L2_walk_t> CORE_walk_t;
+
+// Every application thread runs on a simulated core (thread id modulo the number of cores),
+// with a private L1 and L2 under the shared DDR cache and PCM.
+// The lock of a core covers its L1 and L2, and the threads of the core take turns with it.
+// A reference that an inclusive L2 serves by itself (see StaticHierarchy::next_serves) only
+// touches the core's caches, so the cores run these in parallel. Anything that reaches DDR
+// runs under ddr_lock, which covers DDR and PCM, and also takes the locks of the cores whose
+// L2 may have a line of the DDR set (coherence actions and DDR replacements reach into them),
+// in core order. A core asked for its lock (wanted) lets it go at the next reference.
+const UINT32 MAX_CORES = 64;
+struct CORE
+{
+	L1_t *L1;
+	L2_t *L2;
+	CORE_walk_t *walk;
+	PIN_MUTEX lock;
+	volatile UINT32 wanted;
+};
+CORE cores[MAX_CORES];
+UINT32 num_cores = 0;
+PIN_MUTEX ddr_lock;
+// the DDR children that an access may reach (under ddr_lock)
+std::vector<bool> ddr_sharers;
+// replicas of L1, L2 and DDR that simulate a shard of the sets each (-shards)
+ShardedHierarchy *sharded = NULL;
 
-KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool", "o", "memtrace.out", "output file");
+KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool", "o", "memtrace.out", "binary trace file of -trace");
+KNOB<BOOL> KnobTrace(KNOB_MODE_WRITEONCE, "pintool", "trace", "0", "capture the memory references into a binary trace (see -o) instead of simulating them");
 KNOB<UINT32> KnobNumPagesInBuffer(KNOB_MODE_WRITEONCE, "pintool", "num_pages_in_buffer", "256", "number of pages in buffer");
+KNOB<string> KnobL1Repl(KNOB_MODE_WRITEONCE, "pintool", "l1_repl", "lru", "L1 replacement policy (lru, plru, srrip, brrip, dip, random)");
+KNOB<string> KnobL2Repl(KNOB_MODE_WRITEONCE, "pintool", "l2_repl", "lru", "L2 replacement policy");
+KNOB<string> KnobDDRRepl(KNOB_MODE_WRITEONCE, "pintool", "ddr_repl", "lru", "DDR cache replacement policy");
+KNOB<string> KnobL2Incl(KNOB_MODE_WRITEONCE, "pintool", "l2_incl", "inclusive", "L2 inclusion of L1 lines (inclusive, nine, exclusive)");
+KNOB<string> KnobDDRIncl(KNOB_MODE_WRITEONCE, "pintool", "ddr_incl", "inclusive", "DDR cache inclusion of L2 lines");
+KNOB<UINT32> KnobCores(KNOB_MODE_WRITEONCE, "pintool", "cores", "16", "number of simulated cores with a private L1 and L2 (at most 64)");
+KNOB<INT32> KnobSimThreads(KNOB_MODE_WRITEONCE, "pintool", "sim_threads", "-1", "simulator threads that simulate full buffers while the application continues (-1: one per simulated core, for the threads of that core; 0: simulate in the application thread)");
+KNOB<UINT32> KnobBuffersPerThread(KNOB_MODE_WRITEONCE, "pintool", "buffers_per_thread", "4", "trace buffers of an application thread; it waits for the simulator when all are full");
+KNOB<UINT32> KnobShards(KNOB_MODE_WRITEONCE, "pintool", "shards", "0", "simulate every buffer in this many set shards on as many threads (power of 2, 0 for off; needs -cores 1)");
+KNOB<string> KnobProfileLevel(KNOB_MODE_WRITEONCE, "pintool", "profile_level", "", "profile the LRU stack distances of the requests to this level (l1, l2: those of core 0, ddr) into miss ratio and dirty eviction curves");
+KNOB<UINT32> KnobProfileWays(KNOB_MODE_WRITEONCE, "pintool", "profile_ways", "0", "associativity of the set-associative curve of -profile_level (0: that of the level)");
+KNOB<double> KnobProfileSample(KNOB_MODE_WRITEONCE, "pintool", "profile_sample", "1", "fraction of the lines that -profile_level samples (by address hash)");
+KNOB<UINT64> KnobSamplePeriod(KNOB_MODE_WRITEONCE, "pintool", "sample_period", "0", "sampled simulation: one detailed window per this many references of a thread (0: simulate all references in detail)");
+KNOB<UINT64> KnobSampleWindow(KNOB_MODE_WRITEONCE, "pintool", "sample_window", "10000", "references of a detailed window of -sample_period");
+KNOB<UINT64> KnobSampleWarmup(KNOB_MODE_WRITEONCE, "pintool", "sample_warmup", "200000", "references before a detailed window that only warm the caches");
+KNOB<BOOL> KnobSampleFunctional(KNOB_MODE_WRITEONCE, "pintool", "sample_functional", "0", "warm the caches with all references between the detailed windows, instead of skipping them");
+KNOB<UINT64> KnobRoiSkip(KNOB_MODE_WRITEONCE, "pintool", "roi_skip", "0", "start the region of interest after this many instructions (fast-forward)");
+KNOB<UINT64> KnobRoiLength(KNOB_MODE_WRITEONCE, "pintool", "roi_length", "0", "end the region of interest for good after this many instructions in it (0: never)");
+KNOB<string> KnobRoiRoutine(KNOB_MODE_WRITEONCE, "pintool", "roi_routine", "", "start the region of interest at the entry of this routine, end it at the exit");
+KNOB<BOOL> KnobRoiMagic(KNOB_MODE_WRITEONCE, "pintool", "roi_magic", "0", "start and end the region of interest at the marker instructions of nvramsim_roi.h");
+KNOB<BOOL> KnobRoiSignal(KNOB_MODE_WRITEONCE, "pintool", "roi_signal", "0", "start the region of interest at SIGUSR1, end it at SIGUSR2");
+KNOB<double> KnobSampleError(KNOB_MODE_WRITEONCE, "pintool", "sample_error", "0.03", "target relative error (at 95% confidence) of the sampled estimates, for the suggested -sample_period");
+KNOB<UINT32> KnobRob(KNOB_MODE_WRITEONCE, "pintool", "rob", "0", "reorder window of the cores in instructions, for the timing with memory level parallelism (0: every latency stalls the core)");
+KNOB<UINT32> KnobMshrL1(KNOB_MODE_WRITEONCE, "pintool", "mshr_l1", "10", "outstanding L1 misses of a core with -rob (0: unlimited)");
+KNOB<UINT32> KnobMshrL2(KNOB_MODE_WRITEONCE, "pintool", "mshr_l2", "16", "outstanding L2 misses of a core with -rob (0: unlimited)");
+KNOB<UINT32> KnobMshrDDR(KNOB_MODE_WRITEONCE, "pintool", "mshr_ddr", "32", "outstanding DDR cache misses (PCM reads) of a core with -rob (0: unlimited)");
+KNOB<UINT32> KnobPcmBanks(KNOB_MODE_WRITEONCE, "pintool", "pcm_banks", "0", "banks per rank of the banked PCM model (0: every PCM access takes the flat PCM latency)");
+KNOB<UINT32> KnobPcmRanks(KNOB_MODE_WRITEONCE, "pintool", "pcm_ranks", "1", "ranks per PCM channel of -pcm_banks");
+KNOB<UINT32> KnobPcmChannels(KNOB_MODE_WRITEONCE, "pintool", "pcm_channels", "1", "PCM channels of -pcm_banks");
+KNOB<UINT32> KnobPcmRowBytes(KNOB_MODE_WRITEONCE, "pintool", "pcm_row_bytes", "1024", "row buffer of a PCM bank, in bytes");
+KNOB<string> KnobPcmMap(KNOB_MODE_WRITEONCE, "pintool", "pcm_map", "row:rank:bank:channel:column", "PCM address interleaving: the fields from the most significant bits");
+KNOB<string> KnobPcmPage(KNOB_MODE_WRITEONCE, "pintool", "pcm_page", "open", "PCM row buffer policy (open, closed)");
+KNOB<UINT32> KnobPcmTColumn(KNOB_MODE_WRITEONCE, "pintool", "pcm_t_column", "30", "cycles of a read from the open PCM row");
+KNOB<UINT32> KnobPcmTRead(KNOB_MODE_WRITEONCE, "pintool", "pcm_t_read", "120", "cycles of a PCM array read of a row into the row buffer");
+KNOB<UINT32> KnobPcmTReset(KNOB_MODE_WRITEONCE, "pintool", "pcm_t_reset", "100", "cycles of the RESET pulse of a PCM write");
+KNOB<UINT32> KnobPcmTSet(KNOB_MODE_WRITEONCE, "pintool", "pcm_t_set", "300", "cycles of the SET pulse of a PCM write");
+KNOB<UINT32> KnobPcmTBurst(KNOB_MODE_WRITEONCE, "pintool", "pcm_t_burst", "8", "cycles of the transfer of a DDR sector on a PCM channel");
+KNOB<UINT32> KnobPcmSetIterations(KNOB_MODE_WRITEONCE, "pintool", "pcm_set_iterations", "4", "iterations of the SET pulse of a PCM write, where it can pause");
+KNOB<UINT32> KnobPcmWriteQueue(KNOB_MODE_WRITEONCE, "pintool", "pcm_write_queue", "0", "entries of the PCM write queue of -pcm_banks (0: writes go to the banks at once)");
+KNOB<UINT32> KnobPcmWriteHigh(KNOB_MODE_WRITEONCE, "pintool", "pcm_write_high", "28", "queued writes that start a drain of the PCM write queue");
+KNOB<UINT32> KnobPcmWriteLow(KNOB_MODE_WRITEONCE, "pintool", "pcm_write_low", "16", "queued writes where a drain of the PCM write queue stops");
+KNOB<string> KnobPcmWritePolicy(KNOB_MODE_WRITEONCE, "pintool", "pcm_write_policy", "pause", "what a PCM read does to a queued write in progress in its bank (wait, pause, cancel)");
+
+// the stack distance profile of -profile_level, and the cache it profiles
+StackDistance *profiler = NULL;
+Cache *profiled_cache = NULL;
+
+// Timing with memory level parallelism (-rob): every application thread times its references
+// on an MlpCore of its core's window and MSHRs, levels L1, L2, DDR and PCM. Without it, every
+// latency stalls the core (cycles_memref).
+UINT32 rob_size = 0;
+size_t mshrs[MlpCore::MAX_LEVELS - 1];
+
+// The DDR and PCM activity of references (see ProcessBufferCore)
+struct MEM_TRAFFIC
+{
+	UINT64 ddr_accesses;
+	UINT64 ddr_hits;
+	UINT64 pcm_reads;
+	UINT64 pcm_writes;
+};
+
+// Sampled simulation (-sample_period): the references of every thread go in periods of
+// sample_period. Only the last sample_window of a period are measured (a detailed window),
+// after sample_warmup that only warm the caches; the references before are skipped, or with
+// -sample_functional also only warm the caches. The windows of all threads are the units of
+// the estimates (with 95% confidence intervals) that replace the measured totals at Fini.
+struct SAMPLE_WINDOW
+{
+	UINT64 refs;
+	double instructions;	// the instructions of a buffer are spread evenly over its references
+	UINT64 latency;
+	MEM_TRAFFIC traffic;
+};
+UINT64 sample_period = 0;
+UINT64 sample_window = 0;
+UINT64 sample_warmup = 0;
+PIN_LOCK sample_lock;
+RatioEstimate sample_cpi;		// cycles per instruction
+RatioEstimate sample_ddr_hit_rate;	// DDR hits per DDR access
+RatioEstimate sample_latency;		// cycles per reference
+RatioEstimate sample_pcm_reads;		// per reference
+RatioEstimate sample_pcm_writes;	// per reference
+
+VOID SampleWindowDone(const SAMPLE_WINDOW &window, THREADID tid)
+{
+	GetLock(&sample_lock, tid + 1);
+	sample_cpi.add(InstrCycles*window.instructions + window.latency, window.instructions);
+	sample_ddr_hit_rate.add(window.traffic.ddr_hits, window.traffic.ddr_accesses);
+	sample_latency.add(window.latency, window.refs);
+	sample_pcm_reads.add(window.traffic.pcm_reads, window.refs);
+	sample_pcm_writes.add(window.traffic.pcm_writes, window.refs);
+	ReleaseLock(&sample_lock);
+}
+
+// the sampled estimates, and the sampling period for the target error
+VOID sample_print(FILE *f)
+{
+	fprintf(f, "Sampling: %lu detailed windows of %lu references, one per %lu references of a thread (%lu warming up, %s)\n",
+		sample_cpi.units(), sample_window, sample_period, sample_warmup,
+		KnobSampleFunctional.Value() ? "the others warming up too" : "the others skipped");
+	const char *names[] = { "CPI", "DDR hit rate", "PCM reads per reference", "PCM writes per reference" };
+	const RatioEstimate *estimates[] = { &sample_cpi, &sample_ddr_hit_rate, &sample_pcm_reads, &sample_pcm_writes };
+	const double target = KnobSampleError.Value();
+	size_t needed = 0;
+	for (size_t i=0; i<sizeof(names)/sizeof(names[0]); i++) {
+		fprintf(f, "Sampled %s: %.6f +- %.6f (%.2f%%, 95%% confidence)\n", names[i],
+			estimates[i]->ratio(), estimates[i]->half_width(), 100*estimates[i]->relative_error());
+		needed = MAX2(needed, estimates[i]->units_needed(target));
+	}
+	if (sample_cpi.units() < 2) {
+		fprintf(f, "Sampling: too few windows for confidence intervals, use a shorter -sample_period\n");
+	} else if (needed <= sample_cpi.units()) {
+		fprintf(f, "Sampling: all estimates are within the target error of %.2f%%\n", 100*target);
+	} else {
+		// as many more windows over the same references
+		const UINT64 period = MAX2(sample_window + sample_warmup, (UINT64)(sample_period * sample_cpi.units() / needed));
+		fprintf(f, "Sampling: the target error of %.2f%% needs about %lu windows: -sample_period %lu\n",
+			100*target, needed, period);
+	}
+}
 
 
+// totals of all threads, merged at Fini
 uint64_t num_instr = 0;
 uint64_t num_memrefs = 0;
 uint64_t cycles_memref = 0;
+UINT32 totalBuffersFilled = 0;
+UINT64 totalElementsProcessed = 0;
+
+// counters of one application thread; a thread only updates its own, without locking.
+// Padded to cache lines, so that the threads do not share one.
+const UINT32 MAX_THREADS = 4096;
+struct THREAD_COUNTERS
+{
+	UINT64 num_instr;
+	UINT64 num_memrefs;
+	UINT64 cycles_memref;
+	UINT64 timed_memrefs;	// the references of cycles_memref and traffic (all but with -sample_period)
+	UINT64 buffers_filled;
+	UINT64 elements_processed;
+	MEM_TRAFFIC traffic;	// not with -shards
+	UINT64 mlp_cycles;	// with -rob: all cycles of the thread, instructions and memory stalls
+	UINT8 pad[128 - 7*sizeof(UINT64) - sizeof(MEM_TRAFFIC)];
+};
+THREAD_COUNTERS thread_counters[MAX_THREADS];
 char base_directory[1024];
 
 std::stringstream cmdline;
 
+// Per thread: the cycles of its instructions and its memory stall cycles. With
+// -sample_period, the stall cycles and traffic are scaled up from the detailed windows of
+// the thread; with -rob, they are the cycles the core could not hide. The threads of a core
+// take turns on it and the cores run in parallel, so the execution time is that of the
+// busiest core (the critical path), not that of all cycles.
+VOID timing_print(FILE *f)
+{
+	std::vector<double> core_cycles(num_cores, 0);
+	double all_cycles = 0;
+	if (rob_size)
+		fprintf(f, "Memory level parallelism: reorder window %u instructions, MSHRs L1 %lu, L2 %lu, DDR %lu (0: unlimited)\n",
+			rob_size, mshrs[0], mshrs[1], mshrs[2]);
+	fprintf(f, "Per thread: thread,core,instructions,memory references,memory cycles,cycles,seconds at 2GHz,"
+		"DDR accesses,DDR hits,PCM reads,PCM writes\n");
+	for (UINT32 tid=0; tid<MAX_THREADS; tid++) {
+		const THREAD_COUNTERS &counters = thread_counters[tid];
+		if (counters.num_instr == 0 && counters.num_memrefs == 0)
+			continue;
+		const double scale = counters.timed_memrefs ? double(counters.num_memrefs) / counters.timed_memrefs : 0;
+		const double memory_cycles = rob_size ? counters.mlp_cycles - InstrCycles*counters.num_instr : scale*counters.cycles_memref;
+		const double cycles = InstrCycles*counters.num_instr + memory_cycles;
+		core_cycles[tid % num_cores] += cycles;
+		all_cycles += cycles;
+		fprintf(f, "%u,%u,%lu,%lu,%.0lf,%.0lf,%4.2lf,%.0lf,%.0lf,%.0lf,%.0lf\n", tid, tid % num_cores,
+			counters.num_instr, counters.num_memrefs, memory_cycles, cycles, cycles / ClockHz,
+			scale*counters.traffic.ddr_accesses, scale*counters.traffic.ddr_hits,
+			scale*counters.traffic.pcm_reads, scale*counters.traffic.pcm_writes);
+	}
+	UINT32 critical = 0;
+	fprintf(f, "Per core: core,cycles,seconds at 2GHz\n");
+	for (UINT32 core=0; core<num_cores; core++) {
+		if (core_cycles[core] > core_cycles[critical])
+			critical = core;
+		if (core_cycles[core] > 0)
+			fprintf(f, "%u,%.0lf,%4.2lf\n", core, core_cycles[core], core_cycles[core] / ClockHz);
+	}
+	fprintf(f, "Estimated execution time of the threads in parallel, at 2GHz: %4.2lf seconds (critical path: core %u; all threads one after another: %4.2lf seconds)\n",
+		core_cycles[critical] / ClockHz, critical, all_cycles / ClockHz);
+	fprintf(stderr, "NVRAMSIM: estimated execution time at 2GHz: %4.2lf seconds on %u cores (critical path: core %u)\n",
+		core_cycles[critical] / ClockHz, num_cores, critical);
+}
+
+// simulator memory for the tags and states of each level
+VOID footprint_print(FILE *f, const char *when)
+{
+    const char *names[] = { "L1", "L2", "DDR" };
+    size_t total = 0;
+    for (size_t i=0; i<sizeof(names)/sizeof(names[0]); i++) {
+        size_t bytes = 0;
+        size_t sets_used = 0;
+        size_t sets = 0;
+        // the private levels are summed over the cores
+        for (UINT32 core=0; core<((i < 2) ? num_cores : 1); core++) {
+            Cache *cache = (i == 0) ? (Cache *)cores[core].L1 : (i == 1) ? (Cache *)cores[core].L2 : (Cache *)&DDR;
+            bytes += cache->get_metadata_bytes();
+            sets_used += cache->get_num_sets_used();
+            sets += cache->_num_direct_entries;
+        }
+        for (size_t shard=0; sharded && shard<sharded->num_shards(); shard++) {
+            bytes += sharded->_shards[shard]->caches[i]->get_metadata_bytes();
+            sets_used += sharded->_shards[shard]->caches[i]->get_num_sets_used();
+        }
+        fprintf(f, "NVRAMSIM: %s %s metadata: %lu KB, %lu of %lu sets allocated\n", when,
+                names[i], bytes/1024, sets_used, sets);
+        total += bytes;
+    }
+    fprintf(f, "NVRAMSIM: %s total simulator metadata: %lu KB\n", when, total/1024);
+}
+
 VOID stats_print()
 {
-    double exec_time = double(0.42*num_instr + cycles_memref) / (2*1024*1024*1024LLU);
+    double exec_time = double(InstrCycles*num_instr + cycles_memref) / ClockHz;
+    // every PCM request fetches one DDR sector, and every PCM writeback writes one modified sector
+    // sampled: estimated from the detailed windows (see sample_print)
+    const uint64_t pcm_reads = sample_period ? (uint64_t)(sample_pcm_reads.ratio()*num_memrefs) : PCM.stats.hits;
+    const uint64_t pcm_writes = sample_period ? (uint64_t)(sample_pcm_writes.ratio()*num_memrefs) : PCM.stats.writebacks;
+    const uint64_t pcm_read_bytes = pcm_reads*DDR_sector_bytes;
+    const uint64_t pcm_write_bytes = pcm_writes*DDR_sector_bytes;
+    // the cache and PCM statistics count every simulated reference, not only the detailed windows
+    const char *raw = sample_period ? ", all references including warming" : "";
     char fname_stats[sizeof(base_directory)+255];
     char *pos = strcpy(fname_stats, base_directory) + strlen(base_directory);
     *pos = '/';
     pos++;
     snprintf(pos, sizeof(fname_stats) - (pos - fname_stats), "nvramsim_stats_%d.txt", PIN_GetPid());
     fprintf(stderr, "NVRAMSIM: process %d is saving statistics to file '%s'\n", PIN_GetPid(), fname_stats);
+    footprint_print(stderr, "exit");
     FILE *fstats = fopen(fname_stats, "wb");
     fprintf(fstats, "Command line,Instructions,Total memory references," \
 	    "Avg cycles/mem ref,PCM read KB,PCM 64B reads,PCM 128B reads," \
@@ -143,12 +394,12 @@ VOID stats_print()
 	    "Estimated exec. time at 2GHz\n");
     fprintf(fstats, "\"%s\",%lu,%lu,%6.2lf,%lu,%lu,%lu,%lu,%lu,%lu,%4.2lf\n",
 	    cmdline.str().c_str(),
-	    num_instr, num_memrefs, double(cycles_memref)/num_memrefs, PCM.stats.hits_rd /* each read is for 1KB */,
-	    PCM.stats.hits_rd*DDR_line_bytes/64, /* when PCM is in 64B blocks */
-	    PCM.stats.hits_rd*DDR_line_bytes/128, /* when PCM is in 128B blocks */
-	    PCM.stats.hits_wr, /* each write is for 1KB */
-	    PCM.stats.hits_wr*DDR_line_bytes/64, /* when PCM is in 64B blocks */
-	    PCM.stats.hits_wr*DDR_line_bytes/128, /* when PCM is in 128B blocks */
+	    num_instr, num_memrefs, double(cycles_memref)/num_memrefs, pcm_read_bytes/1024,
+	    pcm_read_bytes/64, /* when PCM is in 64B blocks */
+	    pcm_read_bytes/128, /* when PCM is in 128B blocks */
+	    pcm_write_bytes/1024,
+	    pcm_write_bytes/64, /* when PCM is in 64B blocks */
+	    pcm_write_bytes/128, /* when PCM is in 128B blocks */
 	    exec_time);
     fprintf(fstats, "\n==== Verbose description ====\n");
     fprintf(fstats, "Executed command: %s\n", cmdline.str().c_str());
@@ -156,24 +407,76 @@ VOID stats_print()
     fprintf(fstats, "Instructions: %lu (0.42 Cycles per Instruction; compile-time fixed)\n", num_instr);
     fprintf(fstats, "Total memory references: %lu (%6.2lf Cycles per Memory Reference; workload-dependent)\n", num_memrefs, double(cycles_memref)/num_memrefs);
     fprintf(fstats, "PCM reads: %lu KB. 64B reqs %lu 128B reqs: %lu\n",
-	    PCM.stats.hits_rd, PCM.stats.hits_rd*DDR_line_bytes/64,
-	    PCM.stats.hits_rd*DDR_line_bytes/128);
+	    pcm_read_bytes/1024, pcm_read_bytes/64, pcm_read_bytes/128);
     fprintf(fstats, "PCM writes: %lu KB. 64B reqs %lu 128B reqs: %lu\n",
-	    PCM.stats.hits_wr, PCM.stats.hits_wr*DDR_line_bytes/64,
-	    PCM.stats.hits_wr*DDR_line_bytes/128);
+	    pcm_write_bytes/1024, pcm_write_bytes/64, pcm_write_bytes/128);
+    fprintf(fstats, "DDR sector misses: %lu (%lu B lines, %lu B sectors%s)\n",
+	    DDR.stats.sector_misses, DDR_line_bytes, DDR_sector_bytes, raw);
     fprintf(fstats, "Estimated execution time on an in-order processor at 2GHz: %4.2lf seconds\n", exec_time);
+    if (PCM.is_banked()) {
+        const PcmStats &banks = PCM.pcm_stats;
+        fprintf(fstats, "PCM banks: %lu channels x %lu ranks x %lu banks, %lu B rows, %s page, map %s%s\n",
+                PCM._config.channels, PCM._config.ranks, PCM._config.banks, PCM._config.row_bytes,
+                PCM._config.open_page ? "open" : "closed", pcm_map2str(PCM._config.map).c_str(), raw);
+        fprintf(fstats, "PCM bank activity: %lu reads (%4.2lf%% row buffer hits, %6.2lf cycles on average, %6.2lf of them queueing), %lu writes, %lu bank conflicts\n",
+                banks.reads, 100.0*banks.read_row_hits/MAX2(banks.reads, (size_t)1),
+                double(banks.read_cycles)/MAX2(banks.reads, (size_t)1),
+                double(banks.read_queue_cycles)/MAX2(banks.reads, (size_t)1),
+                banks.writes, banks.bank_conflicts);
+        if (PCM._config.write_queue)
+            fprintf(fstats, "PCM write queue: %lu entries, drained from %lu to %lu, write policy %s: %lu drains, %lu reads forwarded, %lu writes paused, %lu writes cancelled (%lu cycles lost), %lu writes left\n",
+                    PCM._config.write_queue, PCM._config.write_high, PCM._config.write_low,
+                    pcm_write_policy2str(PCM._config.write_policy),
+                    banks.write_drains, banks.read_forwards, banks.writes_paused, banks.writes_cancelled,
+                    banks.cancelled_cycles, PCM.writes_queued());
+        fprintf(fstats, "PCM read latency inflation by writes: %4.2lf%% (%lu reads waited for writes, %6.2lf cycles on average)\n",
+                100*banks.read_inflation(), banks.reads_behind_writes,
+                double(banks.read_write_cycles)/MAX2(banks.reads_behind_writes, (size_t)1));
+    }
+    timing_print(fstats);
+    if (sample_period)
+        sample_print(fstats);
+    footprint_print(fstats, "exit");
     fclose(fstats);
-    PCM.dump_stats();
+    PCM.dump_stats(sample_period ? "All references, including warming (the sampled estimates are in nvramsim_stats)" : NULL);
+}
+
+// the curves of -profile_level: fully associative, and of the associativity of -profile_ways
+VOID profile_print()
+{
+	char fname[sizeof(base_directory)+255];
+	snprintf(fname, sizeof(fname), "%s/nvramsim_mrc_%d.txt", base_directory, PIN_GetPid());
+	fprintf(stderr, "NVRAMSIM: process %d is saving the stack distance profile of %s to file '%s'\n",
+		PIN_GetPid(), profiled_cache->_name.c_str(), fname);
+	std::ofstream out(fname);
+	const size_t ways = KnobProfileWays.Value() ? KnobProfileWays.Value() : profiled_cache->_associativity;
+	profiler->dump(out, profiled_cache->_name.c_str(), 0);
+	out << "\n";
+	profiler->dump(out, profiled_cache->_name.c_str(), ways);
 }
 
 /*
- * Struct of memory reference written to the buffer
+ * Struct of memory reference written to the buffer: the requested line state is recorded
+ * directly, so a full buffer is handed to the caches as one batch
  */
-struct MEMREF
+typedef Access MEMREF;
+
+// Trace capture (-trace): the buffer holds TraceRef records instead of MEMREFs, and every full
+// buffer becomes one chunk of the trace file. Encoding and compression run where a buffer
+// would be simulated (on the simulator threads, see SIM_JOB); only the file write is serialized.
+BOOL capture = false;
+FILE *trace_file = NULL;
+PIN_LOCK trace_lock;
+UINT64 trace_raw_bytes = 0;
+UINT64 trace_stored_bytes = 0;
+UINT64 trace_chunks = 0;
+
+UINT64 TraceTimestamp()
 {
-    ADDRINT ea;
-    BOOL read;
-};
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (UINT64)tv.tv_sec * 1000000000ULL + (UINT64)tv.tv_usec * 1000;
+}
 
 // The buffer ID returned by the one call to PIN_DefineTraceBuffer
 BUFFER_ID bufId;
@@ -182,8 +485,152 @@ BUFFER_ID bufId;
 // object that it owns
 TLS_KEY appThreadRepresentitiveKey;
 
-UINT32 totalBuffersFilled = 0;
-UINT64 totalElementsProcessed = 0;
+// Set-sharded simulation (-shards): the thread with the full buffer simulates shard 0,
+// a worker thread each of the other shards. One buffer is simulated at a time.
+struct SHARD_WORKER
+{
+	UINT32 shard;
+	PIN_SEMAPHORE go;
+	PIN_SEMAPHORE done;
+	PIN_THREAD_UID uid;
+};
+SHARD_WORKER *shard_workers = NULL;
+PIN_LOCK sharded_lock;
+volatile BOOL shard_workers_stop = false;
+
+VOID ShardWorker(VOID *arg)
+{
+	SHARD_WORKER *worker = static_cast<SHARD_WORKER *>(arg);
+	for (;;) {
+		PIN_SemaphoreWait(&worker->go);
+		PIN_SemaphoreClear(&worker->go);
+		if (shard_workers_stop)
+			break;
+		sharded->simulate(worker->shard);
+		PIN_SemaphoreSet(&worker->done);
+	}
+}
+
+VOID ProcessBufferSharded(const MEMREF *memrefs, UINT64 numElements, BatchResult &batch)
+{
+	GetLock(&sharded_lock, 1);
+	sharded->partition(memrefs, numElements);
+	for (UINT32 shard=1; shard<sharded->num_shards(); shard++) {
+		PIN_SemaphoreClear(&shard_workers[shard].done);
+		PIN_SemaphoreSet(&shard_workers[shard].go);
+	}
+	sharded->simulate(0);
+	for (UINT32 shard=1; shard<sharded->num_shards(); shard++) {
+		PIN_SemaphoreWait(&shard_workers[shard].done);
+	}
+	sharded->collect(batch);
+	ReleaseLock(&sharded_lock);
+}
+
+// The locks of the cores that an access to addr from core may reach below its L2, in core
+// order, after ddr_lock: the core's own, and those of the DDR sharers of the set.
+VOID LockSharers(CORE &core, const Addr addr)
+{
+	DDR.set_sharers(addr, ddr_sharers);
+	for (UINT32 c=0; c<num_cores; c++) {
+		if (&cores[c] != &core && !ddr_sharers[cores[c].L2->_index_in_parent])
+			continue;
+		__sync_fetch_and_add(&cores[c].wanted, 1);
+		PIN_MutexLock(&cores[c].lock);
+		__sync_fetch_and_sub(&cores[c].wanted, 1);
+	}
+}
+
+VOID UnlockSharers(CORE &core)
+{
+	for (UINT32 c=0; c<num_cores; c++) {
+		if (&cores[c] == &core || ddr_sharers[cores[c].L2->_index_in_parent])
+			PIN_MutexUnlock(&cores[c].lock);
+	}
+}
+
+// Simulates a buffer on the caches of one core (see CORE), walking its levels. The DDR and
+// PCM activity of the references goes to traffic, if any: only the slow path (under
+// ddr_lock) reaches DDR, so no other thread changes the counters meanwhile.
+// With mlp, the references are also timed on it, instr_per_ref apart; the level that served
+// a miss is the deepest one the walk reached (DDR on a DDR access, PCM on a PCM read).
+// The banked PCM (-pcm_banks) keeps its own clock; before every access that may reach it,
+// it advances by the cycles of the thread since the last one but for the PCM reads, which
+// advance it themselves. The clock is shared, so the threads look serialized to the device.
+VOID ProcessBufferCore(CORE &core, const MEMREF *memrefs, UINT64 numElements, BatchResult &batch, MEM_TRAFFIC *traffic,
+		MlpCore *mlp, double instr_per_ref)
+{
+	uint8_t *data;
+	size_t latency = 0;
+	UINT64 slow = 0;
+	double elapsed = 0;
+	const bool l2_inclusive = (core.L2->_inclusion == INCLUSION_INCLUSIVE);
+	PIN_MutexLock(&core.lock);
+	for (UINT64 i=0; i<numElements; i++) {
+		if (core.wanted) {
+			PIN_MutexUnlock(&core.lock);
+			while (core.wanted)
+				PIN_Yield();
+			PIN_MutexLock(&core.lock);
+		}
+		if (i + ACCESS_BATCH_LOOKAHEAD < numElements)
+			core.L1->prefetch_sets(memrefs[i + ACCESS_BATCH_LOOKAHEAD].addr);
+		const Addr addr = memrefs[i].addr;
+		const uint8_t line_state = (uint8_t)memrefs[i].line_state;
+		const size_t issued = latency;
+		elapsed += InstrCycles*instr_per_ref;
+		if (core.L1->line_hit(addr, line_state, latency, data)) {
+			if (mlp)
+				mlp->reference(instr_per_ref, 0, latency - issued);
+			elapsed += latency - issued;
+			continue;
+		}
+		// the victims of L1 stay in an inclusive L2; DDR may change under ddr_lock meanwhile,
+		// so only the L2 of the core is looked at
+		if (l2_inclusive && core.walk->next_serves(addr, line_state)) {
+			const AccessResult walk = core.walk->access(addr, line_state, data);
+			latency += walk.latency;
+			if (mlp)
+				mlp->reference(instr_per_ref, walk.hit_level, latency - issued);
+			elapsed += latency - issued;
+			slow++;
+			continue;
+		}
+		PIN_MutexUnlock(&core.lock);
+		PIN_MutexLock(&ddr_lock);
+		LockSharers(core, addr);
+		if (PCM.is_banked()) {
+			PCM.advance((size_t)elapsed);
+			elapsed -= (size_t)elapsed;
+		}
+		const size_t pcm_read_cycles = PCM.pcm_stats.read_cycles;
+		const UINT64 ddr_accesses = DDR.stats.hits + DDR.stats.misses;
+		const UINT64 ddr_hits = DDR.stats.hits;
+		const UINT64 pcm_reads = PCM.stats.hits;
+		const UINT64 pcm_writes = PCM.stats.writebacks;
+		const AccessResult walk = core.walk->access(addr, line_state, data);
+		latency += walk.latency;
+		if (traffic) {
+			traffic->ddr_accesses += DDR.stats.hits + DDR.stats.misses - ddr_accesses;
+			traffic->ddr_hits += DDR.stats.hits - ddr_hits;
+			traffic->pcm_reads += PCM.stats.hits - pcm_reads;
+			traffic->pcm_writes += PCM.stats.writebacks - pcm_writes;
+		}
+		if (mlp)
+			mlp->reference(instr_per_ref, walk.hit_level, latency - issued);
+		const size_t pcm_read_latency = PCM.pcm_stats.read_cycles - pcm_read_cycles;
+		elapsed += latency - issued - MIN2(latency - issued, pcm_read_latency);
+		UnlockSharers(core);
+		PIN_MutexUnlock(&ddr_lock);
+		PIN_MutexLock(&core.lock);
+		// another thread of the core may have brought the line in meanwhile
+		slow += (walk.hit_level > 0);
+	}
+	PIN_MutexUnlock(&core.lock);
+	batch.accesses += numElements;
+	batch.latency += latency;
+	batch.hits += numElements - slow;
+}
 
 /*
  *
@@ -196,44 +643,358 @@ class APP_THREAD_REPRESENTITVE
 {
 public:
 	APP_THREAD_REPRESENTITVE(THREADID tid) {
+		_tid = tid;
 		_numBuffersFilled = 0;
 		_numElementsProcessed = 0;
+		_inFlight = 0;
+		_samplePos = 0;
+		_lastInstructions = 0;
+		memset(&_window, 0, sizeof(_window));
+		_mlp = rob_size ? new MlpCore(InstrCycles, rob_size, MlpCore::MAX_LEVELS, mshrs) : NULL;
+		// the pool holds every buffer of the thread at most once
+		_free.init(2UL << log2floor(MAX2(KnobBuffersPerThread.Value(), 1U)));
+		PIN_SemaphoreInit(&_returned);
+	}
+	~APP_THREAD_REPRESENTITVE() {
+		for (size_t i=0; i<_allocated.size(); i++)
+			PIN_DeallocateBuffer(bufId, _allocated[i]);
+		PIN_SemaphoreFini(&_returned);
+		delete _mlp;
 	}
-	~APP_THREAD_REPRESENTITVE() {}
 
-	VOID ProcessBuffer(VOID *buf, UINT64 numElements);
+	VOID ProcessBuffer(VOID *buf, UINT64 numElements, UINT64 timestamp, UINT64 instructions);
+	VOID SampleBuffer(const MEMREF *memrefs, UINT64 numElements, UINT64 instructions);
+	VOID CaptureBuffer(const TraceRef *refs, UINT64 numElements, UINT64 timestamp, UINT64 instructions);
+	VOID MlpFinish(UINT64 instructions);
 	UINT32 NumBuffersFilled() {return _numBuffersFilled;}
 
 	UINT32 NumElementsProcessed() {return _numElementsProcessed;}
+
+	// asynchronous simulation: the buffer pool of the thread
+	VOID *NextBuffer();
+	VOID BufferQueued() { __sync_fetch_and_add(&_inFlight, 1); }
+	VOID ReturnBuffer(VOID *buf);
+	VOID Drain();
 private:
+	THREADID _tid;
 	UINT32 _numBuffersFilled;
 	UINT32 _numElementsProcessed;
+	BoundedRing<VOID *> _free;
+	std::vector<VOID *> _allocated;	// by the tool; Pin frees the first buffer itself
+	PIN_SEMAPHORE _returned;
+	volatile UINT32 _inFlight;
+	TraceChunkBuilder _chunk;	// only used by the one thread that processes our buffers
+	// sampled simulation: the position in the sampling period, and its detailed window
+	UINT64 _samplePos;
+	UINT64 _lastInstructions;	// at the end of the last buffer
+	SAMPLE_WINDOW _window;
+	MlpCore *_mlp;		// -rob
 };
 
-VOID APP_THREAD_REPRESENTITVE::ProcessBuffer(VOID *buf, UINT64 numElements)
+VOID APP_THREAD_REPRESENTITVE::ProcessBuffer(VOID *buf, UINT64 numElements, UINT64 timestamp, UINT64 instructions)
 {
 	_numBuffersFilled++;
 
-	struct MEMREF * memref=(struct MEMREF*)buf;
-	uint8_t *data;
-	for(UINT64 i=0; i<numElements; i++, memref++)
-	{
-//		if (memref->read)
-//			cerr << "Recorded read @" << (void*)memref->ea << "\n";
-//		else
-//			cerr << "Recorded write @" << (void*)memref->ea << "\n";
-		L1.line_get(memref->ea, (memref->read)?LINE_SHR:LINE_MOD, cycles_memref, data);
-		num_memrefs++;
+	if (capture) {
+		CaptureBuffer((const TraceRef *)buf, numElements, timestamp, instructions);
+		_numElementsProcessed += (UINT32)numElements;
+		return;
 	}
+	if (sample_period) {
+		SampleBuffer((const MEMREF *)buf, numElements, instructions);
+		_numElementsProcessed += (UINT32)numElements;
+		return;
+	}
+	BatchResult batch;
+	if (sharded) {
+		ProcessBufferSharded((const MEMREF *)buf, numElements, batch);
+	} else {
+		const double instr_per_ref = numElements ? double(instructions - _lastInstructions) / numElements : 0;
+		_lastInstructions = instructions;
+		ProcessBufferCore(cores[_tid % num_cores], (const MEMREF *)buf, numElements, batch, &thread_counters[_tid].traffic,
+				  _mlp, instr_per_ref);
+	}
+	thread_counters[_tid].cycles_memref += batch.latency;
+	thread_counters[_tid].num_memrefs += batch.accesses;
+	thread_counters[_tid].timed_memrefs += batch.accesses;
 	_numElementsProcessed += (UINT32)numElements;
 }
 
+// the part of the buffer in each phase of the sampling period: skipped (or warming up with
+// -sample_functional), warming up, detailed window
+VOID APP_THREAD_REPRESENTITVE::SampleBuffer(const MEMREF *memrefs, UINT64 numElements, UINT64 instructions)
+{
+	CORE &core = cores[_tid % num_cores];
+	const double instr_per_ref = numElements ? double(instructions - _lastInstructions) / numElements : 0;
+	_lastInstructions = instructions;
+	const UINT64 window_start = sample_period - sample_window;
+	const UINT64 warmup_start = window_start - MIN2(sample_warmup, window_start);
+	for (UINT64 i=0; i<numElements; ) {
+		BatchResult batch;
+		UINT64 n;
+		if (_samplePos < warmup_start) {
+			n = MIN2(numElements - i, warmup_start - _samplePos);
+			if (KnobSampleFunctional.Value())
+				ProcessBufferCore(core, memrefs + i, n, batch, NULL, NULL, 0);
+		} else if (_samplePos < window_start) {
+			n = MIN2(numElements - i, window_start - _samplePos);
+			ProcessBufferCore(core, memrefs + i, n, batch, NULL, NULL, 0);
+		} else {
+			n = MIN2(numElements - i, sample_period - _samplePos);
+			ProcessBufferCore(core, memrefs + i, n, batch, &_window.traffic, NULL, 0);
+			_window.refs += n;
+			_window.instructions += instr_per_ref * n;
+			_window.latency += batch.latency;
+		}
+		i += n;
+		_samplePos += n;
+		if (_samplePos == sample_period) {
+			SampleWindowDone(_window, _tid);
+			THREAD_COUNTERS &counters = thread_counters[_tid];
+			counters.cycles_memref += _window.latency;
+			counters.timed_memrefs += _window.refs;
+			counters.traffic.ddr_accesses += _window.traffic.ddr_accesses;
+			counters.traffic.ddr_hits += _window.traffic.ddr_hits;
+			counters.traffic.pcm_reads += _window.traffic.pcm_reads;
+			counters.traffic.pcm_writes += _window.traffic.pcm_writes;
+			memset(&_window, 0, sizeof(_window));
+			_samplePos = 0;
+		}
+	}
+	thread_counters[_tid].num_memrefs += numElements;
+}
+
+VOID APP_THREAD_REPRESENTITVE::CaptureBuffer(const TraceRef *refs, UINT64 numElements, UINT64 timestamp, UINT64 instructions)
+{
+	_chunk.build(_tid, timestamp, instructions, refs, numElements);
+	TraceChunkHeader header;
+	memcpy(&header, _chunk.data(), sizeof(header));
+	GetLock(&trace_lock, _tid + 1);
+	if (!_chunk.write(trace_file)) {
+		fprintf(stderr, "NVRAMSIM: could not write the trace to %s\n", KnobOutputFile.Value().c_str());
+		PIN_ExitProcess(1);
+	}
+	trace_raw_bytes += header.raw_bytes;
+	trace_stored_bytes += header.stored_bytes;
+	trace_chunks++;
+	ReleaseLock(&trace_lock);
+	thread_counters[_tid].num_memrefs += numElements;
+}
+
+// a free buffer of the pool; when all buffers are queued, wait for the simulator (backpressure)
+VOID *APP_THREAD_REPRESENTITVE::NextBuffer()
+{
+	VOID *buf;
+	for (;;) {
+		if (_free.pop(buf))
+			return buf;
+		if (_allocated.size() + 1 < KnobBuffersPerThread.Value()) {
+			buf = PIN_AllocateBuffer(bufId);
+			_allocated.push_back(buf);
+			return buf;
+		}
+		PIN_SemaphoreClear(&_returned);
+		if (_free.pop(buf))
+			return buf;
+		PIN_SemaphoreWait(&_returned);
+	}
+}
+
+// called by the simulator thread; the thread may be deleted right after _inFlight drops
+VOID APP_THREAD_REPRESENTITVE::ReturnBuffer(VOID *buf)
+{
+	const BOOL pushed = _free.push(buf);
+	ASSERTX(pushed);
+	PIN_SemaphoreSet(&_returned);
+	__sync_fetch_and_sub(&_inFlight, 1);
+}
+
+// wait until the simulator is done with all queued buffers of the thread
+VOID APP_THREAD_REPRESENTITVE::Drain()
+{
+	while (_inFlight != 0)
+		PIN_Sleep(1);
+}
+
+// -rob: the instructions after the last buffer, and the cycles until all have retired
+VOID APP_THREAD_REPRESENTITVE::MlpFinish(UINT64 instructions)
+{
+	if (!_mlp)
+		return;
+	thread_counters[_tid].mlp_cycles += (UINT64)_mlp->finish(instructions - _lastInstructions);
+	_lastInstructions = instructions;
+}
+
+// Asynchronous simulation (-sim_threads): BufferFull queues the full buffer on the ring of a
+// simulator thread and the application continues with a free buffer from its pool. All
+// buffers of an application thread go to the same simulator thread, so they are simulated
+// in order.
+struct SIM_JOB
+{
+	APP_THREAD_REPRESENTITVE *thread;
+	VOID *buf;
+	UINT64 numElements;
+	UINT64 timestamp;	// of the trace chunk (-trace)
+	UINT64 instructions;
+};
+struct SIM_THREAD
+{
+	BoundedRing<SIM_JOB> jobs;
+	PIN_SEMAPHORE work;
+	PIN_THREAD_UID uid;
+};
+const size_t SIM_RING_JOBS = 1024;
+SIM_THREAD *sim_threads = NULL;
+UINT32 num_sim_threads = 0;
+volatile UINT64 sim_jobs_in_flight = 0;
+volatile BOOL sim_threads_stop = false;
+
+VOID SimThread(VOID *arg)
+{
+	SIM_THREAD *sim = static_cast<SIM_THREAD *>(arg);
+	SIM_JOB job;
+	for (;;) {
+		if (sim->jobs.pop(job)) {
+			job.thread->ProcessBuffer(job.buf, job.numElements, job.timestamp, job.instructions);
+			job.thread->ReturnBuffer(job.buf);
+			__sync_fetch_and_sub(&sim_jobs_in_flight, 1);
+			continue;
+		}
+		if (sim_threads_stop)
+			break;
+		PIN_SemaphoreClear(&sim->work);
+		if (sim->jobs.empty())
+			PIN_SemaphoreWait(&sim->work);
+	}
+}
+
+VOID CountInstr(UINT32 numInstInBbl, THREADID tid)
+{
+	thread_counters[tid].num_instr += numInstInBbl;
+}
+
+// Region of interest (-roi_*): only its instructions are counted, and only their references
+// simulated (or traced). Outside it, Trace inserts nothing but what the triggers need to see
+// it start. A change of the region removes all instrumentation from the code cache, so the
+// code is instrumented again for the new state; the triggers of analysis routines that know
+// the context also go on in the new code right away (PIN_ExecuteAt), the others at the next
+// trace. Without a trigger that starts it, the region is the whole run.
+volatile UINT32 roi_active = 1;
+volatile UINT32 roi_ended = 0;		// by -roi_length, for good
+volatile UINT32 roi_entries = 0;
+UINT64 roi_skip = 0;
+UINT64 roi_length = 0;
+volatile UINT64 roi_skipped = 0;	// instructions of the fast-forward
+volatile UINT64 roi_instructions = 0;	// counted against -roi_length
+volatile INT32 roi_routine_depth = 0;
+BOOL roi_triggered = false;		// any -roi_* knob
+// the region of interest markers (nvramsim_roi.h): xchg %rcx,%rcx with these values in rcx
+const ADDRINT ROI_MAGIC_BEGIN = 1;
+const ADDRINT ROI_MAGIC_END = 2;
+
+// true if the region changed
+BOOL RoiSet(BOOL active, const char *trigger, BOOL for_good=false)
+{
+	if (roi_ended || !__sync_bool_compare_and_swap(&roi_active, active ? 0 : 1, active ? 1 : 0))
+		return false;
+	if (for_good)
+		roi_ended = 1;
+	if (active)
+		__sync_fetch_and_add(&roi_entries, 1);
+	fprintf(stderr, "NVRAMSIM: the region of interest %s (%s)\n", active ? "starts" : "ends", trigger);
+	PIN_RemoveInstrumentation();
+	return true;
+}
+
+ADDRINT FastForward(UINT32 numInstInBbl)
+{
+	return __sync_add_and_fetch(&roi_skipped, numInstInBbl) >= roi_skip;
+}
+
+VOID FastForwardDone(CONTEXT *ctxt)
+{
+	roi_skip = 0;
+	if (RoiSet(true, "-roi_skip"))
+		PIN_ExecuteAt(ctxt);
+}
+
+ADDRINT CountInstrLimited(UINT32 numInstInBbl, THREADID tid)
+{
+	thread_counters[tid].num_instr += numInstInBbl;
+	return __sync_add_and_fetch(&roi_instructions, numInstInBbl) >= roi_length;
+}
+
+VOID RoiLengthDone(CONTEXT *ctxt)
+{
+	if (RoiSet(false, "-roi_length", true))
+		PIN_ExecuteAt(ctxt);
+}
 
-VOID CountInstr(UINT32 numInstInBbl)
+// recursive calls (of any thread) nest
+VOID RoiRoutineEnter()
 {
-	num_instr += numInstInBbl;
+	if (__sync_fetch_and_add(&roi_routine_depth, 1) == 0)
+		RoiSet(true, "-roi_routine entry");
 }
 
+VOID RoiRoutineExit()
+{
+	if (__sync_sub_and_fetch(&roi_routine_depth, 1) == 0)
+		RoiSet(false, "-roi_routine exit");
+}
+
+// the marker runs again in the new code, and then changes nothing
+VOID RoiMarker(ADDRINT value, CONTEXT *ctxt)
+{
+	if ((value == ROI_MAGIC_BEGIN || value == ROI_MAGIC_END) &&
+	    RoiSet(value == ROI_MAGIC_BEGIN, "-roi_magic marker"))
+		PIN_ExecuteAt(ctxt);
+}
+
+BOOL IsRoiMarker(INS ins)
+{
+	return INS_IsXchg(ins) && INS_OperandIsReg(ins, 0) && INS_OperandIsReg(ins, 1) &&
+	       INS_OperandReg(ins, 0) == REG_GCX && INS_OperandReg(ins, 1) == REG_GCX;
+}
+
+// the application does not see the signal
+BOOL RoiSignal(THREADID tid, INT32 sig, CONTEXT *ctxt, BOOL hasHandler, const EXCEPTION_INFO *pExceptInfo, VOID *v)
+{
+	RoiSet(sig == SIGUSR1, (sig == SIGUSR1) ? "SIGUSR1" : "SIGUSR2");
+	return false;
+}
+
+VOID Image(IMG img, VOID *v)
+{
+	RTN rtn = RTN_FindByName(img, KnobRoiRoutine.Value().c_str());
+	if (!RTN_Valid(rtn))
+		return;
+	fprintf(stderr, "NVRAMSIM: region of interest routine %s found in %s\n", KnobRoiRoutine.Value().c_str(), IMG_Name(img).c_str());
+	RTN_Open(rtn);
+	RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)RoiRoutineEnter, IARG_END);
+	RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)RoiRoutineExit, IARG_END);
+	RTN_Close(rtn);
+}
+
+
+// write a record of one memory reference of ins to the buffer; the trace also records
+// the size of the reference and the PC
+VOID InsertRecord(INS ins, IARG_TYPE ea, IARG_TYPE size, UINT32 line_state)
+{
+	if (capture) {
+		INS_InsertFillBuffer(ins, IPOINT_BEFORE, bufId,
+				     ea, offsetof(TraceRef, addr),
+				     IARG_UINT32, line_state, offsetof(TraceRef, line_state),
+				     size, offsetof(TraceRef, size),
+				     IARG_INST_PTR, offsetof(TraceRef, pc),
+				     IARG_END);
+	} else {
+		INS_InsertFillBuffer(ins, IPOINT_BEFORE, bufId,
+				     ea, offsetof(MEMREF, addr),
+				     IARG_UINT32, line_state, offsetof(MEMREF, line_state),
+				     IARG_END);
+	}
+}
 
 /*
  * Insert code to write data to a thread-specific buffer for instructions
@@ -241,42 +1002,36 @@ VOID CountInstr(UINT32 numInstInBbl)
  */
 VOID Trace(TRACE trace, VOID *v)
 {
+	const BOOL in_roi = roi_active;
 	// Insert a call to record the effective address.
 	for(BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl=BBL_Next(bbl))
 	{
 		const uint64_t num_instr_bbl = BBL_NumIns(bbl);
 		for(INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins=INS_Next(ins))
 		{
+			if (KnobRoiMagic.Value() && IsRoiMarker(ins))
+				INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)RoiMarker, IARG_REG_VALUE, REG_GCX, IARG_CONTEXT, IARG_END);
+			if (!in_roi)
+				continue;
 			// Log every memory references of the instruction
 			if (INS_IsMemoryRead(ins))
-			{
-				INS_InsertFillBuffer(ins, IPOINT_BEFORE, bufId,
-						     IARG_MEMORYREAD_EA,
-						     offsetof(struct MEMREF, ea),
-						     IARG_BOOL, true,
-						     offsetof(struct MEMREF, read),
-						     IARG_END);
-			}
+				InsertRecord(ins, IARG_MEMORYREAD_EA, IARG_MEMORYREAD_SIZE, LINE_SHR);
 			if (INS_IsMemoryWrite(ins))
-			{
-				INS_InsertFillBuffer(ins, IPOINT_BEFORE, bufId,
-						     IARG_MEMORYWRITE_EA,
-						     offsetof(struct MEMREF, ea),
-						     IARG_BOOL, false,
-						     offsetof(struct MEMREF, read),
-						     IARG_END);
-			}
+				InsertRecord(ins, IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE, LINE_MOD);
 			if (INS_HasMemoryRead2(ins))
-			{
-				INS_InsertFillBuffer(ins, IPOINT_BEFORE, bufId,
-						     IARG_MEMORYREAD2_EA,
-						     offsetof(struct MEMREF, ea),
-						     IARG_BOOL, true,
-						     offsetof(struct MEMREF, read),
-						     IARG_END);
+				InsertRecord(ins, IARG_MEMORYREAD2_EA, IARG_MEMORYREAD_SIZE, LINE_SHR);
+		}
+		if (!in_roi) {
+			if (roi_skip) {
+				BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)FastForward, IARG_UINT32, num_instr_bbl, IARG_END);
+				BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)FastForwardDone, IARG_CONTEXT, IARG_END);
 			}
+		} else if (roi_length) {
+			BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)CountInstrLimited, IARG_UINT32, num_instr_bbl, IARG_THREAD_ID, IARG_END);
+			BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)RoiLengthDone, IARG_CONTEXT, IARG_END);
+		} else {
+			BBL_InsertCall(bbl, IPOINT_ANYWHERE, (AFUNPTR)CountInstr, IARG_UINT32, num_instr_bbl, IARG_THREAD_ID, IARG_END);
 		}
-		BBL_InsertCall(bbl, IPOINT_ANYWHERE, (AFUNPTR)CountInstr, IARG_UINT32, num_instr_bbl, IARG_END);
 	}
 }
 
@@ -302,14 +1057,34 @@ VOID * BufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf,
 		  UINT64 numElements, VOID *v)
 {
 	APP_THREAD_REPRESENTITVE * appThreadRepresentitive = static_cast<APP_THREAD_REPRESENTITVE*>( PIN_GetThreadData( appThreadRepresentitiveKey, tid ) );
-	appThreadRepresentitive->ProcessBuffer(buf, numElements);
-	return buf;
+	const UINT64 timestamp = capture ? TraceTimestamp() : 0;
+	if (num_sim_threads == 0) {
+		appThreadRepresentitive->ProcessBuffer(buf, numElements, timestamp, thread_counters[tid].num_instr);
+		return buf;
+	}
+	SIM_THREAD &sim = sim_threads[tid % num_sim_threads];
+	SIM_JOB job;
+	job.thread = appThreadRepresentitive;
+	job.buf = buf;
+	job.numElements = numElements;
+	job.timestamp = timestamp;
+	job.instructions = thread_counters[tid].num_instr;
+	appThreadRepresentitive->BufferQueued();
+	__sync_fetch_and_add(&sim_jobs_in_flight, 1);
+	while (!sim.jobs.push(job))
+		PIN_Yield();
+	PIN_SemaphoreSet(&sim.work);
+	return appThreadRepresentitive->NextBuffer();
 }
 
 
 
 VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
 {
+	if (tid >= MAX_THREADS) {
+		fprintf(stderr, "NVRAMSIM: more than %u threads are not supported\n", MAX_THREADS);
+		PIN_ExitProcess(1);
+	}
 	// There is a new APP_THREAD_REPRESENTITVE for every thread.
 	APP_THREAD_REPRESENTITVE * appThreadRepresentitive = new APP_THREAD_REPRESENTITVE(tid);
 
@@ -321,21 +1096,95 @@ VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
 VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
 {
 	APP_THREAD_REPRESENTITVE * appThreadRepresentitive = static_cast<APP_THREAD_REPRESENTITVE*>(PIN_GetThreadData(appThreadRepresentitiveKey, tid));
-	totalBuffersFilled += appThreadRepresentitive->NumBuffersFilled();
-	totalElementsProcessed +=  appThreadRepresentitive->NumElementsProcessed();
+	appThreadRepresentitive->Drain();
+	appThreadRepresentitive->MlpFinish(thread_counters[tid].num_instr);
+	thread_counters[tid].buffers_filled += appThreadRepresentitive->NumBuffersFilled();
+	thread_counters[tid].elements_processed += appThreadRepresentitive->NumElementsProcessed();
 
 	delete appThreadRepresentitive;
 
 	PIN_SetThreadData(appThreadRepresentitiveKey, 0, tid);
 }
 
+// the workers have to exit before the application does; the simulator threads first
+// finish the buffers that are still queued (and they may need the shard workers for it)
+VOID WorkersStop(INT32 code, VOID *v)
+{
+	while (sim_jobs_in_flight != 0)
+		PIN_Sleep(1);
+	sim_threads_stop = true;
+	for (UINT32 sim=0; sim<num_sim_threads; sim++) {
+		PIN_SemaphoreSet(&sim_threads[sim].work);
+		PIN_WaitForThreadTermination(sim_threads[sim].uid, PIN_INFINITE_TIMEOUT, NULL);
+	}
+	shard_workers_stop = true;
+	for (UINT32 shard=1; sharded && shard<sharded->num_shards(); shard++) {
+		PIN_SemaphoreSet(&shard_workers[shard].go);
+		PIN_WaitForThreadTermination(shard_workers[shard].uid, PIN_INFINITE_TIMEOUT, NULL);
+	}
+}
+
 VOID Fini(INT32 code, VOID *v)
 {
-	stats_print();
+	for (UINT32 tid=0; tid<MAX_THREADS; tid++) {
+		num_instr += thread_counters[tid].num_instr;
+		num_memrefs += thread_counters[tid].num_memrefs;
+		cycles_memref += thread_counters[tid].cycles_memref;
+		totalBuffersFilled += thread_counters[tid].buffers_filled;
+		totalElementsProcessed += thread_counters[tid].elements_processed;
+	}
+	if (capture) {
+		fclose(trace_file);
+		fprintf(stderr, "NVRAMSIM: traced %lu instructions, %lu references in %lu chunks to %s: %lu bytes encoded, %lu bytes stored\n",
+			num_instr, num_memrefs, trace_chunks, KnobOutputFile.Value().c_str(), trace_raw_bytes, trace_stored_bytes);
+	} else {
+		if (sharded)
+			sharded->merge_stats();
+		if (sample_period) {
+			// only the detailed windows were measured
+			cycles_memref = (uint64_t)(sample_latency.ratio()*num_memrefs);
+			sample_print(stderr);
+		}
+		if (rob_size) {
+			// the memory cycles are only those that the cores did not hide
+			double cycles = 0;
+			for (UINT32 tid=0; tid<MAX_THREADS; tid++)
+				cycles += thread_counters[tid].mlp_cycles;
+			cycles_memref = (uint64_t)MAX2(cycles - InstrCycles*num_instr, 0.0);
+		}
+		stats_print();
+		if (profiler)
+			profile_print();
+	}
+	if (roi_triggered)
+		fprintf(stderr, "NVRAMSIM: the region of interest started %u times; %lu instructions fast-forwarded\n",
+			roi_entries, roi_skipped);
 	printf ("totalBuffersFilled %u  totalElementsProcessed %14.0f\n", (totalBuffersFilled),
 		static_cast<double>(totalElementsProcessed));
 }
 
+BOOL set_repl_policy(Cache &cache, const char *level, const string &name)
+{
+	ReplPolicy policy;
+	if (!str2repl_policy(name.c_str(), policy)) {
+		fprintf(stderr, "NVRAMSIM: unknown replacement policy '%s' for %s\n", name.c_str(), level);
+		return false;
+	}
+	cache.set_repl_policy(policy);
+	return true;
+}
+
+BOOL set_inclusion(Cache &cache, const char *level, const string &name)
+{
+	InclusionPolicy policy;
+	if (!str2inclusion(name.c_str(), policy)) {
+		fprintf(stderr, "NVRAMSIM: unknown inclusion policy '%s' for %s\n", name.c_str(), level);
+		return false;
+	}
+	cache.set_inclusion(policy);
+	return true;
+}
+
 INT32 Usage()
 {
 	puts("\nThis tool estimates the execution time, using a simple memory model\n");
@@ -355,6 +1204,182 @@ int main(int argc, char * argv[])
 	}
 	PIN_InitSymbols();
 
+	num_cores = KnobCores.Value();
+	if (num_cores < 1 || num_cores > MAX_CORES) {
+		fprintf(stderr, "NVRAMSIM: the number of cores has to be 1 to %u\n", MAX_CORES);
+		return Usage();
+	}
+	if (KnobShards.Value() > 1 && num_cores != 1) {
+		fprintf(stderr, "NVRAMSIM: sharded simulation needs -cores 1\n");
+		return Usage();
+	}
+	// all cores are connected before the first access; their sets are only allocated when used
+	for (UINT32 core=0; core<num_cores; core++) {
+		stringstream name;
+		name << "core " << core;
+		cores[core].L2 = new L2_t("L2 " + name.str(), &DDR, L2Latency, IS_WRITEBACK_CACHE);
+		cores[core].L1 = new L1_t("L1 " + name.str(), cores[core].L2, L1Latency, IS_WRITEBACK_CACHE);
+		cores[core].walk = new CORE_walk_t(*cores[core].L1,
+			L2_walk_t(*cores[core].L2, DDR_walk_t(DDR, StaticHierarchy<PcmMemory>(PCM))));
+		PIN_MutexInit(&cores[core].lock);
+		cores[core].wanted = 0;
+		if (!set_repl_policy(*cores[core].L1, "L1", KnobL1Repl.Value()) ||
+		    !set_repl_policy(*cores[core].L2, "L2", KnobL2Repl.Value()))
+		{
+			return Usage();
+		}
+	}
+	PIN_MutexInit(&ddr_lock);
+	if (!set_repl_policy(DDR, "DDR", KnobDDRRepl.Value()))
+	{
+		return Usage();
+	}
+	// only hits, misses and writebacks are simulated, ProcessBuffer never reads line data
+	DDR.set_sector_size(DDR_sector_bytes);
+	DDR.set_tag_only(true);
+	// an exclusive DDR cache needs DDR sectors of the L2 line size, set above
+	for (UINT32 core=0; core<num_cores; core++) {
+		if (!set_inclusion(*cores[core].L2, "L2", KnobL2Incl.Value()))
+			return Usage();
+	}
+	if (!set_inclusion(DDR, "DDR", KnobDDRIncl.Value()))
+	{
+		return Usage();
+	}
+	if (KnobShards.Value() > 1) {
+		const UINT32 num_shards = KnobShards.Value();
+		if (!is_power_of_2(num_shards)) {
+			fprintf(stderr, "NVRAMSIM: the number of shards has to be a power of 2\n");
+			return Usage();
+		}
+		sharded = new ShardedHierarchy(cores[0].L1, num_shards);
+		InitLock(&sharded_lock);
+		shard_workers = new SHARD_WORKER[num_shards];
+		for (UINT32 shard=1; shard<num_shards; shard++) {
+			shard_workers[shard].shard = shard;
+			PIN_SemaphoreInit(&shard_workers[shard].go);
+			PIN_SemaphoreInit(&shard_workers[shard].done);
+			if (PIN_SpawnInternalThread(ShardWorker, &shard_workers[shard], 0, &shard_workers[shard].uid) == INVALID_THREADID) {
+				fprintf(stderr, "NVRAMSIM: could not start the worker thread of shard %u\n", shard);
+				return 1;
+			}
+		}
+	}
+	sample_period = KnobSamplePeriod.Value();
+	if (sample_period) {
+		sample_window = KnobSampleWindow.Value();
+		sample_warmup = KnobSampleWarmup.Value();
+		if (sample_window == 0 || sample_window > sample_period) {
+			fprintf(stderr, "NVRAMSIM: the sample window has to be 1 to -sample_period references\n");
+			return Usage();
+		}
+		if (sharded) {
+			fprintf(stderr, "NVRAMSIM: -sample_period does not work with -shards\n");
+			return Usage();
+		}
+		if (!KnobProfileLevel.Value().empty()) {
+			fprintf(stderr, "NVRAMSIM: -profile_level needs all references, not -sample_period\n");
+			return Usage();
+		}
+		InitLock(&sample_lock);
+	}
+	if (KnobPcmBanks.Value()) {
+		PcmConfig config;
+		config.channels = KnobPcmChannels.Value();
+		config.ranks = KnobPcmRanks.Value();
+		config.banks = KnobPcmBanks.Value();
+		config.row_bytes = KnobPcmRowBytes.Value();
+		config.access_bytes = DDR_sector_bytes;
+		config.t_column = KnobPcmTColumn.Value();
+		config.t_read = KnobPcmTRead.Value();
+		config.t_reset = KnobPcmTReset.Value();
+		config.t_set = KnobPcmTSet.Value();
+		config.t_burst = KnobPcmTBurst.Value();
+		config.set_iterations = MAX2(KnobPcmSetIterations.Value(), 1U);
+		config.write_queue = KnobPcmWriteQueue.Value();
+		config.write_high = KnobPcmWriteHigh.Value();
+		config.write_low = KnobPcmWriteLow.Value();
+		if (config.write_queue && !(config.write_low < config.write_high && config.write_high <= config.write_queue)) {
+			fprintf(stderr, "NVRAMSIM: the PCM write queue watermarks have to be low < high <= entries\n");
+			return Usage();
+		}
+		if (!str2pcm_write_policy(KnobPcmWritePolicy.Value().c_str(), config.write_policy)) {
+			fprintf(stderr, "NVRAMSIM: unknown PCM write policy '%s' (wait, pause, cancel)\n", KnobPcmWritePolicy.Value().c_str());
+			return Usage();
+		}
+		if (!is_power_of_2(config.channels) || !is_power_of_2(config.ranks) || !is_power_of_2(config.banks) ||
+		    config.channels == 0 || config.ranks == 0 || !is_power_of_2(config.row_bytes) || config.row_bytes < config.access_bytes) {
+			fprintf(stderr, "NVRAMSIM: the PCM channels, ranks, banks and row bytes have to be powers of 2, the rows at least %lu bytes\n",
+				config.access_bytes);
+			return Usage();
+		}
+		if (!str2pcm_map(KnobPcmMap.Value().c_str(), config.map)) {
+			fprintf(stderr, "NVRAMSIM: the PCM map has to have each of row, rank, bank, channel and column once, separated by ':'\n");
+			return Usage();
+		}
+		if (KnobPcmPage.Value() != "open" && KnobPcmPage.Value() != "closed") {
+			fprintf(stderr, "NVRAMSIM: unknown PCM page policy '%s' (open, closed)\n", KnobPcmPage.Value().c_str());
+			return Usage();
+		}
+		config.open_page = (KnobPcmPage.Value() == "open");
+		if (sharded) {
+			// the shards replicate the flat PCM
+			fprintf(stderr, "NVRAMSIM: -pcm_banks does not work with -shards\n");
+			return Usage();
+		}
+		PCM.configure(config);
+	}
+	rob_size = KnobRob.Value();
+	if (rob_size) {
+		if (sharded || sample_period) {
+			// the model needs every reference of a thread, in order, on its core
+			fprintf(stderr, "NVRAMSIM: -rob does not work with -shards or -sample_period\n");
+			return Usage();
+		}
+		mshrs[0] = KnobMshrL1.Value();
+		mshrs[1] = KnobMshrL2.Value();
+		mshrs[2] = KnobMshrDDR.Value();
+	}
+	if (!KnobProfileLevel.Value().empty()) {
+		const string &level = KnobProfileLevel.Value();
+		profiled_cache = (level == "l1") ? (Cache *)cores[0].L1 : (level == "l2") ? (Cache *)cores[0].L2 :
+				 (level == "ddr") ? (Cache *)&DDR : NULL;
+		if (!profiled_cache) {
+			fprintf(stderr, "NVRAMSIM: unknown level '%s' to profile (l1, l2, ddr)\n", level.c_str());
+			return Usage();
+		}
+		if (sharded) {
+			// the shards are replicas of the caches, which do not profile
+			fprintf(stderr, "NVRAMSIM: -profile_level does not work with -shards\n");
+			return Usage();
+		}
+		const double rate = KnobProfileSample.Value();
+		if (!(rate > 0 && rate <= 1) || !is_power_of_2(KnobProfileWays.Value())) {
+			fprintf(stderr, "NVRAMSIM: the profile sample rate has to be in (0, 1], its associativity a power of 2\n");
+			return Usage();
+		}
+		profiler = new StackDistance(profiled_cache->_line_size_bytes, rate);
+		profiled_cache->set_profiler(profiler);
+	}
+	// the threads of a core go to the same simulator thread (both by thread id modulo), so a
+	// simulator thread per core keeps them all busy without sharing a core's private caches
+	num_sim_threads = (KnobSimThreads.Value() < 0) ? num_cores : KnobSimThreads.Value();
+	if (num_sim_threads > 0 && KnobBuffersPerThread.Value() < 2) {
+		fprintf(stderr, "NVRAMSIM: asynchronous simulation needs at least 2 buffers per thread\n");
+		return Usage();
+	}
+	sim_threads = new SIM_THREAD[num_sim_threads];
+	for (UINT32 sim=0; sim<num_sim_threads; sim++) {
+		sim_threads[sim].jobs.init(SIM_RING_JOBS);
+		PIN_SemaphoreInit(&sim_threads[sim].work);
+		if (PIN_SpawnInternalThread(SimThread, &sim_threads[sim], 0, &sim_threads[sim].uid) == INVALID_THREADID) {
+			fprintf(stderr, "NVRAMSIM: could not start simulator thread %u\n", sim);
+			return 1;
+		}
+	}
+	PIN_AddFiniUnlockedFunction(WorkersStop, 0);
+	footprint_print(stderr, "startup");
+
 	if (!getcwd(base_directory, sizeof(base_directory)))
 		perror("getcwd() error");
 
@@ -371,7 +1396,16 @@ int main(int argc, char * argv[])
 		}
 	}
 
-	bufId = PIN_DefineTraceBuffer(sizeof(struct MEMREF), KnobNumPagesInBuffer,
+	capture = KnobTrace.Value();
+	if (capture) {
+		trace_file = fopen(KnobOutputFile.Value().c_str(), "wb");
+		if (!trace_file || !trace_write_header(trace_file)) {
+			fprintf(stderr, "NVRAMSIM: could not open the trace file %s\n", KnobOutputFile.Value().c_str());
+			return 1;
+		}
+		InitLock(&trace_lock);
+	}
+	bufId = PIN_DefineTraceBuffer(capture ? sizeof(TraceRef) : sizeof(MEMREF), KnobNumPagesInBuffer,
 				      BufferFull, 0);
 
 	if(bufId == BUFFER_ID_INVALID)
@@ -383,6 +1417,20 @@ int main(int argc, char * argv[])
 	// Initialize thread-specific data not handled by buffering api.
 	appThreadRepresentitiveKey = PIN_CreateThreadDataKey(0);
 
+	roi_skip = KnobRoiSkip.Value();
+	roi_length = KnobRoiLength.Value();
+	if (roi_skip || !KnobRoiRoutine.Value().empty() || KnobRoiMagic.Value() || KnobRoiSignal.Value())
+		roi_active = 0;
+	roi_triggered = !roi_active || roi_length;
+	if (!KnobRoiRoutine.Value().empty())
+		IMG_AddInstrumentFunction(Image, 0);
+	if (KnobRoiSignal.Value()) {
+		PIN_InterceptSignal(SIGUSR1, RoiSignal, 0);
+		PIN_InterceptSignal(SIGUSR2, RoiSignal, 0);
+		PIN_UnblockSignal(SIGUSR1, true);
+		PIN_UnblockSignal(SIGUSR2, true);
+	}
+
 	// add an instrumentation function
 	TRACE_AddInstrumentFunction(Trace, 0);
 
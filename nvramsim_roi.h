@@ -0,0 +1,12 @@
+/*
+ * Region of interest markers for nvramsim -roi_magic: the simulation starts at
+ * NVRAMSIM_ROI_BEGIN() and ends at NVRAMSIM_ROI_END(), in any thread. Outside Pin
+ * the markers do nothing (xchg of a register with itself).
+ */
+#ifndef __NVRAMSIM_ROI_H__
+#define __NVRAMSIM_ROI_H__
+
+#define NVRAMSIM_ROI_BEGIN() __asm__ __volatile__ ("xchg %%rcx, %%rcx" : : "c" (1) : "memory")
+#define NVRAMSIM_ROI_END()   __asm__ __volatile__ ("xchg %%rcx, %%rcx" : : "c" (2) : "memory")
+
+#endif //__NVRAMSIM_ROI_H__